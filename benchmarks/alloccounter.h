@@ -0,0 +1,69 @@
+/*!
+ * \file
+ * \brief     CerQall benchmarks - heap allocation counter
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * This header replaces the global operator new and delete, so it must be included by exactly one
+ * translation unit of a benchmark executable.
+ */
+
+#ifndef CERQALL_ALLOCCOUNTER_H
+#define CERQALL_ALLOCCOUNTER_H
+
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+
+namespace cerqall_bench {
+
+/**
+ * Number of heap allocations made by the calling thread.
+ */
+inline uint64_t& thread_allocations()
+{
+    static thread_local uint64_t count = 0;
+    return count;
+}
+
+}   //namespace cerqall_bench
+
+void* operator new(std::size_t size)
+{
+    ++cerqall_bench::thread_allocations();
+    void* p = std::malloc(size != 0 ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+#endif //CERQALL_ALLOCCOUNTER_H
@@ -0,0 +1,126 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - clock service alarm scheduling
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Sets a large number of alarms spread over a day in the AlarmScheduler of the clock service, cancels half
+ * of them and runs the clock to the end of the day, reporting the cost of each operation. The same set and
+ * cancel operations are run on the former list of alarms with one QTimer each ("legacy"), with fewer alarms.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include <QTimer>
+#include <list>
+#include <random>
+#include "alarmscheduler.h"
+
+using namespace cerqall_bench;
+using std::chrono::milliseconds;
+
+namespace {
+
+const qint64 DayMs = 24 * 3600 * 1000;
+
+std::vector<milliseconds> random_delays(int count)
+{
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<qint64> dist(0, DayMs);
+    std::vector<milliseconds> delays;
+    delays.reserve(static_cast<size_t>(count));
+    for (int i = 0; i < count; ++i) {
+        delays.emplace_back(dist(rng));
+    }
+    return delays;
+}
+
+QJsonObject run_wheel(int count)
+{
+    std::vector<milliseconds> delays = random_delays(count);
+    uint64_t fired = 0;
+    AlarmScheduler<qint32, QString> alarms([&fired](const qint32&, QString&&) { ++fired; });
+    const QString tag("alarm");
+
+    auto start = Clock::now();
+    for (int i = 0; i < count; ++i) {
+        alarms.set(i, tag, delays[static_cast<size_t>(i)]);
+    }
+    double setSecs = elapsed_sec(start);
+
+    start = Clock::now();
+    for (int i = 0; i < count; i += 2) {
+        alarms.cancel(i);
+    }
+    double cancelSecs = elapsed_sec(start);
+
+    start = Clock::now();
+    alarms.advance_to(alarms.elapsed() + milliseconds(DayMs + 1000));
+    double fireSecs = elapsed_sec(start);
+
+    QJsonObject result;
+    result["alarms"] = count;
+    result["set_nsec"] = setSecs * 1e9 / count;
+    result["cancel_nsec"] = cancelSecs * 1e9 / ((count + 1) / 2);
+    result["fire_nsec"] = fired > 0 ? fireSecs * 1e9 / fired : 0.0;
+    result["fired"] = static_cast<double>(fired);
+    result["left"] = static_cast<double>(alarms.size());
+    return result;
+}
+
+struct LegacyAlarm
+{
+    QTimer myTimer;
+    QString myTag;
+    qint32 myId;
+};
+
+QJsonObject run_legacy(int count)
+{
+    std::vector<milliseconds> delays = random_delays(count);
+    std::list<LegacyAlarm> alarms;
+    const QString tag("alarm");
+
+    auto start = Clock::now();
+    for (int i = 0; i < count; ++i) {
+        alarms.emplace_back();
+        LegacyAlarm& alarm = alarms.back();
+        alarm.myTag = tag;
+        alarm.myId = i;
+        alarm.myTimer.setSingleShot(true);
+        alarm.myTimer.start(delays[static_cast<size_t>(i)]);
+    }
+    double setSecs = elapsed_sec(start);
+
+    start = Clock::now();
+    for (int i = 0; i < count; i += 2) {
+        auto it = std::find_if(alarms.begin(), alarms.end(), [i](const LegacyAlarm& a) { return a.myId == i; });
+        alarms.erase(it);
+    }
+    double cancelSecs = elapsed_sec(start);
+
+    QJsonObject result;
+    result["alarms"] = count;
+    result["set_nsec"] = setSecs * 1e9 / count;
+    result["cancel_nsec"] = cancelSecs * 1e9 / ((count + 1) / 2);
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_alarms";
+
+    int alarms = int_option("alarms", 1000000);
+    int legacyAlarms = int_option("legacy-alarms", 20000);
+    Report report("alarms");
+    report.add(QString("legacy/%1").arg(legacyAlarms), run_legacy(legacyAlarms));
+    report.add(QString("wheel/%1").arg(legacyAlarms), run_wheel(legacyAlarms));
+    report.add(QString("wheel/%1").arg(alarms), run_wheel(alarms));
+    return report.write();
+}
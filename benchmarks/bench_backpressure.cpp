@@ -0,0 +1,167 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - write flow control with slow consumers
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Events are broadcast to the server-side TcpTransports of a number of loopback clients which read all they
+ * get ("fast") and of a few which read nothing ("slow"). For each overflow policy, and without flow control
+ * ("unbounded": no watermark and no queue limit), the peak of the bytes held for one slow and one fast client
+ * is reported, with the number of events the slow clients lost and the data the fast clients received.
+ * The "conflation" run broadcasts with conflation on, so that a slow client holds at most one event.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include <QTcpServer>
+#include <limits>
+#include <thread>
+#include "loopback.h"
+#include "cercall/qt/tcptransport.h"
+
+using namespace cerqall_bench;
+using cercall::qt::TcpTransport;
+
+namespace {
+
+int connect_silent(quint16 port)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    int rcvbuf = 16 * 1024;
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+std::vector<std::shared_ptr<TcpTransport>> accept_transports(QTcpServer& server, int count, FrameCounter& listener,
+                                                             const TcpTransport::FlowControl& flow)
+{
+    std::vector<std::shared_ptr<TcpTransport>> transports;
+    while (static_cast<int>(transports.size()) < count && server.waitForNewConnection(5000)) {
+        while (QTcpSocket* sock = server.nextPendingConnection()) {
+            transports.push_back(std::make_shared<TcpTransport>(sock));
+            transports.back()->set_listener(&listener);
+            transports.back()->set_flow_control(flow);
+        }
+    }
+    return transports;
+}
+
+QJsonObject run(const TcpTransport::FlowControl& flow, bool conflate, int fastClients, int slowClients,
+                int frameSize, int durationMs)
+{
+    QTcpServer server;
+    server.setMaxPendingConnections(fastClients + slowClients);
+    server.listen(QHostAddress::LocalHost);
+    FrameCounter listener(static_cast<uint32_t>(frameSize));
+
+    std::vector<int> silent;
+    for (int i = 0; i < slowClients; ++i) {
+        silent.push_back(connect_silent(server.serverPort()));
+    }
+    std::vector<std::shared_ptr<TcpTransport>> slow = accept_transports(server, slowClients, listener, flow);
+
+    std::atomic<uint64_t> received { 0 };
+    std::thread reader(sink, server.serverPort(), fastClients, std::ref(received));
+    std::vector<std::shared_ptr<TcpTransport>> fast = accept_transports(server, fastClients, listener, flow);
+
+    const std::string frame(static_cast<size_t>(frameSize), 'e');
+    size_t peakSlow = 0u;
+    size_t peakFast = 0u;
+    uint64_t broadcasts = 0u;
+    auto start = Clock::now();
+    while (elapsed_sec(start) * 1000 < durationMs) {
+        {
+            cercall::qt::BroadcastScope scope;
+            scope.set_event_key(1u);
+            scope.set_conflation(conflate);
+            for (auto* group : { &slow, &fast }) {
+                for (auto& tr : *group) {
+                    if (tr->is_open()) {
+                        tr->write(frame);
+                    }
+                }
+            }
+        }
+        ++broadcasts;
+        for (auto& tr : slow) {
+            peakSlow = std::max(peakSlow, tr->pending_bytes());
+        }
+        for (auto& tr : fast) {
+            peakFast = std::max(peakFast, tr->pending_bytes());
+        }
+        QCoreApplication::processEvents();
+    }
+
+    uint64_t dropped = 0u;
+    uint64_t conflated = 0u;
+    int disconnected = 0;
+    for (auto& tr : slow) {
+        dropped += tr->dropped_events();
+        conflated += tr->conflated_events();
+        disconnected += tr->is_open() ? 0 : 1;
+    }
+    slow.clear();
+    fast.clear();
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    reader.join();
+    for (int fd : silent) {
+        ::close(fd);
+    }
+
+    QJsonObject result;
+    result["fast_clients"] = fastClients;
+    result["slow_clients"] = slowClients;
+    result["frame_size"] = frameSize;
+    result["broadcasts"] = static_cast<double>(broadcasts);
+    result["peak_slow_pending_kb"] = peakSlow / 1024.0;
+    result["peak_fast_pending_kb"] = peakFast / 1024.0;
+    result["slow_dropped_events"] = static_cast<double>(dropped);
+    result["slow_conflated_events"] = static_cast<double>(conflated);
+    result["slow_disconnected"] = disconnected;
+    result["fast_mb_received"] = received.load() / 1e6;
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_backpressure";
+
+    int durationMs = int_option("duration-ms", 2000);
+    int frameSize = int_option("frame-size", 256);
+    int fastClients = int_option("fast-clients", 20);
+    int slowClients = int_option("slow-clients", 2);
+
+    TcpTransport::FlowControl unbounded;
+    unbounded.myHighWatermark = std::numeric_limits<qint64>::max();
+    unbounded.myLowWatermark = unbounded.myHighWatermark;
+    unbounded.myMaxQueuedBytes = std::numeric_limits<size_t>::max() / 2;
+
+    Report report("backpressure");
+    report.add("unbounded", run(unbounded, false, fastClients, slowClients, frameSize, durationMs));
+    const std::pair<const char*, TcpTransport::OverflowPolicy> policies[] = {
+        { "drop_oldest", TcpTransport::OverflowPolicy::DropOldest },
+        { "conflate", TcpTransport::OverflowPolicy::Conflate },
+        { "disconnect", TcpTransport::OverflowPolicy::Disconnect }
+    };
+    for (const auto& policy : policies) {
+        TcpTransport::FlowControl flow;
+        flow.myPolicy = policy.second;
+        report.add(policy.first, run(flow, false, fastClients, slowClients, frameSize, durationMs));
+    }
+    report.add("conflation", run(TcpTransport::FlowControl {}, true, fastClients, slowClients, frameSize, durationMs));
+    return report.write();
+}
@@ -0,0 +1,99 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - event broadcast fan-out
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * The same event frame is written to every server-side TcpTransport of a number of loopback clients, the way
+ * a service broadcasts an event, once with a copy per transport ("copy") and once within a BroadcastScope
+ * ("shared"). The CPU cost and heap allocations of one broadcast are reported against the number of clients.
+ */
+
+#include "debug.h"
+#include "alloccounter.h"
+#include "benchutil.h"
+#include <QTcpServer>
+#include <thread>
+#include "loopback.h"
+#include "cercall/qt/tcptransport.h"
+
+using namespace cerqall_bench;
+using cercall::qt::TcpTransport;
+
+namespace {
+
+QJsonObject run(bool shared, int clients, int frameSize, int durationMs)
+{
+    QTcpServer server;
+    server.setMaxPendingConnections(clients);
+    server.listen(QHostAddress::LocalHost);
+    std::atomic<uint64_t> received { 0 };
+    std::thread reader(sink, server.serverPort(), clients, std::ref(received));
+
+    FrameCounter listener(static_cast<uint32_t>(frameSize));
+    std::vector<std::shared_ptr<TcpTransport>> transports;
+    while (static_cast<int>(transports.size()) < clients && server.waitForNewConnection(5000)) {
+        while (QTcpSocket* sock = server.nextPendingConnection()) {
+            transports.push_back(std::make_shared<TcpTransport>(sock));
+            transports.back()->set_listener(&listener);
+        }
+    }
+
+    const std::string frame(static_cast<size_t>(frameSize), 'e');
+    uint64_t broadcasts = 0;
+    double busySecs = 0.0;
+    uint64_t allocs = 0;
+    auto start = Clock::now();
+    while (elapsed_sec(start) * 1000 < durationMs) {
+        uint64_t allocsBefore = thread_allocations();
+        auto broadcastStart = Clock::now();
+        if (shared) {
+            cercall::qt::BroadcastScope scope;
+            for (auto& tr : transports) {
+                tr->write(frame);
+            }
+        } else {
+            for (auto& tr : transports) {
+                tr->write(frame);
+            }
+        }
+        busySecs += elapsed_sec(broadcastStart);
+        allocs += thread_allocations() - allocsBefore;
+        ++broadcasts;
+        QCoreApplication::processEvents();
+    }
+
+    transports.clear();
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    reader.join();
+
+    QJsonObject result;
+    result["clients"] = clients;
+    result["frame_size"] = frameSize;
+    result["broadcasts"] = static_cast<double>(broadcasts);
+    result["usec_per_broadcast"] = broadcasts > 0 ? busySecs * 1e6 / broadcasts : 0.0;
+    result["nsec_per_client"] = broadcasts > 0 ? busySecs * 1e9 / broadcasts / clients : 0.0;
+    result["allocs_per_broadcast"] = broadcasts > 0 ? static_cast<double>(allocs) / broadcasts : 0.0;
+    result["mb_received"] = received.load() / 1e6;
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_broadcast";
+
+    int durationMs = int_option("duration-ms", 2000);
+    int frameSize = int_option("frame-size", 128);
+    Report report("broadcast");
+    for (int clients : { 1, 10, 100, 500 }) {
+        report.add(QString("copy/%1").arg(clients), run(false, clients, frameSize, durationMs));
+        report.add(QString("shared/%1").arg(clients), run(true, clients, frameSize, durationMs));
+    }
+    return report.write();
+}
@@ -0,0 +1,139 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - message compression
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Sends messages from one CompressingTransport to another over loopback, both on the main thread, with
+ * compression off, with zlib and, if built with LZ4, with LZ4. The messages are either compressible
+ * (serialized records with repeating field names) or random bytes. For each run the payload throughput, the
+ * ratio of the bytes on the wire to the payload and the CPU time spent per megabyte, on both ends, are reported.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include <QTcpServer>
+#include <ctime>
+#include <random>
+#include "loopback.h"
+#include "cercall/qt/compressingtransport.h"
+
+using namespace cerqall_bench;
+using cercall::qt::Codec;
+using cercall::qt::CompressingTransport;
+using cercall::qt::CompressionOptions;
+using cercall::qt::TcpTransport;
+
+namespace {
+
+std::string compressible_message(int size)
+{
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist(0, 99999);
+    std::string msg;
+    while (static_cast<int>(msg.size()) < size) {
+        msg += "{\"alarm\":" + std::to_string(dist(rng)) + ",\"tag\":\"wake-up\",\"after\":\""
+                + std::to_string(dist(rng) % 24) + ":" + std::to_string(dist(rng) % 60) + "\"}";
+    }
+    msg.resize(static_cast<size_t>(size));
+    return msg;
+}
+
+std::string random_message(int size)
+{
+    std::mt19937 rng(42);
+    std::string msg(static_cast<size_t>(size), '\0');
+    for (char& c : msg) {
+        c = static_cast<char>(rng());
+    }
+    return msg;
+}
+
+QJsonObject run(const CompressionOptions& options, const std::string& msg, int durationMs)
+{
+    QTcpServer server;
+    server.listen(QHostAddress::LocalHost);
+    FrameCounter listener(static_cast<uint32_t>(msg.size()));
+
+    auto clientTcp = std::make_shared<TcpTransport>(QHostAddress::LocalHost, server.serverPort());
+    CompressingTransport client(clientTcp, options);
+    client.set_listener(&listener);
+    if ( !client.open() || !server.waitForNewConnection(5000)) {
+        return QJsonObject {};
+    }
+    CompressingTransport service(std::make_shared<TcpTransport>(server.nextPendingConnection()), options);
+    service.set_listener(&listener);
+    service.read(static_cast<uint32_t>(msg.size()));
+
+    //The codec is known once the hello of the other end has arrived.
+    auto start = Clock::now();
+    while (client.codec() == Codec::None && (options.myZlib || options.myLz4) && elapsed_sec(start) < 1.0) {
+        QCoreApplication::processEvents();
+    }
+
+    uint64_t sent = 0u;
+    std::clock_t cpuStart = std::clock();
+    start = Clock::now();
+    while (elapsed_sec(start) * 1000 < durationMs) {
+        while (clientTcp->pending_bytes() < 1024u * 1024u) {
+            client.write(msg);
+            ++sent;
+        }
+        QCoreApplication::processEvents();
+    }
+    while (listener.myFrames < sent && elapsed_sec(start) * 1000 < durationMs + 5000) {
+        QCoreApplication::processEvents();
+    }
+    double secs = elapsed_sec(start);
+    double cpuSecs = static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+    double mb = listener.myFrames * msg.size() / 1e6;
+
+    QJsonObject result;
+    result["codec"] = static_cast<int>(client.codec());
+    result["message_size"] = static_cast<int>(msg.size());
+    result["messages"] = static_cast<double>(listener.myFrames);
+    result["lost"] = static_cast<double>(sent - listener.myFrames);
+    result["payload_mb_per_sec"] = mb / secs;
+    result["wire_ratio"] = client.message_bytes() > 0u
+            ? static_cast<double>(client.frame_bytes()) / client.message_bytes() : 0.0;
+    result["cpu_msec_per_mb"] = mb > 0.0 ? cpuSecs * 1000 / mb : 0.0;
+    client.close();
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_compression";
+
+    int durationMs = int_option("duration-ms", 2000);
+    int messageSize = int_option("message-size", 16384);
+
+    CompressionOptions off;
+    off.myZlib = off.myLz4 = false;
+    CompressionOptions zlib;
+    zlib.myLz4 = false;
+    std::vector<std::pair<QString, CompressionOptions>> codecs = { { "off", off }, { "zlib", zlib } };
+#ifdef HAS_LZ4
+    CompressionOptions lz4;
+    lz4.myZlib = false;
+    codecs.emplace_back("lz4", lz4);
+#endif
+
+    const std::pair<QString, std::string> data[] = {
+        { "compressible", compressible_message(messageSize) },
+        { "incompressible", random_message(messageSize) }
+    };
+    Report report("compression");
+    for (const auto& d : data) {
+        for (const auto& codec : codecs) {
+            report.add(d.first + "/" + codec.first, run(codec.second, d.second, durationMs));
+        }
+    }
+    return report.write();
+}
@@ -0,0 +1,187 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - connect storm
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * A thread opens a large number of loopback connections at once, as the clients of a service do when they
+ * all come back after a failover, and the time until the acceptor has handed all of them to its listener,
+ * or turned them down, is measured. The TcpAcceptor, which takes all pending connections per wakeup, is
+ * compared with taking one connection per newConnection signal ("legacy"), and run with a connection limit
+ * and with an accept-rate limit.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include <sys/resource.h>
+#include <thread>
+#include "loopback.h"
+#include "cercall/qt/tcpacceptor.h"
+
+using namespace cerqall_bench;
+using cercall::qt::AdmissionControl;
+
+namespace {
+
+/**
+ * Connects all clients without waiting for each connection, waits until every connect has completed and keeps
+ * the connections open until stopped.
+ */
+void storm(quint16 port, int clients, std::atomic<int>& connected, std::atomic<bool>& stop)
+{
+    std::vector<pollfd> fds;
+    for (int i = 0; i < clients; ++i) {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            break;
+        }
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        fds.push_back(pollfd { fd, POLLOUT, 0 });
+    }
+    size_t pending = fds.size();
+    while (pending > 0u && !stop) {
+        if (::poll(fds.data(), fds.size(), 100) < 0) {
+            break;
+        }
+        for (pollfd& p : fds) {
+            if (p.events != 0 && p.revents != 0) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                ::getsockopt(p.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                connected += err == 0 ? 1 : 0;
+                p.events = 0;
+                --pending;
+            }
+        }
+    }
+    while ( !stop) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    for (const pollfd& p : fds) {
+        ::close(p.fd);
+    }
+}
+
+struct Accepted : public cercall::AcceptorListener
+{
+    FrameCounter myCounter { 1u };
+    std::vector<std::shared_ptr<cercall::Transport>> myTransports;
+
+    void on_client_accepted(std::shared_ptr<cercall::Transport> tr) override
+    {
+        tr->set_listener(&myCounter);
+        myTransports.push_back(tr);
+    }
+
+    void on_accept_error(const cercall::Error& err) override
+    {
+        fprintf(stderr, "accept error: %s\n", err.message().c_str());
+    }
+};
+
+/**
+ * The former accept path: one connection per newConnection signal.
+ */
+struct LegacyAcceptor
+{
+    QTcpServer myServer;
+    Accepted& myListener;
+
+    explicit LegacyAcceptor(Accepted& listener) : myListener(listener)
+    {
+        QObject::connect(&myServer, &QTcpServer::newConnection, [this]() {
+            if (QTcpSocket* sock = myServer.nextPendingConnection()) {
+                sock->setParent(nullptr);
+                myListener.on_client_accepted(std::make_shared<cercall::qt::TcpTransport>(sock));
+            }
+        });
+    }
+};
+
+template<typename Done>
+QJsonObject run_storm(quint16 port, int clients, const Done& done)
+{
+    std::atomic<int> connected { 0 };
+    std::atomic<bool> stop { false };
+    auto start = Clock::now();
+    std::thread client(storm, port, clients, std::ref(connected), std::ref(stop));
+    while ( !done() && elapsed_sec(start) < 60.0) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 10);
+    }
+    double ms = elapsed_sec(start) * 1000;
+    stop = true;
+    client.join();
+
+    QJsonObject result;
+    result["clients"] = clients;
+    result["client_connected"] = connected.load();
+    result["time_to_all_ms"] = ms;
+    return result;
+}
+
+QJsonObject run_legacy(int clients)
+{
+    Accepted accepted;
+    LegacyAcceptor acceptor(accepted);
+    acceptor.myServer.listen(QHostAddress::LocalHost);
+    QJsonObject result = run_storm(acceptor.myServer.serverPort(), clients, [&]() {
+        return static_cast<int>(accepted.myTransports.size()) >= clients;
+    });
+    result["accepted"] = static_cast<int>(accepted.myTransports.size());
+    return result;
+}
+
+QJsonObject run(int clients, const AdmissionControl& admission)
+{
+    Accepted accepted;
+    cercall::qt::TcpAcceptor acceptor(QHostAddress::LocalHost, 0);
+    acceptor.set_listener(&accepted);
+    acceptor.set_admission_control(admission);
+    acceptor.open();
+    QJsonObject result = run_storm(acceptor.port(), clients, [&]() {
+        return static_cast<int>(accepted.myTransports.size() + acceptor.rejected_connections()) >= clients;
+    });
+    result["accepted"] = static_cast<int>(accepted.myTransports.size());
+    result["rejected"] = static_cast<double>(acceptor.rejected_connections());
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_connectstorm";
+
+    int clients = int_option("clients", 2000);
+
+    //Each connection takes a descriptor at both ends.
+    rlimit files {};
+    if (::getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    AdmissionControl limited;
+    limited.myMaxConnections = clients / 2;
+    AdmissionControl rateLimited;
+    rateLimited.myAcceptRate = clients;
+    rateLimited.myAcceptBurst = clients / 10;
+
+    Report report("connect_storm");
+    report.add("legacy", run_legacy(clients));
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    report.add("drain", run(clients, AdmissionControl {}));
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    report.add("max_connections", run(clients, limited));
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    report.add("rate_limited", run(clients, rateLimited));
+    return report.write();
+}
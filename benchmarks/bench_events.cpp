@@ -0,0 +1,223 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - typed event set against polymorphic events
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * The alarm and tick events of the clock example, in turns, are encoded and decoded with a cereal binary archive
+ * and then dispatched to a handler, once as the QlockEvent of qlockinterface.h, a cercall::qt::EventSet with
+ * a type tag and a visitor ("tagged"), and once as the former QEvent-derived classes, serialized through cereal's
+ * polymorphic pointer support and found with dynamic_cast ("polymorphic"). Time and operator new calls per event
+ * are reported for each step, along with the encoded size.
+ */
+
+#include "debug.h"
+#include "alloccounter.h"
+#include "benchutil.h"
+#include <QEvent>
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/memory.hpp>
+#include <cereal/types/polymorphic.hpp>
+#include <sstream>
+#include "qcereal.h"
+#include "qlockinterface.h"
+
+using namespace cerqall_bench;
+
+namespace {
+
+class PolyEvent : public QEvent
+{
+public:
+    PolyEvent() : QEvent(QEvent::None) {}
+    PolyEvent(QEvent::Type et) : QEvent(et) {}
+
+    template<class DerivedEvent>
+    const DerivedEvent* get_as() const
+    {
+        return dynamic_cast<const DerivedEvent*>(this);
+    }
+
+    template<class A>
+    void serialize(A& ar)
+    {
+        ar(t);
+    }
+};
+
+class PolyAlarmEvent : public PolyEvent
+{
+public:
+    PolyAlarmEvent() : PolyEvent(static_cast<QEvent::Type>(ClockAlarmEvent)) {}
+    PolyAlarmEvent(ClockAlarmId alarm, const QString& tag)
+        : PolyEvent(static_cast<QEvent::Type>(ClockAlarmEvent)), myAlarmId(alarm), myTag(tag) {}
+
+    ClockAlarmId myAlarmId = 0;
+    QString myTag;
+
+    template<class A>
+    void serialize(A& ar)
+    {
+        ar(myTag, myAlarmId);
+    }
+};
+
+class PolyTickEvent : public PolyEvent
+{
+public:
+    PolyTickEvent() : PolyEvent(static_cast<QEvent::Type>(ClockTickEvent)) {}
+    PolyTickEvent(const QTime& time) : PolyEvent(static_cast<QEvent::Type>(ClockTickEvent)), myTickTime(time) {}
+
+    QTime myTickTime;
+
+    template<class A>
+    void serialize(A& ar)
+    {
+        ar(myTickTime);
+    }
+};
+
+}   //namespace
+
+CEREAL_REGISTER_TYPE(PolyAlarmEvent);
+CEREAL_REGISTER_TYPE(PolyTickEvent);
+CEREAL_REGISTER_POLYMORPHIC_RELATION(PolyEvent, PolyAlarmEvent);
+CEREAL_REGISTER_POLYMORPHIC_RELATION(PolyEvent, PolyTickEvent);
+
+namespace {
+
+struct Handled
+{
+    int64_t myAlarms = 0;
+    int64_t myTicks = 0;
+
+    void operator()(const QlockAlarmEvent& alarm)
+    {
+        myAlarms += alarm.myAlarmId;
+    }
+
+    void operator()(const QlockTickEvent& tick)
+    {
+        myTicks += tick.myTickTime.msec();
+    }
+};
+
+void dispatch(const PolyEvent& event, Handled& handled)
+{
+    if (const PolyAlarmEvent* alarm = event.get_as<PolyAlarmEvent>()) {
+        handled.myAlarms += alarm->myAlarmId;
+    } else if (const PolyTickEvent* tick = event.get_as<PolyTickEvent>()) {
+        handled.myTicks += tick->myTickTime.msec();
+    }
+}
+
+void dispatch(const QlockEvent& event, Handled& handled)
+{
+    event.visit(handled);
+}
+
+const PolyEvent& event_of(const std::unique_ptr<PolyEvent>& event)
+{
+    return *event;
+}
+
+const QlockEvent& event_of(const QlockEvent& event)
+{
+    return event;
+}
+
+std::unique_ptr<PolyEvent> make_poly(int i)
+{
+    if (i % 2 == 0) {
+        return std::unique_ptr<PolyEvent>(new PolyAlarmEvent(i, "alarm"));
+    }
+    return std::unique_ptr<PolyEvent>(new PolyTickEvent(QTime(12, 34, 56, i % 1000)));
+}
+
+QlockEvent make_tagged(int i)
+{
+    if (i % 2 == 0) {
+        return QlockAlarmEvent(i, "alarm");
+    }
+    return QlockTickEvent(QTime(12, 34, 56, i % 1000));
+}
+
+/**
+ * Encodes, decodes and dispatches batches of events, held by an H. Polymorphic events can only be serialized
+ * through a pointer, which is what a cercall client gets anyway; the tagged ones are decoded in place.
+ */
+template<typename H>
+QJsonObject run(H (*make)(int), int batch, int iterations)
+{
+    std::vector<H> events;
+    for (int i = 0; i < batch; ++i) {
+        events.push_back(make(i));
+    }
+    std::vector<H> decoded(static_cast<size_t>(batch));
+    std::stringstream ss;
+    Handled handled;
+    double encodeSecs = 0.0, decodeSecs = 0.0, dispatchSecs = 0.0;
+    uint64_t encodeAllocs = 0u, decodeAllocs = 0u, dispatchAllocs = 0u;
+    double bytes = 0.0;
+    for (int n = 0; n < iterations; ++n) {
+        ss.seekp(0);
+        uint64_t allocsBefore = thread_allocations();
+        auto start = Clock::now();
+        for (const H& event : events) {
+            //One archive per event, as cercall has one per message.
+            cereal::BinaryOutputArchive oar(ss);
+            oar(event);
+        }
+        encodeSecs += elapsed_sec(start);
+        encodeAllocs += thread_allocations() - allocsBefore;
+        bytes = static_cast<double>(ss.tellp());
+
+        ss.seekg(0);
+        allocsBefore = thread_allocations();
+        start = Clock::now();
+        for (H& event : decoded) {
+            cereal::BinaryInputArchive iar(ss);
+            iar(event);
+        }
+        decodeSecs += elapsed_sec(start);
+        decodeAllocs += thread_allocations() - allocsBefore;
+
+        allocsBefore = thread_allocations();
+        start = Clock::now();
+        for (const H& event : decoded) {
+            dispatch(event_of(event), handled);
+        }
+        dispatchSecs += elapsed_sec(start);
+        dispatchAllocs += thread_allocations() - allocsBefore;
+    }
+
+    const double total = static_cast<double>(batch) * iterations;
+    QJsonObject result;
+    result["bytes_per_event"] = bytes / batch;
+    result["encode_ns_per_event"] = encodeSecs * 1e9 / total;
+    result["encode_allocs_per_event"] = encodeAllocs / total;
+    result["decode_ns_per_event"] = decodeSecs * 1e9 / total;
+    result["decode_allocs_per_event"] = decodeAllocs / total;
+    result["dispatch_ns_per_event"] = dispatchSecs * 1e9 / total;
+    result["dispatch_allocs_per_event"] = dispatchAllocs / total;
+    result["checksum"] = static_cast<double>(handled.myAlarms + handled.myTicks);
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_events";
+
+    int iterations = int_option("iterations", 2000);
+    int batch = int_option("batch", 1000);
+    Report report("events");
+    report.add("polymorphic", run<std::unique_ptr<PolyEvent>>(make_poly, batch, iterations));
+    report.add("tagged", run<QlockEvent>(make_tagged, batch, iterations));
+    return report.write();
+}
@@ -0,0 +1,109 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - debug log
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Measures the cost of an enabled log statement on the calling thread: the former implementation, which
+ * cleaned up __PRETTY_FUNCTION__ with regular expressions and wrote synchronously ("legacy"), against the
+ * current one. Lines are logged in bursts which fit the queue of the writer thread. With --json <file>
+ * the log lines are discarded, otherwise they are mixed with the results on stdout.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include <QTime>
+#include <regex>
+
+using namespace cerqall_bench;
+using cercall_user_log::LogLevel;
+
+namespace {
+
+template<typename... Args>
+void legacy_log(LogLevel ll, const char* logToken, const char* format, Args... args)
+{
+    fprintf(stdout, "%s [%s] ", cercall_user_log::programName.c_str(), cercall_user_log::levelToStr(ll));
+    if (*logToken != 0) {
+        std::string tok = std::regex_replace(logToken, std::regex("([^[]*) \\[with .*\\](.*)"), "$1$2");
+        do {
+            tok = std::regex_replace(tok, std::regex("([^(]*)\\([^)]*\\)(.*)"), "$1$2");
+        } while (tok.find_first_of('(') != tok.npos);
+
+        do {
+            tok = std::regex_replace(tok, std::regex("([^<]*)<[^>]*>(.*)"), "$1$2");
+        } while (tok.find_first_of('<') != tok.npos);
+
+        size_t posLastSpace = tok.find_last_of(' ');
+        if (posLastSpace != tok.npos) {
+            tok = tok.substr(posLastSpace + 1);
+        }
+        fprintf(stdout, "%s", tok.c_str());
+    }
+    if (*format != 0) {
+        fprintf(stdout, ": ");
+        fprintf(stdout, format, args...);
+    }
+    fprintf(stdout, "\n");
+    fflush(stdout);
+}
+
+struct Service
+{
+    template<typename T>
+    void on_tick(const QTime& time, T count, bool legacy)
+    {
+        if (legacy) {
+            legacy_log(cercall_user_log::error, O_LOG_TOKEN, "tick %d at %s", static_cast<int>(count),
+                       time.toString().toStdString().c_str());
+        } else {
+            cercall_user_log::log<cercall_user_log::error>(cercall_user_log::error, O_LOG_TOKEN, "tick %d at %s",
+                                                           static_cast<int>(count),
+                                                           [&time]() { return time.toString(); });
+        }
+    }
+};
+
+QJsonObject run(bool legacy, int lines, int bursts)
+{
+    Service service;
+    const QTime time = QTime::currentTime();
+    std::vector<double> samples;
+    for (int b = 0; b < bursts; ++b) {
+        auto start = Clock::now();
+        for (int i = 0; i < lines; ++i) {
+            service.on_tick(time, i, legacy);
+        }
+        samples.push_back(elapsed_usec(start) * 1000.0 / lines);
+        //Let the writer thread catch up between bursts.
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    QJsonObject result;
+    result["lines_per_burst"] = lines;
+    add_percentiles(result, samples, "nsec_per_line");
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_log";
+    if (app.arguments().contains("--json")) {
+        //The results go to the file, the log lines nowhere.
+        if (freopen("/dev/null", "w", stdout) == nullptr) {
+            return 1;
+        }
+    }
+
+    int lines = int_option("lines", 2000);
+    int bursts = int_option("bursts", 50);
+    Report report("log");
+    report.add("legacy", run(true, lines, bursts));
+    report.add("async", run(false, lines, bursts));
+    return report.write();
+}
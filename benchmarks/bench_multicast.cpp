@@ -0,0 +1,195 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - event fan-out over TCP against UDP multicast
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * An event frame of the size of a tick event goes to a number of clients, either written to the server-side
+ * TcpTransport of every loopback client within a BroadcastScope ("tcp"), as in bench_broadcast, or sent once
+ * by a MulticastTransport to a group on the loopback interface, which every client joins ("multicast"). The
+ * CPU cost of one broadcast on the sending thread is reported against the number of clients, along with the
+ * messages the multicast receivers got and missed, by the sequence numbers of the datagrams.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include <QTcpServer>
+#include <QtEndian>
+#include <thread>
+#include "loopback.h"
+#include "cercall/qt/multicasttransport.h"
+#include "cercall/qt/tcptransport.h"
+
+using namespace cerqall_bench;
+using cercall::qt::MulticastTransport;
+using cercall::qt::TcpTransport;
+
+namespace {
+
+const char* const Group = "239.255.67.81";
+
+/**
+ * Joins the group on the loopback interface with the given number of sockets and counts the datagrams and the
+ * gaps in their sequence numbers, until stopped. Meant to be run in its own thread.
+ */
+void multicast_sink(quint16 port, int receivers, std::atomic<bool>& ready, std::atomic<bool>& stop,
+                    std::atomic<uint64_t>& received, std::atomic<uint64_t>& missed)
+{
+    std::vector<pollfd> fds;
+    for (int i = 0; i < receivers; ++i) {
+        int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+        int on = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        ip_mreq mreq {};
+        ::inet_pton(AF_INET, Group, &mreq.imr_multiaddr);
+        mreq.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0
+                && ::setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0) {
+            fds.push_back(pollfd { fd, POLLIN, 0 });
+        } else {
+            ::close(fd);
+        }
+    }
+    ready = true;
+    std::vector<uint64_t> expected(fds.size(), 0u);
+    std::vector<char> buf(65536);
+    while ( !stop) {
+        if (::poll(fds.data(), fds.size(), 100) < 0) {
+            break;
+        }
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            ssize_t n;
+            while ((n = ::recv(fds[i].fd, buf.data(), buf.size(), MSG_DONTWAIT)) >= 16) {
+                const uint64_t sequence = qFromBigEndian<quint64>(buf.data() + 8);
+                if (expected[i] != 0u && sequence > expected[i]) {
+                    missed += sequence - expected[i];
+                }
+                expected[i] = sequence + 1u;
+                ++received;
+            }
+        }
+    }
+    for (const pollfd& p : fds) {
+        ::close(p.fd);
+    }
+}
+
+QJsonObject run_tcp(int clients, int frameSize, int durationMs)
+{
+    QTcpServer server;
+    server.setMaxPendingConnections(clients);
+    server.listen(QHostAddress::LocalHost);
+    std::atomic<uint64_t> received { 0 };
+    std::thread reader(sink, server.serverPort(), clients, std::ref(received));
+
+    FrameCounter listener(static_cast<uint32_t>(frameSize));
+    std::vector<std::shared_ptr<TcpTransport>> transports;
+    while (static_cast<int>(transports.size()) < clients && server.waitForNewConnection(5000)) {
+        while (QTcpSocket* sock = server.nextPendingConnection()) {
+            transports.push_back(std::make_shared<TcpTransport>(sock));
+            transports.back()->set_listener(&listener);
+        }
+    }
+
+    const std::string frame(static_cast<size_t>(frameSize), 'e');
+    uint64_t broadcasts = 0;
+    double busySecs = 0.0;
+    auto start = Clock::now();
+    while (elapsed_sec(start) * 1000 < durationMs) {
+        auto broadcastStart = Clock::now();
+        {
+            cercall::qt::BroadcastScope scope;
+            for (auto& tr : transports) {
+                tr->write(frame);
+            }
+        }
+        busySecs += elapsed_sec(broadcastStart);
+        ++broadcasts;
+        QCoreApplication::processEvents();
+    }
+
+    transports.clear();
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    reader.join();
+
+    QJsonObject result;
+    result["clients"] = clients;
+    result["broadcasts"] = static_cast<double>(broadcasts);
+    result["usec_per_broadcast"] = broadcasts > 0 ? busySecs * 1e6 / broadcasts : 0.0;
+    result["frames_received"] = static_cast<double>(received.load() / static_cast<uint64_t>(frameSize));
+    return result;
+}
+
+QJsonObject run_multicast(int clients, int frameSize, int durationMs, quint16 port)
+{
+    std::atomic<bool> ready { false };
+    std::atomic<bool> stop { false };
+    std::atomic<uint64_t> received { 0 };
+    std::atomic<uint64_t> missed { 0 };
+    std::thread reader(multicast_sink, port, clients, std::ref(ready), std::ref(stop), std::ref(received),
+                       std::ref(missed));
+    while ( !ready) {
+        std::this_thread::yield();
+    }
+
+    FrameCounter listener(static_cast<uint32_t>(frameSize));
+    MulticastTransport sender(MulticastTransport::Role::Sender, QHostAddress(Group), port,
+                              cercall::qt::MulticastOptions::loopback());
+    sender.set_listener(&listener);
+    sender.open();
+
+    const std::string frame(static_cast<size_t>(frameSize), 'e');
+    uint64_t broadcasts = 0;
+    double busySecs = 0.0;
+    auto start = Clock::now();
+    while (elapsed_sec(start) * 1000 < durationMs) {
+        auto broadcastStart = Clock::now();
+        {
+            cercall::qt::BroadcastScope scope;
+            sender.write(frame);
+        }
+        busySecs += elapsed_sec(broadcastStart);
+        ++broadcasts;
+        QCoreApplication::processEvents();
+    }
+    //The receivers catch up with what is in their socket buffers.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    stop = true;
+    reader.join();
+
+    QJsonObject result;
+    result["clients"] = clients;
+    result["broadcasts"] = static_cast<double>(broadcasts);
+    result["usec_per_broadcast"] = broadcasts > 0 ? busySecs * 1e6 / broadcasts : 0.0;
+    result["frames_received"] = static_cast<double>(received.load());
+    result["frames_missed"] = static_cast<double>(missed.load());
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_multicast";
+
+    int durationMs = int_option("duration-ms", 2000);
+    int frameSize = int_option("frame-size", 64);
+    quint16 port = static_cast<quint16>(int_option("port", 43210));
+    Report report("multicast");
+    for (int clients : { 1, 10, 100, 500 }) {
+        report.add(QString("tcp/%1").arg(clients), run_tcp(clients, frameSize, durationMs));
+        report.add(QString("multicast/%1").arg(clients), run_multicast(clients, frameSize, durationMs, port));
+    }
+    return report.write();
+}
@@ -0,0 +1,193 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - cereal serializers for Qt types
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Encodes and decodes records of Qt values with a cereal binary archive, once with the serializers of
+ * qcereal.h and once with the former ones, which went through std::string and formatted time text ("legacy").
+ * Encode and decode throughput and operator new calls per record are reported. Before that, the benchmark
+ * checks that lengths which the data does not back up are rejected, and fails if not.
+ */
+
+#include "debug.h"
+#include "alloccounter.h"
+#include "benchutil.h"
+#include <cereal/archives/binary.hpp>
+#include <sstream>
+#include "qcereal.h"
+
+using namespace cerqall_bench;
+
+namespace {
+
+struct LegacyString
+{
+    QString myValue;
+
+    template<class Archive>
+    void save(Archive& ar) const
+    {
+        ar(myValue.toStdString());
+    }
+
+    template<class Archive>
+    void load(Archive& ar)
+    {
+        std::string stds;
+        ar(stds);
+        myValue = QString::fromStdString(stds);
+    }
+};
+
+struct LegacyTime
+{
+    QTime myValue;
+
+    template<class Archive>
+    void save(Archive& ar) const
+    {
+        LegacyString tStr { myValue.toString() };
+        ar(tStr);
+    }
+
+    template<class Archive>
+    void load(Archive& ar)
+    {
+        LegacyString tStr;
+        ar(tStr);
+        myValue = QTime::fromString(tStr.myValue);
+    }
+};
+
+struct Record
+{
+    QString myName;
+    QString myText;
+    QTime myTime;
+
+    template<class Archive>
+    void serialize(Archive& ar)
+    {
+        ar(myName, myText, myTime);
+    }
+};
+
+struct LegacyRecord
+{
+    LegacyString myName;
+    LegacyString myText;
+    LegacyTime myTime;
+
+    template<class Archive>
+    void serialize(Archive& ar)
+    {
+        ar(myName, myText, myTime);
+    }
+};
+
+template<typename R>
+QJsonObject run(const R& record, int iterations)
+{
+    std::stringstream ss;
+    {
+        cereal::BinaryOutputArchive oar(ss);
+        oar(record);
+    }
+    const double recordSize = static_cast<double>(ss.tellp());
+
+    uint64_t allocsBefore = thread_allocations();
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        ss.seekp(0);
+        cereal::BinaryOutputArchive oar(ss);
+        oar(record);
+    }
+    double encodeSecs = elapsed_sec(start);
+    uint64_t encodeAllocs = thread_allocations() - allocsBefore;
+
+    R decoded;
+    allocsBefore = thread_allocations();
+    start = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        ss.seekg(0);
+        cereal::BinaryInputArchive iar(ss);
+        iar(decoded);
+    }
+    double decodeSecs = elapsed_sec(start);
+    uint64_t decodeAllocs = thread_allocations() - allocsBefore;
+
+    QJsonObject result;
+    result["record_bytes"] = recordSize;
+    result["encode_records_per_sec"] = iterations / encodeSecs;
+    result["encode_mb_per_sec"] = iterations * recordSize / encodeSecs / 1e6;
+    result["encode_allocs_per_record"] = static_cast<double>(encodeAllocs) / iterations;
+    result["decode_records_per_sec"] = iterations / decodeSecs;
+    result["decode_mb_per_sec"] = iterations * recordSize / decodeSecs / 1e6;
+    result["decode_allocs_per_record"] = static_cast<double>(decodeAllocs) / iterations;
+    return result;
+}
+
+/**
+ * Decodes a value from a size tag with the given length, followed by a few bytes. Returns true if the length is
+ * rejected with a cereal::Exception, as it must be when the data does not back it up.
+ */
+template<typename T>
+bool rejects_length(cereal::size_type length)
+{
+    std::stringstream ss;
+    {
+        cereal::BinaryOutputArchive oar(ss);
+        oar(cereal::make_size_tag(length));
+        oar(cereal::binary_data("0123456789abcdef", 16u));
+    }
+    try {
+        cereal::BinaryInputArchive iar(ss);
+        T value;
+        iar(value);
+    } catch (const cereal::Exception&) {
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Lengths which do not fit in an int, which truncate to a small one, or which exceed the data.
+ */
+bool rejects_bad_lengths()
+{
+    for (cereal::size_type length : { cereal::size_type(0x100000004u), cereal::size_type(1u) << 40,
+                                      cereal::size_type(0x80000000u), cereal::size_type(1000u) }) {
+        if ( !rejects_length<QString>(length) || !rejects_length<QByteArray>(length)
+                || !rejects_length<QVector<qint32>>(length) || !rejects_length<QVector<QString>>(length)) {
+            fprintf(stderr, "length %llu not rejected\n", static_cast<unsigned long long>(length));
+            return false;
+        }
+    }
+    return true;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_qcereal";
+
+    //A corrupt or hostile length must fail the decoding, not overflow a buffer.
+    if ( !rejects_bad_lengths()) {
+        return 1;
+    }
+    int iterations = int_option("iterations", 1000000);
+    Report report("qcereal");
+    for (int textLength : { 16, 256, 4096 }) {
+        Record record { "alarm-name", QString(textLength, QChar('x')), QTime(12, 34, 56, 789) };
+        LegacyRecord legacy { { record.myName }, { record.myText }, { record.myTime } };
+        report.add(QString("legacy/%1").arg(textLength), run(legacy, iterations));
+        report.add(QString("binary/%1").arg(textLength), run(record, iterations));
+    }
+    return report.write();
+}
@@ -0,0 +1,272 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - clock service calls
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Runs QlockService on worker threads of a QlockServicePool and calls it over loopback with QlockClient.
+ * The round-trip latency of get_time() is measured with a single call in flight, the sustained call rate
+ * with N clients, each keeping a window of pipelined get_time() calls in flight. The time to set and then
+ * cancel a large number of alarms is measured with the calls sent one by one, in a QlockClient::Batch, and
+ * with a single set_alarms() and cancel_alarms() call.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include <QEventLoop>
+#include <QTimer>
+#include <algorithm>
+#include <cstdlib>
+#include "cercall/qt/tcptransport.h"
+#include "qlockclient.h"
+#include "qlockservice.h"
+
+using namespace cerqall_bench;
+
+namespace {
+
+std::shared_ptr<QlockClient> connect_client(quint16 port)
+{
+    auto client = std::make_shared<QlockClient>(
+                cercall::make_unique<cercall::qt::TcpTransport>(QHostAddress::LocalHost, port));
+    return client->open() ? client : nullptr;
+}
+
+/**
+ * Returns a connected client, or exits if the service cannot be reached: the measurements need one.
+ */
+std::shared_ptr<QlockClient> required_client(quint16 port)
+{
+    std::shared_ptr<QlockClient> client = connect_client(port);
+    if ( !client) {
+        fprintf(stderr, "cannot connect to port %d\n", static_cast<int>(port));
+        std::exit(1);
+    }
+    return client;
+}
+
+QJsonObject run_latency(quint16 port, int calls)
+{
+    std::shared_ptr<QlockClient> client = required_client(port);
+    std::vector<double> samples;
+    samples.reserve(static_cast<size_t>(calls));
+    int errors = 0;
+    QEventLoop loop;
+
+    std::function<void()> next;
+    next = [&]() {
+        if (static_cast<int>(samples.size()) + errors >= calls) {
+            loop.quit();
+            return;
+        }
+        auto start = Clock::now();
+        client->get_time([&, start](const cercall::Result<QTime>& res) {
+            if (res) {
+                samples.push_back(elapsed_usec(start));
+            } else {
+                ++errors;
+            }
+            next();
+        });
+    };
+    QTimer::singleShot(0, next);
+    loop.exec();
+    client->close();
+
+    QJsonObject result;
+    result["calls"] = calls;
+    result["errors"] = errors;
+    add_percentiles(result, samples);
+    return result;
+}
+
+QJsonObject run_throughput(quint16 port, int clientCount, int window, int durationMs)
+{
+    std::vector<std::shared_ptr<QlockClient>> clients;
+    for (int i = 0; i < clientCount; ++i) {
+        if (auto client = connect_client(port)) {
+            clients.push_back(client);
+        }
+    }
+
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    bool running = true;
+    std::function<void(QlockClient&)> call;
+    call = [&](QlockClient& client) {
+        client.get_time([&](const cercall::Result<QTime>& res) {
+            ++(res ? completed : errors);
+            if (running) {
+                call(client);
+            }
+        });
+    };
+
+    QEventLoop loop;
+    QTimer::singleShot(durationMs, &loop, &QEventLoop::quit);
+    auto start = Clock::now();
+    for (auto& client : clients) {
+        for (int w = 0; w < window; ++w) {
+            call(*client);
+        }
+    }
+    loop.exec();
+    double secs = elapsed_sec(start);
+    uint64_t done = completed;
+    running = false;
+
+    //Collect the calls still in flight before the clients go away.
+    QEventLoop drain;
+    QTimer::singleShot(200, &drain, &QEventLoop::quit);
+    drain.exec();
+    for (auto& client : clients) {
+        client->close();
+    }
+
+    QJsonObject result;
+    result["clients"] = static_cast<int>(clients.size());
+    result["window"] = window;
+    result["calls_per_sec"] = done / secs;
+    result["errors"] = static_cast<double>(errors);
+    return result;
+}
+
+/**
+ * Sets the alarms, far enough in the future not to fire, and cancels them, waiting for all results
+ * after each step.
+ */
+QJsonObject run_alarms(quint16 port, int count, bool batched)
+{
+    std::shared_ptr<QlockClient> client = required_client(port);
+    std::vector<ClockAlarmId> alarms;
+    alarms.reserve(static_cast<size_t>(count));
+    int pending = 0;
+    int errors = 0;
+    QEventLoop loop;
+    auto done = [&](bool ok) {
+        errors += ok ? 0 : 1;
+        if (--pending == 0) {
+            loop.quit();
+        }
+    };
+
+    auto start = Clock::now();
+    {
+        std::unique_ptr<QlockClient::Batch> batch(batched ? new QlockClient::Batch(*client) : nullptr);
+        for (int i = 0; i < count; ++i) {
+            ++pending;
+            client->set_alarm("bench", QTime(1, 0), [&](const cercall::Result<ClockAlarmId>& res) {
+                if ( !res.error()) {
+                    alarms.push_back(res.get_value());
+                }
+                done( !res.error());
+            });
+        }
+    }
+    if (pending > 0) {
+        loop.exec();
+    }
+    double setSecs = elapsed_sec(start);
+
+    start = Clock::now();
+    {
+        std::unique_ptr<QlockClient::Batch> batch(batched ? new QlockClient::Batch(*client) : nullptr);
+        for (ClockAlarmId alarm : alarms) {
+            ++pending;
+            client->cancel_alarm(alarm, [&](const cercall::Result<void>& res) { done( !res.error()); });
+        }
+    }
+    if (pending > 0) {
+        loop.exec();
+    }
+    double cancelSecs = elapsed_sec(start);
+    client->close();
+
+    QJsonObject result;
+    result["alarms"] = count;
+    result["errors"] = errors;
+    result["set_usec_per_alarm"] = setSecs * 1e6 / count;
+    result["cancel_usec_per_alarm"] = alarms.empty() ? 0.0 : cancelSecs * 1e6 / alarms.size();
+    return result;
+}
+
+QJsonObject run_alarm_vectors(quint16 port, int count)
+{
+    std::shared_ptr<QlockClient> client = required_client(port);
+    std::vector<QlockAlarmRequest> requests(static_cast<size_t>(count), QlockAlarmRequest { "bench", QTime(1, 0) });
+    std::vector<ClockAlarmId> alarms;
+    int errors = 0;
+    int cancelled = 0;
+    QEventLoop loop;
+
+    auto start = Clock::now();
+    client->set_alarms(requests, [&](const cercall::Result<std::vector<ClockAlarmId>>& res) {
+        if ( !res.error()) {
+            alarms = res.get_value();
+        } else {
+            ++errors;
+        }
+        loop.quit();
+    });
+    loop.exec();
+    double setSecs = elapsed_sec(start);
+
+    start = Clock::now();
+    client->cancel_alarms(alarms, [&](const cercall::Result<std::vector<bool>>& res) {
+        if ( !res.error()) {
+            const std::vector<bool>& statuses = res.get_value();
+            cancelled = static_cast<int>(std::count(statuses.begin(), statuses.end(), true));
+        } else {
+            ++errors;
+        }
+        loop.quit();
+    });
+    loop.exec();
+    double cancelSecs = elapsed_sec(start);
+    client->close();
+
+    QJsonObject result;
+    result["alarms"] = count;
+    result["errors"] = errors;
+    result["cancelled"] = cancelled;
+    result["set_usec_per_alarm"] = setSecs * 1e6 / count;
+    result["cancel_usec_per_alarm"] = alarms.empty() ? 0.0 : cancelSecs * 1e6 / alarms.size();
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_qlock";
+
+    int workers = int_option("workers", 1);
+    int calls = int_option("calls", 20000);
+    int window = int_option("window", 16);
+    int durationMs = int_option("duration-ms", 2000);
+    int alarms = int_option("alarms", 10000);
+
+    QlockServicePool services(workers, QHostAddress::LocalHost, 0);
+    if ( !services.listen()) {
+        fprintf(stderr, "cannot listen: %s\n", services.error_string().toStdString().c_str());
+        return 1;
+    }
+
+    Report report("qlock");
+    QJsonObject latency = run_latency(services.port(), calls);
+    latency["workers"] = workers;
+    report.add("get_time_latency", latency);
+    for (int clients : { 1, 4, 16, 64 }) {
+        QJsonObject throughput = run_throughput(services.port(), clients, window, durationMs);
+        throughput["workers"] = workers;
+        report.add(QString("get_time_pipelined/%1").arg(clients), throughput);
+    }
+    report.add("alarms_one_by_one", run_alarms(services.port(), alarms, false));
+    report.add("alarms_batched", run_alarms(services.port(), alarms, true));
+    report.add("alarms_vector", run_alarm_vectors(services.port(), alarms));
+    return report.write();
+}
@@ -0,0 +1,97 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - same-host transports against TCP loopback
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * A client transport sends fixed-size frames to an echo transport on the server side. Round-trip latency
+ * is measured with one frame in flight, throughput with a window of pipelined frames. The transports
+ * compared are TcpTransport over loopback, LocalTransport and ShmTransport.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include <QLocalServer>
+#include <QTcpServer>
+#include "loopback.h"
+#include "cercall/qt/localtransport.h"
+#include "cercall/qt/shmacceptor.h"
+#include "cercall/qt/tcptransport.h"
+
+using namespace cerqall_bench;
+
+namespace {
+
+//The listeners are declared before the transports, which notify them when they are closed.
+
+QJsonObject run_tcp(int frameSize, int window, int total)
+{
+    Echo echo(static_cast<uint32_t>(frameSize));
+    Pinger pinger(static_cast<uint32_t>(frameSize), window, static_cast<uint64_t>(total));
+    QTcpServer server;
+    server.listen(QHostAddress::LocalHost);
+    cercall::qt::TcpTransport client(QHostAddress::LocalHost, server.serverPort());
+    client.set_listener(&pinger);
+    client.open();
+    server.waitForNewConnection(5000);
+    cercall::qt::TcpTransport serverSide(server.nextPendingConnection());
+    return ping_pong(client, serverSide, pinger, echo);
+}
+
+QJsonObject run_local(int frameSize, int window, int total)
+{
+    Echo echo(static_cast<uint32_t>(frameSize));
+    Pinger pinger(static_cast<uint32_t>(frameSize), window, static_cast<uint64_t>(total));
+    QString name = QString("cerqall_bench_%1").arg(QCoreApplication::applicationPid());
+    QLocalServer::removeServer(name);
+    QLocalServer server;
+    server.listen(name);
+    cercall::qt::LocalTransport client(name);
+    client.set_listener(&pinger);
+    client.open();
+    server.waitForNewConnection(5000);
+    cercall::qt::LocalTransport serverSide(server.nextPendingConnection());
+    return ping_pong(client, serverSide, pinger, echo);
+}
+
+QJsonObject run_shm(int frameSize, int window, int total)
+{
+    Echo echo(static_cast<uint32_t>(frameSize));
+    Pinger pinger(static_cast<uint32_t>(frameSize), window, static_cast<uint64_t>(total));
+    AcceptedTransport accepted;
+    cercall::qt::ShmAcceptor acceptor(QString("cerqall_bench_shm_%1").arg(QCoreApplication::applicationPid()));
+    acceptor.set_listener(&accepted);
+    acceptor.open();
+    cercall::qt::ShmTransport client(QString("cerqall_bench_shm_%1").arg(QCoreApplication::applicationPid()));
+    client.set_listener(&pinger);
+    //The acceptor runs in this thread, so the connection has to be set up asynchronously.
+    client.open([](const cercall::Result<bool>&) {});
+    while ( !client.is_open() || !accepted.myTransport) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+    return ping_pong(client, *accepted.myTransport, pinger, echo);
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_samehost";
+
+    int total = int_option("round-trips", 100000);
+    Report report("same_host_transports");
+    for (int frameSize : { 64, 4096 }) {
+        for (int window : { 1, 32 }) {
+            QString suffix = QString("%1/window%2").arg(frameSize).arg(window);
+            report.add("tcp/" + suffix, run_tcp(frameSize, window, total));
+            report.add("local/" + suffix, run_local(frameSize, window, total));
+            report.add("shm/" + suffix, run_shm(frameSize, window, total));
+            QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+        }
+    }
+    return report.write();
+}
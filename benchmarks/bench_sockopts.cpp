@@ -0,0 +1,72 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - TCP socket options
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Small frames go back and forth between a client TcpTransport and a transport accepted by a TcpAcceptor over
+ * loopback, with one frame and with a window of frames in flight, as in bench_samehost. The round-trip latency
+ * percentiles are reported with the default SocketOptions, with Nagle's algorithm enabled, and with small
+ * kernel buffers. Both ends get the same options: the client through its transport, the accepted end through
+ * the acceptor.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include "loopback.h"
+#include "cercall/qt/tcpacceptor.h"
+
+using namespace cerqall_bench;
+using cercall::qt::SocketOptions;
+
+namespace {
+
+QJsonObject run(const SocketOptions& options, int frameSize, int window, int total)
+{
+    Echo echo(static_cast<uint32_t>(frameSize));
+    Pinger pinger(static_cast<uint32_t>(frameSize), window, static_cast<uint64_t>(total));
+    AcceptedTransport accepted;
+    cercall::qt::TcpAcceptor acceptor(QHostAddress::LocalHost, 0, options);
+    acceptor.set_listener(&accepted);
+    acceptor.open();
+    cercall::qt::TcpTransport client(QHostAddress::LocalHost, acceptor.port(), options);
+    client.set_listener(&pinger);
+    client.open();
+    while ( !accepted.myTransport) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+    return ping_pong(client, *accepted.myTransport, pinger, echo);
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_sockopts";
+
+    int total = int_option("round-trips", 20000);
+
+    SocketOptions nagle;
+    nagle.myLowDelay = false;
+    SocketOptions smallBuffers;
+    smallBuffers.mySendBufferSize = smallBuffers.myReceiveBufferSize = 8 * 1024;
+    const std::pair<QString, SocketOptions> variants[] = {
+        { "default", SocketOptions {} }, { "nagle", nagle }, { "small_buffers", smallBuffers }
+    };
+
+    Report report("socket_options");
+    for (int frameSize : { 64, 4096 }) {
+        for (int window : { 1, 8 }) {
+            for (const auto& variant : variants) {
+                report.add(QString("%1/%2/window%3").arg(variant.first).arg(frameSize).arg(window),
+                           run(variant.second, frameSize, window, total));
+                QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+            }
+        }
+    }
+    return report.write();
+}
@@ -0,0 +1,80 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - batched receive in TcpTransport
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Small pipelined frames are received through TcpTransport with different socket read buffer sizes.
+ * A read buffer of one frame reproduces the former one-message-per-readyRead behaviour.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include <QEventLoop>
+#include <QTcpServer>
+#include <QTimer>
+#include <thread>
+#include "loopback.h"
+#include "cercall/qt/tcptransport.h"
+
+using namespace cerqall_bench;
+
+namespace {
+
+QJsonObject run(int frameSize, qint64 readBufferSize, int durationMs)
+{
+    QTcpServer server;
+    server.listen(QHostAddress::LocalHost);
+    std::atomic<bool> stop { false };
+    std::thread producer(produce, server.serverPort(), frameSize, std::ref(stop));
+    server.waitForNewConnection(5000);
+    QTcpSocket* sock = server.nextPendingConnection();
+    Q_ASSERT(sock != nullptr);
+
+    uint64_t wakeups = 0;
+    QObject::connect(sock, &QTcpSocket::readyRead, [&wakeups]() { ++wakeups; });
+    FrameCounter counter(static_cast<uint32_t>(frameSize));
+    auto tr = std::make_shared<cercall::qt::TcpTransport>(sock);
+    tr->set_read_buffer_size(readBufferSize);
+    tr->set_listener(&counter);
+    tr->read(static_cast<uint32_t>(frameSize));
+
+    QEventLoop loop;
+    QTimer::singleShot(durationMs, &loop, &QEventLoop::quit);
+    auto start = Clock::now();
+    loop.exec();
+    double secs = elapsed_sec(start);
+
+    stop = true;
+    tr.reset();
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    producer.join();
+
+    QJsonObject result;
+    result["frame_size"] = frameSize;
+    result["read_buffer_size"] = static_cast<double>(readBufferSize);
+    result["frames_per_sec"] = counter.myFrames / secs;
+    result["wakeups_per_sec"] = wakeups / secs;
+    result["frames_per_wakeup"] = wakeups > 0 ? static_cast<double>(counter.myFrames) / wakeups : 0.0;
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_tcpbatch";
+
+    int durationMs = int_option("duration-ms", 2000);
+    int frameSize = int_option("frame-size", 32);
+    Report report("tcp_batch_receive");
+    for (qint64 bufSize : { static_cast<qint64>(frameSize), qint64(4096), qint64(65536),
+                            cercall::qt::TcpTransport::DefaultReadBufferSize }) {
+        report.add(QString("read_buffer/%1").arg(bufSize), run(frameSize, bufSize, durationMs));
+    }
+    return report.write();
+}
@@ -0,0 +1,101 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - TcpTransport read path
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * A producer thread pushes fixed-size frames over a loopback connection as fast as it can. The consumer
+ * reads them either with the former QByteArray + std::string copying scheme ("legacy") or through
+ * TcpTransport::get_read_data(). Throughput and heap allocations per frame on the consumer thread are reported.
+ */
+
+#include "debug.h"
+#include "alloccounter.h"
+#include "benchutil.h"
+#include <QEventLoop>
+#include <QTcpServer>
+#include <QTimer>
+#include <thread>
+#include "loopback.h"
+#include "cercall/qt/tcptransport.h"
+
+using namespace cerqall_bench;
+
+namespace {
+
+QJsonObject run(bool legacy, int frameSize, int durationMs)
+{
+    QTcpServer server;
+    server.listen(QHostAddress::LocalHost);
+    std::atomic<bool> stop { false };
+    std::thread producer(produce, server.serverPort(), frameSize, std::ref(stop));
+    server.waitForNewConnection(5000);
+    QTcpSocket* sock = server.nextPendingConnection();
+    Q_ASSERT(sock != nullptr);
+
+    uint64_t frames = 0;
+    std::shared_ptr<cercall::qt::TcpTransport> tr;
+    FrameCounter counter(static_cast<uint32_t>(frameSize));
+    if (legacy) {
+        sock->setReadBufferSize(frameSize);
+        QObject::connect(sock, &QTcpSocket::readyRead, [sock, frameSize, &frames]() {
+            if (sock->bytesAvailable() >= frameSize) {
+                QByteArray data = sock->read(frameSize);
+                std::string copy(data.constData(), data.length());
+                frames += copy.size() == static_cast<size_t>(frameSize) ? 1u : 0u;
+            }
+        });
+    } else {
+        tr = std::make_shared<cercall::qt::TcpTransport>(sock);
+        tr->set_listener(&counter);
+        tr->read(static_cast<uint32_t>(frameSize));
+    }
+
+    QEventLoop loop;
+    QTimer::singleShot(durationMs, &loop, &QEventLoop::quit);
+    uint64_t allocsBefore = thread_allocations();
+    auto start = Clock::now();
+    loop.exec();
+    double secs = elapsed_sec(start);
+    uint64_t allocs = thread_allocations() - allocsBefore;
+
+    if ( !legacy) {
+        frames = counter.myFrames;
+    }
+    stop = true;
+    if (legacy) {
+        sock->abort();
+        delete sock;
+    } else {
+        tr.reset();
+        QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    }
+    producer.join();
+
+    QJsonObject result;
+    result["frame_size"] = frameSize;
+    result["frames"] = static_cast<double>(frames);
+    result["frames_per_sec"] = frames / secs;
+    result["mb_per_sec"] = frames * frameSize / secs / 1e6;
+    result["allocs_per_frame"] = frames > 0 ? static_cast<double>(allocs) / frames : 0.0;
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_tcpread";
+
+    int durationMs = int_option("duration-ms", 2000);
+    Report report("tcp_read");
+    for (int frameSize : { 64, 1024, 16384 }) {
+        report.add(QString("legacy_copy/%1").arg(frameSize), run(true, frameSize, durationMs));
+        report.add(QString("transport/%1").arg(frameSize), run(false, frameSize, durationMs));
+    }
+    return report.write();
+}
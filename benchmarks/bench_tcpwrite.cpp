@@ -0,0 +1,102 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - TcpTransport write path
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Bursts of small frames are written through TcpTransport to a loopback sink thread,
+ * with and without corking, by copy, by move and as header + payload segments.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include <QTcpServer>
+#include <thread>
+#include "loopback.h"
+#include "cercall/qt/tcptransport.h"
+
+using namespace cerqall_bench;
+using cercall::qt::TcpTransport;
+
+namespace {
+
+enum class WriteKind { Copy, Move, Segments };
+
+QJsonObject run(TcpTransport::CorkMode mode, WriteKind kind, int frameSize, int burst, int durationMs)
+{
+    QTcpServer server;
+    server.listen(QHostAddress::LocalHost);
+    std::atomic<uint64_t> received { 0 };
+    std::thread reader(sink, server.serverPort(), 1, std::ref(received));
+    server.waitForNewConnection(5000);
+    QTcpSocket* sock = server.nextPendingConnection();
+    Q_ASSERT(sock != nullptr);
+
+    FrameCounter listener(static_cast<uint32_t>(frameSize));
+    auto tr = std::make_shared<TcpTransport>(sock);
+    tr->set_listener(&listener);
+    tr->set_cork_mode(mode);
+
+    const size_t headerSize = 8u;
+    const std::string frame(static_cast<size_t>(frameSize), 'f');
+    uint64_t frames = 0;
+    auto start = Clock::now();
+    while (elapsed_sec(start) * 1000 < durationMs) {
+        for (int i = 0; i < burst; ++i) {
+            switch (kind) {
+                case WriteKind::Copy:
+                    tr->write(frame);
+                    break;
+                case WriteKind::Move:
+                    tr->write(std::string(frame));
+                    break;
+                case WriteKind::Segments:
+                    tr->write_segments({ std::string(headerSize, 'h'),
+                                         std::string(static_cast<size_t>(frameSize) - headerSize, 'p') });
+                    break;
+            }
+        }
+        frames += static_cast<uint64_t>(burst);
+        QCoreApplication::processEvents();
+        while (sock->bytesToWrite() > (4 << 20)) {
+            sock->waitForBytesWritten(100);
+        }
+    }
+    tr->flush();
+    while (sock->bytesToWrite() > 0 && sock->waitForBytesWritten(1000)) {}
+    double secs = elapsed_sec(start);
+
+    tr.reset();
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    reader.join();
+
+    QJsonObject result;
+    result["frame_size"] = frameSize;
+    result["burst"] = burst;
+    result["frames_per_sec"] = frames / secs;
+    result["mb_per_sec"] = received.load() / secs / 1e6;
+    return result;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_tcpwrite";
+
+    int durationMs = int_option("duration-ms", 2000);
+    int frameSize = int_option("frame-size", 64);
+    int burst = int_option("burst", 32);
+    Report report("tcp_write");
+    report.add("uncorked/copy", run(TcpTransport::CorkMode::Off, WriteKind::Copy, frameSize, burst, durationMs));
+    report.add("uncorked/move", run(TcpTransport::CorkMode::Off, WriteKind::Move, frameSize, burst, durationMs));
+    report.add("corked/copy", run(TcpTransport::CorkMode::EventLoop, WriteKind::Copy, frameSize, burst, durationMs));
+    report.add("corked/move", run(TcpTransport::CorkMode::EventLoop, WriteKind::Move, frameSize, burst, durationMs));
+    report.add("corked/segments",
+               run(TcpTransport::CorkMode::EventLoop, WriteKind::Segments, frameSize, burst, durationMs));
+    return report.write();
+}
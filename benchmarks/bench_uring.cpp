@@ -0,0 +1,76 @@
+/*!
+ * \file
+ * \brief     CerQall benchmark - io_uring transport against TcpTransport
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Frames go back and forth between a client transport and a transport accepted by the matching acceptor over
+ * loopback, with one frame and with a window of frames in flight, as in bench_samehost. TcpTransport with
+ * TcpAcceptor is compared to UringTransport with UringAcceptor. Without liburing only TCP is measured.
+ */
+
+#include "debug.h"
+#include "benchutil.h"
+#include "loopback.h"
+#include "cercall/qt/tcpacceptor.h"
+#ifdef HAS_LIBURING
+#include "cercall/qt/uringacceptor.h"
+#endif
+
+using namespace cerqall_bench;
+
+namespace {
+
+/**
+ * Returns an empty object if the acceptor could not be opened.
+ */
+template<typename AcceptorT, typename TransportT>
+QJsonObject run(int frameSize, int window, int total)
+{
+    Echo echo(static_cast<uint32_t>(frameSize));
+    Pinger pinger(static_cast<uint32_t>(frameSize), window, static_cast<uint64_t>(total));
+    AcceptedTransport accepted;
+    AcceptorT acceptor(QHostAddress::LocalHost, 0);
+    acceptor.set_listener(&accepted);
+    acceptor.open();
+    if ( !acceptor.is_open()) {
+        return QJsonObject {};
+    }
+    TransportT client(QHostAddress::LocalHost, acceptor.port());
+    client.set_listener(&pinger);
+    client.open();
+    while ( !accepted.myTransport) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+    return ping_pong(client, *accepted.myTransport, pinger, echo);
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    cercall_user_log::programName = "bench_uring";
+
+    int total = int_option("round-trips", 50000);
+    Report report("uring_transport");
+    for (int frameSize : { 64, 4096, 65536 }) {
+        for (int window : { 1, 8 }) {
+            QString suffix = QString("%1/window%2").arg(frameSize).arg(window);
+            report.add("tcp/" + suffix, run<cercall::qt::TcpAcceptor, cercall::qt::TcpTransport>(frameSize, window,
+                                                                                               total));
+#ifdef HAS_LIBURING
+            QJsonObject uring = run<cercall::qt::UringAcceptor, cercall::qt::UringTransport>(frameSize, window,
+                                                                                            total);
+            if ( !uring.isEmpty()) {
+                report.add("uring/" + suffix, uring);
+            }
+#endif
+            QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+        }
+    }
+    return report.write();
+}
@@ -0,0 +1,128 @@
+/*!
+ * \file
+ * \brief     CerQall benchmarks - common helpers
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERQALL_BENCHUTIL_H
+#define CERQALL_BENCHUTIL_H
+
+#include <QCoreApplication>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QFile>
+#include <QStringList>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+namespace cerqall_bench {
+
+using Clock = std::chrono::steady_clock;
+
+inline double elapsed_sec(Clock::time_point start, Clock::time_point end = Clock::now())
+{
+    return std::chrono::duration<double>(end - start).count();
+}
+
+inline double elapsed_usec(Clock::time_point start, Clock::time_point end = Clock::now())
+{
+    return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+/**
+ * Returns the p-th percentile (0 <= p <= 100) of the samples. The vector gets sorted.
+ */
+inline double percentile(std::vector<double>& samples, double p)
+{
+    if (samples.empty()) {
+        return 0.0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t idx = static_cast<size_t>(p / 100.0 * (samples.size() - 1) + 0.5);
+    return samples[std::min(idx, samples.size() - 1)];
+}
+
+/**
+ * Adds the usual latency percentiles of the samples to the result object.
+ */
+inline void add_percentiles(QJsonObject& result, std::vector<double>& samples, const QString& unit = "us")
+{
+    result["p50_" + unit] = percentile(samples, 50);
+    result["p90_" + unit] = percentile(samples, 90);
+    result["p99_" + unit] = percentile(samples, 99);
+    result["p999_" + unit] = percentile(samples, 99.9);
+    result["max_" + unit] = samples.empty() ? 0.0 : samples.back();
+}
+
+/**
+ * Collects benchmark results and writes them as a JSON document.
+ *
+ * The document goes to stdout, or to the file given with the --json <file> command line option.
+ */
+class Report
+{
+public:
+    Report(const QString& benchmark) : myBenchmark(benchmark) {}
+
+    void add(const QString& name, QJsonObject metrics)
+    {
+        metrics["name"] = name;
+        myResults.append(metrics);
+        fprintf(stderr, "%s: %s\n", name.toStdString().c_str(),
+                QJsonDocument(metrics).toJson(QJsonDocument::Compact).constData());
+    }
+
+    int write() const
+    {
+        QJsonObject doc;
+        doc["benchmark"] = myBenchmark;
+        doc["qt_version"] = QString(qVersion());
+        doc["results"] = myResults;
+        QByteArray json = QJsonDocument(doc).toJson();
+
+        QStringList args = QCoreApplication::arguments();
+        int pos = args.indexOf("--json");
+        if (pos >= 0 && pos + 1 < args.size()) {
+            QFile f(args[pos + 1]);
+            if ( !f.open(QIODevice::WriteOnly | QIODevice::Truncate) || f.write(json) != json.size()) {
+                fprintf(stderr, "cannot write %s\n", args[pos + 1].toStdString().c_str());
+                return 1;
+            }
+        } else {
+            fwrite(json.constData(), 1, json.size(), stdout);
+        }
+        return 0;
+    }
+
+private:
+    QString myBenchmark;
+    QJsonArray myResults;
+};
+
+/**
+ * Returns the integer value of a "--name value" command line option, or the default.
+ */
+inline int int_option(const QString& name, int defaultValue)
+{
+    QStringList args = QCoreApplication::arguments();
+    int pos = args.indexOf("--" + name);
+    if (pos >= 0 && pos + 1 < args.size()) {
+        bool ok = false;
+        int v = args[pos + 1].toInt(&ok);
+        if (ok) {
+            return v;
+        }
+    }
+    return defaultValue;
+}
+
+}   //namespace cerqall_bench
+
+#endif //CERQALL_BENCHUTIL_H
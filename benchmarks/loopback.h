@@ -0,0 +1,231 @@
+/*!
+ * \file
+ * \brief     CerQall benchmarks - loopback traffic helpers
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERQALL_LOOPBACK_H
+#define CERQALL_LOOPBACK_H
+
+#include <QEventLoop>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "cercall/acceptor.h"
+#include "cercall/transport.h"
+#include "benchutil.h"
+
+namespace cerqall_bench {
+
+/**
+ * Connects to the loopback port and sends back-to-back frames of the given size until stopped
+ * or until the peer closes the connection. Meant to be run in its own thread.
+ */
+inline void produce(uint16_t port, int frameSize, std::atomic<bool>& stop)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+        std::string chunk(static_cast<size_t>(frameSize) * 64u, 'x');
+        while ( !stop) {
+            if (::send(fd, chunk.data(), chunk.size(), MSG_NOSIGNAL) < 0) {
+                break;
+            }
+        }
+    }
+    ::close(fd);
+}
+
+/**
+ * Opens the given number of connections to the loopback port and reads and discards everything sent over
+ * them, until the peer has closed all of them. Meant to be run in its own thread.
+ */
+inline void sink(uint16_t port, int connections, std::atomic<uint64_t>& received)
+{
+    std::vector<pollfd> fds;
+    for (int i = 0; i < connections; ++i) {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+            fds.push_back(pollfd { fd, POLLIN, 0 });
+        } else {
+            ::close(fd);
+        }
+    }
+    std::vector<char> buf(1 << 20);
+    while ( !fds.empty()) {
+        if (::poll(fds.data(), fds.size(), 1000) < 0) {
+            break;
+        }
+        for (size_t i = 0; i < fds.size(); ) {
+            if (fds[i].revents == 0) {
+                ++i;
+                continue;
+            }
+            ssize_t n = ::recv(fds[i].fd, buf.data(), buf.size(), 0);
+            if (n > 0) {
+                received += static_cast<uint64_t>(n);
+                ++i;
+            } else {
+                ::close(fds[i].fd);
+                fds.erase(fds.begin() + static_cast<long>(i));
+            }
+        }
+    }
+    for (const pollfd& p : fds) {
+        ::close(p.fd);
+    }
+}
+
+/**
+ * Transport listener which consumes fixed-size frames and counts them.
+ */
+struct FrameCounter : public cercall::TransportListener
+{
+    uint32_t myFrameSize;
+    uint64_t myFrames = 0;
+
+    explicit FrameCounter(uint32_t frameSize) : myFrameSize(frameSize) {}
+
+    void on_connected(cercall::Transport&) override {}
+    void on_disconnected(cercall::Transport&) override {}
+    void on_connection_error(cercall::Transport&, const cercall::Error&) override {}
+
+    void on_incoming_data(cercall::Transport& tr, size_t) override
+    {
+        if (tr.get_read_data().size() == myFrameSize) {
+            ++myFrames;
+        }
+        if (tr.is_open()) {
+            tr.read(myFrameSize);
+        }
+    }
+};
+
+/**
+ * Transport listener which sends every frame back.
+ */
+struct Echo : public FrameCounter
+{
+    using FrameCounter::FrameCounter;
+
+    void on_incoming_data(cercall::Transport& tr, size_t) override
+    {
+        tr.write(tr.get_read_data());
+        ++myFrames;
+        tr.read(myFrameSize);
+    }
+};
+
+/**
+ * Transport listener which sends frames and measures the round-trip time until they come back, with a window
+ * of frames in flight.
+ */
+struct Pinger : public FrameCounter
+{
+    std::string myFrame;
+    int myWindow;
+    uint64_t myTotal;
+    uint64_t mySent = 0;
+    std::vector<double> myLatencies;
+    std::vector<Clock::time_point> mySendTimes;
+
+    Pinger(uint32_t frameSize, int window, uint64_t total)
+        : FrameCounter(frameSize), myFrame(frameSize, 'p'), myWindow(window), myTotal(total)
+    {
+        myLatencies.reserve(total);
+        mySendTimes.reserve(total);
+    }
+
+    void start(cercall::Transport& tr)
+    {
+        tr.read(myFrameSize);
+        for (int i = 0; i < myWindow; ++i) {
+            send(tr);
+        }
+    }
+
+    void send(cercall::Transport& tr)
+    {
+        if (mySent < myTotal) {
+            mySendTimes.push_back(Clock::now());
+            ++mySent;
+            tr.write(myFrame);
+        }
+    }
+
+    void on_incoming_data(cercall::Transport& tr, size_t) override
+    {
+        tr.get_read_data();
+        myLatencies.push_back(elapsed_usec(mySendTimes[myFrames]));
+        ++myFrames;
+        tr.read(myFrameSize);
+        send(tr);
+    }
+
+    bool done() const
+    {
+        return myFrames >= myTotal;
+    }
+};
+
+/**
+ * Acceptor listener which keeps the last transport accepted.
+ */
+struct AcceptedTransport : public cercall::AcceptorListener
+{
+    std::shared_ptr<cercall::Transport> myTransport;
+
+    void on_client_accepted(std::shared_ptr<cercall::Transport> tr) override
+    {
+        myTransport = tr;
+    }
+
+    void on_accept_error(const cercall::Error& err) override
+    {
+        fprintf(stderr, "accept error: %s\n", err.message().c_str());
+    }
+};
+
+/**
+ * Runs the ping-pong once the client and server transports are connected.
+ */
+inline QJsonObject ping_pong(cercall::Transport& client, cercall::Transport& server, Pinger& pinger, Echo& echo)
+{
+    server.set_listener(&echo);
+    server.read(echo.myFrameSize);
+
+    client.set_listener(&pinger);
+    auto start = Clock::now();
+    pinger.start(client);
+    while ( !pinger.done()) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+    double secs = elapsed_sec(start);
+
+    QJsonObject result;
+    result["frame_size"] = static_cast<int>(pinger.myFrameSize);
+    result["window"] = pinger.myWindow;
+    result["round_trips_per_sec"] = pinger.myTotal / secs;
+    add_percentiles(result, pinger.myLatencies);
+    return result;
+}
+
+}   //namespace cerqall_bench
+
+#endif //CERQALL_LOOPBACK_H
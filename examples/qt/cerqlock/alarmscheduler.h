@@ -0,0 +1,386 @@
+/*!
+ * \file
+ * \brief     CerQall example - alarm scheduler based on a hierarchical timer wheel
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERQALL_ALARMSCHEDULER_H
+#define CERQALL_ALARMSCHEDULER_H
+
+#include <QElapsedTimer>
+#include <QTimer>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Hierarchical timer wheel with an index by key.
+ *
+ * Time is counted in ticks. Each level has 64 slots, a slot of level n spans 64^n ticks, and entries
+ * further away than the top level can reach wait in an overflow list. An entry is placed at the lowest
+ * level whose slots share the higher bits of its expiry tick with the current tick, and moves down one or
+ * more levels whenever the current tick reaches the start of its slot. Adding and removing entries is O(1);
+ * advancing costs O(1) per entry moved or expired, and skips over runs of empty slots.
+ *
+ * Entries live in a hash map which gives them stable addresses, and the slots are intrusive lists threaded
+ * through them. An entry is freed as soon as it expires or is removed.
+ */
+template<typename Key, typename Value>
+class TimerWheel
+{
+public:
+    static constexpr int SlotBits = 6;
+    static constexpr int Slots = 1 << SlotBits;
+    static constexpr int Levels = 4;
+
+    explicit TimerWheel(uint64_t now = 0u) : myNow(now)
+    {
+        for (auto& level : mySlots) {
+            for (Node*& head : level) {
+                head = nullptr;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    uint64_t now() const
+    {
+        return myNow;
+    }
+
+    size_t size() const
+    {
+        return myNodes.size();
+    }
+
+    bool contains(const Key& key) const
+    {
+        return myNodes.count(key) != 0u;
+    }
+
+    /**
+     * Makes room for the given number of entries, so that adding up to that many does not rehash.
+     */
+    void reserve(size_t count)
+    {
+        myNodes.reserve(count);
+    }
+
+    /**
+     * Adds an entry which expires at the given tick, or at the next one if that is already past.
+     * Returns false if the key is already in use.
+     */
+    bool add(const Key& key, Value value, uint64_t expiry)
+    {
+        auto res = myNodes.emplace(key, Node {});
+        if ( !res.second) {
+            return false;
+        }
+        Node& node = res.first->second;
+        node.myKey = &res.first->first;
+        node.myValue = std::move(value);
+        node.myExpiry = std::max(expiry, myNow + 1u);
+        place(node);
+        return true;
+    }
+
+    /**
+     * Removes the entry, returns false if there is none with this key.
+     */
+    bool remove(const Key& key)
+    {
+        auto it = myNodes.find(key);
+        if (it == myNodes.end()) {
+            return false;
+        }
+        unlink(it->second);
+        myNodes.erase(it);
+        return true;
+    }
+
+    /**
+     * Advances the current tick, calling fn(key, value) for every entry which expires on the way, in the
+     * order of expiry. The function may add and remove entries.
+     */
+    template<typename Fn>
+    void advance_to(uint64_t tick, Fn&& fn)
+    {
+        uint64_t wakeup;
+        while (myNow < tick) {
+            if ( !next_wakeup(wakeup)) {
+                myNow = tick;
+                break;
+            }
+            //Nothing happens before the wakeup tick, so skip right to it.
+            myNow = std::max(myNow, std::min(wakeup, tick) - 1u);
+            if (myNow < tick) {
+                step(fn);
+            }
+        }
+    }
+
+    /**
+     * Gives the earliest tick at which advance_to() may have something to do: the expiry of the next entry,
+     * or the time at which entries further away move down to a lower level. Returns false if empty.
+     */
+    bool next_wakeup(uint64_t& tick) const
+    {
+        if (myNodes.empty()) {
+            return false;
+        }
+        for (int level = 0; level < Levels; ++level) {
+            const int shift = SlotBits * level;
+            const uint64_t blockStart = (myNow >> (shift + SlotBits)) << (shift + SlotBits);
+            for (uint64_t s = ((myNow >> shift) & Mask) + 1u; s < static_cast<uint64_t>(Slots); ++s) {
+                if (mySlots[level][s] != nullptr) {
+                    tick = blockStart + (s << shift);
+                    return true;
+                }
+            }
+        }
+        tick = ((myNow >> TopShift) + 1u) << TopShift;
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        const Key* myKey = nullptr;
+        Value myValue {};
+        uint64_t myExpiry = 0u;
+        Node* myPrev = nullptr;
+        Node* myNext = nullptr;
+        int myLevel = 0;
+        int mySlot = 0;
+    };
+
+    static constexpr uint64_t Mask = Slots - 1;
+    static constexpr int TopShift = SlotBits * Levels;
+
+    std::unordered_map<Key, Node> myNodes;
+    Node* mySlots[Levels][Slots];
+    Node* myOverflow = nullptr;
+    uint64_t myNow;
+
+    Node*& head(int level, int slot)
+    {
+        return level < Levels ? mySlots[level][slot] : myOverflow;
+    }
+
+    void place(Node& node)
+    {
+        int level = 0;
+        while (level < Levels
+               && (node.myExpiry >> (SlotBits * (level + 1))) != (myNow >> (SlotBits * (level + 1)))) {
+            ++level;
+        }
+        node.myLevel = level;
+        node.mySlot = level < Levels ? static_cast<int>((node.myExpiry >> (SlotBits * level)) & Mask) : 0;
+        Node*& first = head(node.myLevel, node.mySlot);
+        node.myPrev = nullptr;
+        node.myNext = first;
+        if (first != nullptr) {
+            first->myPrev = &node;
+        }
+        first = &node;
+    }
+
+    void unlink(Node& node)
+    {
+        if (node.myPrev != nullptr) {
+            node.myPrev->myNext = node.myNext;
+        } else {
+            head(node.myLevel, node.mySlot) = node.myNext;
+        }
+        if (node.myNext != nullptr) {
+            node.myNext->myPrev = node.myPrev;
+        }
+        node.myPrev = node.myNext = nullptr;
+    }
+
+    void cascade(int level, int slot)
+    {
+        //Detached first, because entries of the overflow list may go back to it.
+        Node* node = head(level, slot);
+        head(level, slot) = nullptr;
+        while (node != nullptr) {
+            Node* next = node->myNext;
+            place(*node);
+            node = next;
+        }
+    }
+
+    template<typename Fn>
+    void step(Fn& fn)
+    {
+        const uint64_t t = ++myNow;
+        //Move the entries of the slots starting now down, from the top level, so that they can fall through.
+        int wrapped = 0;
+        while (wrapped < Levels && (t & ((uint64_t(1) << (SlotBits * (wrapped + 1))) - 1u)) == 0u) {
+            ++wrapped;
+        }
+        for (int level = wrapped; level >= 1; --level) {
+            cascade(level, level < Levels ? static_cast<int>((t >> (SlotBits * level)) & Mask) : 0);
+        }
+        const int slot = static_cast<int>(t & Mask);
+        while (Node* node = mySlots[0][slot]) {
+            unlink(*node);
+            auto it = myNodes.find(*node->myKey);
+            Key key = it->first;
+            Value value = std::move(node->myValue);
+            myNodes.erase(it);
+            fn(key, std::move(value));
+        }
+    }
+};
+
+/**
+ * Alarms driven by a single QTimer.
+ *
+ * The alarms are kept in a TimerWheel with a resolution of a few milliseconds. An alarm never fires before
+ * its time, and at most one resolution step plus the timer latency after it. The timer only runs when there
+ * are alarms, and is set to the next time the wheel has something to do.
+ */
+template<typename Key, typename Value>
+class AlarmScheduler
+{
+public:
+    using Handler = std::function<void(const Key&, Value&&)>;
+
+    struct Alarm
+    {
+        Key myKey;
+        Value myValue;
+        std::chrono::milliseconds myAfter;
+    };
+
+    explicit AlarmScheduler(Handler handler, std::chrono::milliseconds resolution = std::chrono::milliseconds(10))
+        : myHandler(std::move(handler)), myResolution(resolution.count() > 0 ? resolution.count() : 1)
+    {
+        myClock.start();
+        myTimer.setSingleShot(true);
+        QObject::connect(&myTimer, &QTimer::timeout, [this]() { advance_to(elapsed()); });
+    }
+
+    size_t size() const
+    {
+        return myWheel.size();
+    }
+
+    /**
+     * Sets an alarm which fires after the given time. Returns false if the key is already in use.
+     */
+    bool set(const Key& key, Value value, std::chrono::milliseconds after)
+    {
+        uint64_t expiry = expiry_tick(elapsed().count(), after);
+        bool added = myWheel.add(key, std::move(value), expiry);
+        if (added && expiry < myTimerTick) {
+            reschedule();
+        }
+        return added;
+    }
+
+    /**
+     * Sets a batch of alarms in one pass, reading the clock and setting the timer once for all of them.
+     * Alarms whose key is already in use are skipped. Returns the number of alarms set.
+     */
+    size_t set(std::vector<Alarm>&& alarms)
+    {
+        const qint64 now = elapsed().count();
+        myWheel.reserve(myWheel.size() + alarms.size());
+        size_t added = 0u;
+        uint64_t earliest = UINT64_MAX;
+        for (Alarm& alarm : alarms) {
+            uint64_t expiry = expiry_tick(now, alarm.myAfter);
+            if (myWheel.add(alarm.myKey, std::move(alarm.myValue), expiry)) {
+                ++added;
+                earliest = std::min(earliest, expiry);
+            }
+        }
+        if (earliest < myTimerTick) {
+            reschedule();
+        }
+        return added;
+    }
+
+    /**
+     * Removes the alarm, returns false if there is no alarm with this key.
+     */
+    bool cancel(const Key& key)
+    {
+        bool removed = myWheel.remove(key);
+        //If the timer fires early, it is just set again.
+        if (myWheel.size() == 0u) {
+            reschedule();
+        }
+        return removed;
+    }
+
+    /**
+     * Removes a batch of alarms, telling for each key whether there was an alarm with it.
+     */
+    std::vector<bool> cancel(const std::vector<Key>& keys)
+    {
+        std::vector<bool> removed;
+        removed.reserve(keys.size());
+        for (const Key& key : keys) {
+            removed.push_back(myWheel.remove(key));
+        }
+        if (myWheel.size() == 0u) {
+            reschedule();
+        }
+        return removed;
+    }
+
+    /**
+     * Fires the alarms due at the given time, counted from the construction of the scheduler.
+     * Normally called by the timer.
+     */
+    void advance_to(std::chrono::milliseconds now)
+    {
+        myWheel.advance_to(static_cast<uint64_t>(now.count() / myResolution), myHandler);
+        reschedule();
+    }
+
+    std::chrono::milliseconds elapsed() const
+    {
+        return std::chrono::milliseconds(myClock.elapsed());
+    }
+
+private:
+    Handler myHandler;
+    const qint64 myResolution;
+    TimerWheel<Key, Value> myWheel;
+    QElapsedTimer myClock;
+    QTimer myTimer;
+    uint64_t myTimerTick = UINT64_MAX;  //Tick for which the timer is set.
+
+    uint64_t expiry_tick(qint64 now, std::chrono::milliseconds after) const
+    {
+        //Rounded up, so that the alarm does not fire early.
+        qint64 due = now + std::max<qint64>(after.count(), 0);
+        return static_cast<uint64_t>((due + myResolution - 1) / myResolution);
+    }
+
+    void reschedule()
+    {
+        if (myWheel.next_wakeup(myTimerTick)) {
+            qint64 delay = static_cast<qint64>(myTimerTick) * myResolution - elapsed().count();
+            myTimer.start(static_cast<int>(std::min<qint64>(std::max<qint64>(delay, 0), INT32_MAX)));
+        } else {
+            myTimerTick = UINT64_MAX;
+            myTimer.stop();
+        }
+    }
+};
+
+#endif //CERQALL_ALARMSCHEDULER_H
@@ -12,18 +12,13 @@
 #define CERCALL_CERQLOCK_CEREAL_SETUP_H
 
 #include "cercall/cereal/binary.h"
-#include <cereal/types/polymorphic.hpp>
+#include <cereal/types/memory.hpp>
 #include <cereal/types/vector.hpp>
 #include <cereal/types/chrono.hpp>
 #include "qcereal.h"
 #include "qlockinterface.h"
 
-CEREAL_REGISTER_TYPE(QlockAlarmEvent);
-
-CEREAL_REGISTER_TYPE(QlockTickEvent);
-
-CEREAL_REGISTER_POLYMORPHIC_RELATION(QlockEvent, QlockAlarmEvent);
-CEREAL_REGISTER_POLYMORPHIC_RELATION(QlockEvent, QlockTickEvent);
+//The events are a closed set, serialized with a type tag by cercall::qt::EventSet, not as polymorphic types.
 
 using QlockSerialization = cercall::cereal::Binary;
 
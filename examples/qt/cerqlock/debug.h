@@ -7,17 +7,36 @@
  *
  * See the LICENSE file for the license terms and conditions.
  *
+ * Log lines are formatted on the calling thread and handed over to a writer thread through a lock-free
+ * queue; the writer thread writes them out in batches. Define CERQALL_SYNC_LOG to write every line
+ * directly instead.
+ *
+ * Arguments which are expensive to compute can be passed as callables, which are only called if the line
+ * is logged. A std::string, or an object with a toStdString() method like QString, can be given for a %s:
+ *
+ *     log<debug>(O_LOG_TOKEN, "tick time: %s", [&t]() { return t.toString(); });
+ *
+ * The CerQall headers log such arguments, like host addresses, in the same way, so a log function used with
+ * them has to take callables and QStrings as well.
  */
 
 #ifndef CERCALL_DEBUG_H
 #define CERCALL_DEBUG_H
 
 #include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdarg>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <cstring>
-#include <regex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 
 namespace cercall_user_log {
 
@@ -51,35 +70,405 @@ const char* levelToStr(LogLevel l)
     }
 }
 
-static std::string programName;
+namespace details {
+
+inline std::string& program_name()
+{
+    static std::string name;
+    return name;
+}
+
+/**
+ * Reduces a __PRETTY_FUNCTION__ string to the qualified function name: the template arguments, the
+ * parameter lists and the return type are left out.
+ */
+inline std::string short_name(const char* pretty)
+{
+    std::string name;
+    const char* with = std::strstr(pretty, " [with ");
+    const char* end = with != nullptr ? with : pretty + std::strlen(pretty);
+    int parens = 0;
+    int angles = 0;
+    for (const char* p = pretty; p != end; ++p) {
+        switch (*p) {
+            case '(':
+                ++parens;
+                continue;
+            case ')':
+                parens -= parens > 0 ? 1 : 0;
+                continue;
+            case '<':
+                ++angles;
+                continue;
+            case '>':
+                angles -= angles > 0 ? 1 : 0;
+                continue;
+            default:
+                break;
+        }
+        if (parens == 0 && angles == 0) {
+            name += *p;
+        }
+    }
+    size_t posLastSpace = name.find_last_of(' ');
+    if (posLastSpace != name.npos) {
+        name.erase(0, posLastSpace + 1);
+    }
+    return name;
+}
+
+/**
+ * Returns the short name of a call site. __PRETTY_FUNCTION__ of a function is always the same string,
+ * so the names are worked out once per thread and call site and then looked up by address.
+ */
+inline const std::string& call_site_name(const char* logToken)
+{
+    static thread_local std::unordered_map<const char*, std::string> names;
+    auto it = names.find(logToken);
+    if (it == names.end()) {
+        it = names.emplace(logToken, short_name(logToken)).first;
+    }
+    return it->second;
+}
+
+template<typename T, typename = void>
+struct is_lazy : std::false_type {};
+
+template<typename T>
+struct is_lazy<T, decltype(void(std::declval<T&>()()))> : std::true_type {};
+
+template<typename T, typename = void>
+struct has_to_std_string : std::false_type {};
+
+template<typename T>
+struct has_to_std_string<T, decltype(void(std::declval<const T&>().toStdString()))> : std::true_type {};
+
+/* The argument conversions below return temporaries which live until the end of the formatting call. */
+
+template<typename T>
+typename std::enable_if<is_lazy<T>::value, decltype(std::declval<T&>()())>::type
+evaluate(T& arg)
+{
+    return arg();
+}
+
+template<typename T>
+typename std::enable_if<!is_lazy<T>::value, const T&>::type
+evaluate(T& arg)
+{
+    return arg;
+}
+
+template<typename T>
+typename std::enable_if<has_to_std_string<T>::value, std::string>::type
+to_text(const T& arg)
+{
+    return arg.toStdString();
+}
+
+template<typename T>
+typename std::enable_if<!has_to_std_string<T>::value, const T&>::type
+to_text(const T& arg)
+{
+    return arg;
+}
+
+inline const char* printable(const std::string& s)
+{
+    return s.c_str();
+}
+
+template<typename T>
+const T& printable(const T& arg)
+{
+    return arg;
+}
+
+/**
+ * A log line, built in a stack buffer unless it gets too long.
+ */
+class LogLine
+{
+public:
+    static constexpr size_t StackSize = 240u;
+
+    const char* data() const
+    {
+        return myIsLong ? myLong.data() : myBuf;
+    }
+
+    size_t size() const
+    {
+        return myIsLong ? myLong.size() : myLength;
+    }
+
+    void append(const char* s, size_t n)
+    {
+        if ( !myIsLong && myLength + n <= StackSize) {
+            std::memcpy(myBuf + myLength, s, n);
+            myLength += n;
+        } else {
+            go_long();
+            myLong.append(s, n);
+        }
+    }
+
+    template<typename... Args>
+    void print(const char* format, Args... args)
+    {
+        if ( !myIsLong) {
+            int n = snprintf(myBuf + myLength, StackSize + 1u - myLength, format, args...);
+            if (n < 0) {
+                return;
+            }
+            if (myLength + static_cast<size_t>(n) <= StackSize) {
+                myLength += static_cast<size_t>(n);
+                return;
+            }
+            go_long();
+        }
+        int n = snprintf(nullptr, 0u, format, args...);
+        if (n > 0) {
+            size_t pos = myLong.size();
+            myLong.resize(pos + static_cast<size_t>(n) + 1u);
+            snprintf(&myLong[pos], static_cast<size_t>(n) + 1u, format, args...);
+            myLong.resize(pos + static_cast<size_t>(n));
+        }
+    }
+
+private:
+    char myBuf[StackSize + 1u];     //One more for the terminating null of snprintf.
+    size_t myLength = 0u;
+    bool myIsLong = false;
+    std::string myLong;
+
+    void go_long()
+    {
+        if ( !myIsLong) {
+            myLong.assign(myBuf, myLength);
+            myIsLong = true;
+        }
+    }
+};
+
+/**
+ * Bounded multi-producer, single-consumer queue of log lines, drained by a writer thread.
+ *
+ * Each slot carries a sequence number which tells whether it is free for the producer of a given
+ * position or full for the consumer, so producers only contend on the enqueue position. Lines longer
+ * than a slot are passed in a heap buffer. If the queue is full, producers wait for the writer.
+ */
+class LogSink
+{
+public:
+    static constexpr size_t Capacity = 4096u;       //Power of two.
+    static constexpr size_t LineSize = LogLine::StackSize;
+    static constexpr size_t BatchSize = 64u * 1024u;
+
+    static LogSink& instance()
+    {
+        static LogSink sink;
+        return sink;
+    }
+
+    /**
+     * False once the sink is gone at program exit; lines are then written directly.
+     */
+    static bool alive()
+    {
+        return alive_flag().load(std::memory_order_acquire);
+    }
+
+    void push(const char* line, size_t len)
+    {
+        uint64_t pos = myEnqueuePos.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &mySlots[pos & (Capacity - 1u)];
+            uint64_t seq = slot->mySeq.load(std::memory_order_acquire);
+            int64_t dif = static_cast<int64_t>(seq - pos);
+            if (dif == 0) {
+                if (myEnqueuePos.compare_exchange_weak(pos, pos + 1u, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                wake_writer();
+                std::this_thread::yield();     //Full.
+                pos = myEnqueuePos.load(std::memory_order_relaxed);
+            } else {
+                pos = myEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        if (len <= LineSize) {
+            std::memcpy(slot->myLine, line, len);
+            slot->myLong = nullptr;
+        } else {
+            slot->myLong = new std::string(line, len);
+        }
+        slot->myLength = static_cast<uint32_t>(len);
+        //Sequentially consistent, so that either the writer sees the line or this sees the writer sleeping.
+        slot->mySeq.store(pos + 1u);
+        if (myWriterSleeping.load()) {
+            wake_writer();
+        }
+    }
+
+    /**
+     * Waits until all lines logged so far are written.
+     */
+    void flush()
+    {
+        uint64_t target = myEnqueuePos.load(std::memory_order_acquire);
+        while (myWrittenPos.load(std::memory_order_acquire) < target) {
+            wake_writer();
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> mySeq;
+        uint32_t myLength;
+        std::string* myLong;
+        char myLine[LineSize];
+    };
+
+    std::unique_ptr<Slot[]> mySlots;
+    alignas(64) std::atomic<uint64_t> myEnqueuePos { 0u };
+    alignas(64) uint64_t myDequeuePos = 0u;
+    std::atomic<uint64_t> myWrittenPos { 0u };
+    std::atomic<bool> myWriterSleeping { false };
+    std::atomic<bool> myStop { false };
+    std::mutex myMutex;
+    std::condition_variable myWakeup;
+    std::thread myWriter;
+
+    LogSink() : mySlots(new Slot[Capacity])
+    {
+        for (size_t i = 0u; i < Capacity; ++i) {
+            mySlots[i].mySeq.store(i, std::memory_order_relaxed);
+        }
+        myWriter = std::thread([this]() { run(); });
+        alive_flag().store(true, std::memory_order_release);
+    }
+
+    ~LogSink()
+    {
+        alive_flag().store(false, std::memory_order_release);
+        myStop = true;
+        wake_writer();
+        myWriter.join();
+    }
+
+    static std::atomic<bool>& alive_flag()
+    {
+        static std::atomic<bool> flag { false };
+        return flag;
+    }
+
+    void wake_writer()
+    {
+        if (myWriterSleeping.exchange(false)) {
+            std::lock_guard<std::mutex> lock(myMutex);
+            myWakeup.notify_one();
+        }
+    }
+
+    bool pending() const
+    {
+        return mySlots[myDequeuePos & (Capacity - 1u)].mySeq.load() == myDequeuePos + 1u;
+    }
+
+    /**
+     * Moves the queued lines into the batch, returns the number of lines moved.
+     */
+    size_t drain(std::string& batch)
+    {
+        size_t lines = 0u;
+        while (batch.size() < BatchSize) {
+            Slot& slot = mySlots[myDequeuePos & (Capacity - 1u)];
+            if (slot.mySeq.load(std::memory_order_acquire) != myDequeuePos + 1u) {
+                break;
+            }
+            if (slot.myLong != nullptr) {
+                batch += *slot.myLong;
+                delete slot.myLong;
+            } else {
+                batch.append(slot.myLine, slot.myLength);
+            }
+            slot.mySeq.store(myDequeuePos + Capacity, std::memory_order_release);
+            ++myDequeuePos;
+            ++lines;
+        }
+        return lines;
+    }
+
+    void run()
+    {
+        std::string batch;
+        batch.reserve(BatchSize + LineSize);
+        int idleRounds = 0;
+        for (;;) {
+            batch.clear();
+            if (drain(batch) > 0u) {
+                fwrite(batch.data(), 1u, batch.size(), stdout);
+                fflush(stdout);
+                myWrittenPos.store(myDequeuePos, std::memory_order_release);
+                idleRounds = 0;
+                continue;
+            }
+            if (myStop) {
+                break;
+            }
+            if (++idleRounds < 10) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            } else {
+                //Producers wake the writer up only once it has been idle for a while.
+                std::unique_lock<std::mutex> lock(myMutex);
+                myWriterSleeping = true;
+                if ( !pending() && !myStop) {
+                    myWakeup.wait_for(lock, std::chrono::milliseconds(100));
+                }
+                myWriterSleeping = false;
+            }
+        }
+    }
+};
+
+}   //namespace details
+
+/**
+ * The program name shown in the log. Every translation unit refers to the same string.
+ */
+static std::string& programName = details::program_name();
 
 template<LogLevel StaticLevel, typename... Args>
 void log(LogLevel ll, const char* logToken, const char* format, Args... args)
 {
     if /* constexpr */ (StaticLevel <= ENABLED_LOG_LEVEL) {
-        fprintf(stdout, "%s [%s] ", programName.c_str(), levelToStr(ll));
+        details::LogLine line;
+        line.print("%s [%s] ", programName.c_str(), levelToStr(ll));
         if (*logToken != 0) {
-            std::string tok = std::regex_replace(logToken, std::regex("([^[]*) \\[with .*\\](.*)"), "$1$2");
-            do {
-                tok = std::regex_replace(tok, std::regex("([^(]*)\\([^)]*\\)(.*)"), "$1$2");
-            } while (tok.find_first_of('(') != tok.npos);
-
-            do {
-                tok = std::regex_replace(tok, std::regex("([^<]*)<[^>]*>(.*)"), "$1$2");
-            } while (tok.find_first_of('<') != tok.npos);
-
-            size_t posLastSpace = tok.find_last_of(' ');
-            if (posLastSpace != tok.npos) {
-                tok = tok.substr(posLastSpace + 1);
-            }
-            fprintf(stdout, "%s", tok.c_str());
-            //fprintf(stdout, "%s", logToken);
+            const std::string& name = details::call_site_name(logToken);
+            line.append(name.data(), name.size());
         }
         if (*format != 0) {
-            fprintf(stdout, ": ");
-            fprintf(stdout, format, args...);
+            line.append(": ", 2u);
+            line.print(format, details::printable(details::to_text(details::evaluate(args)))...);
         }
-        fprintf(stdout, "\n");
+        line.append("\n", 1u);
+#ifndef CERQALL_SYNC_LOG
+        details::LogSink& sink = details::LogSink::instance();
+        if (details::LogSink::alive()) {
+            sink.push(line.data(), line.size());
+            if (ll == fatal) {
+                sink.flush();
+            }
+            return;
+        }
+#endif
+        fwrite(line.data(), 1u, line.size(), stdout);
         fflush(stdout);
     }
 }
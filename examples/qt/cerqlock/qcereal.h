@@ -6,25 +6,112 @@
  *  All rights reserved.
  *
  * See the LICENSE file for the license terms and conditions.
+ *
+ * Binary archives get the raw representation of the Qt types: UTF-16 code units of strings, bytes of byte arrays
+ * and integer counts for times and dates, with no formatting and no temporary buffers. Text archives get
+ * readable equivalents where the binary form would not fit, like UTF-8 strings and base64 byte arrays.
  */
 
 #ifndef CERCALL_QCEREAL_H
 #define CERCALL_QCEREAL_H
 
-#include <QTime>
+#include <QByteArray>
+#include <QDate>
+#include <QDateTime>
+#include <QHash>
+#include <QList>
 #include <QString>
+#include <QTime>
+#include <QVector>
+#include <algorithm>
+#include <limits>
+#include <cereal/cereal.hpp>
 #include <cereal/types/string.hpp>
 
 namespace cereal {
 
+namespace qt_detail {
+
+template<class Archive>
+using is_binary_output = traits::is_output_serializable<BinaryData<char>, Archive>;
+
+template<class Archive>
+using is_binary_input = traits::is_input_serializable<BinaryData<char>, Archive>;
+
+/**
+ * Containers are filled in pieces of this size, and reserve no more than this in advance, so that a length read
+ * from the archive which the data does not back up fails with the read instead of allocating first.
+ */
+constexpr std::size_t LoadChunkBytes = 64u * 1024u;
+
+/**
+ * Returns the number of elements read from the archive as the int of a Qt container, or throws.
+ */
+template<typename T>
+int checked_size(size_type size)
+{
+    if (size > static_cast<size_type>(std::numeric_limits<int>::max() / sizeof(T))) {
+        throw Exception("Qt container size out of range: " + std::to_string(size));
+    }
+    return static_cast<int>(size);
+}
+
+/**
+ * Reads the binary data of size elements into a QString, QByteArray or QVector, growing it chunk by chunk.
+ */
+template<class Archive, class Container>
+void load_binary(Archive& ar, Container& c, size_type size)
+{
+    using T = typename std::remove_pointer<decltype(c.data())>::type;
+    const int count = checked_size<T>(size);
+    const int chunk = static_cast<int>(LoadChunkBytes / sizeof(T));
+    c.resize(0);
+    for (int done = 0; done < count; ) {
+        const int n = std::min(count - done, chunk);
+        c.resize(done + n);
+        ar(binary_data(c.data() + done, static_cast<std::size_t>(n) * sizeof(T)));
+        done += n;
+    }
+}
+
+/**
+ * Number of elements to reserve for a container of size elements read one by one.
+ */
+template<typename T>
+int reserve_size(size_type size)
+{
+    return std::min(checked_size<T>(size), static_cast<int>(std::max<std::size_t>(LoadChunkBytes / sizeof(T), 1u)));
+}
+
+}   //namespace qt_detail
+
 template<class Archive>
-void save(Archive& ar, const QString& s)
+typename std::enable_if<qt_detail::is_binary_output<Archive>::value, void>::type
+save(Archive& ar, const QString& s)
+{
+    ar(make_size_tag(static_cast<size_type>(s.size())));
+    ar(binary_data(s.utf16(), static_cast<std::size_t>(s.size()) * sizeof(ushort)));
+}
+
+template<class Archive>
+typename std::enable_if<qt_detail::is_binary_input<Archive>::value, void>::type
+load(Archive& ar, QString& s)
+{
+    size_type size;
+    ar(make_size_tag(size));
+    qt_detail::load_binary(ar, s, size);
+}
+
+template<class Archive>
+typename std::enable_if<!qt_detail::is_binary_output<Archive>::value, void>::type
+save(Archive& ar, const QString& s)
 {
     ar(s.toStdString());
 }
 
 template<class Archive>
-void load(Archive& ar, QString& s)
+typename std::enable_if<!qt_detail::is_binary_input<Archive>::value, void>::type
+load(Archive& ar, QString& s)
 {
     std::string stds;
     ar(stds);
@@ -32,18 +119,203 @@ void load(Archive& ar, QString& s)
 }
 
 template<class Archive>
-void save(Archive& archive, const QTime& t)
+typename std::enable_if<qt_detail::is_binary_output<Archive>::value, void>::type
+save(Archive& ar, const QByteArray& a)
+{
+    ar(make_size_tag(static_cast<size_type>(a.size())));
+    ar(binary_data(a.constData(), static_cast<std::size_t>(a.size())));
+}
+
+template<class Archive>
+typename std::enable_if<qt_detail::is_binary_input<Archive>::value, void>::type
+load(Archive& ar, QByteArray& a)
 {
-    QString tStr = t.toString();
-    archive(tStr);
+    size_type size;
+    ar(make_size_tag(size));
+    qt_detail::load_binary(ar, a, size);
 }
 
 template<class Archive>
-void load(Archive& archive, QTime& t)
+typename std::enable_if<!qt_detail::is_binary_output<Archive>::value, void>::type
+save(Archive& ar, const QByteArray& a)
+{
+    ar(a.toBase64().toStdString());
+}
+
+template<class Archive>
+typename std::enable_if<!qt_detail::is_binary_input<Archive>::value, void>::type
+load(Archive& ar, QByteArray& a)
+{
+    std::string b64;
+    ar(b64);
+    a = QByteArray::fromBase64(QByteArray::fromStdString(b64));
+}
+
+/**
+ * Milliseconds since midnight, -1 for an invalid time.
+ */
+template<class Archive>
+void save(Archive& ar, const QTime& t)
+{
+    qint32 msecs = t.isValid() ? t.msecsSinceStartOfDay() : -1;
+    ar(msecs);
+}
+
+template<class Archive>
+void load(Archive& ar, QTime& t)
+{
+    qint32 msecs;
+    ar(msecs);
+    t = msecs >= 0 ? QTime::fromMSecsSinceStartOfDay(msecs) : QTime();
+}
+
+/**
+ * Julian day number; an invalid date has its own day number, which maps back to an invalid date.
+ */
+template<class Archive>
+void save(Archive& ar, const QDate& d)
+{
+    qint64 jd = d.toJulianDay();
+    ar(jd);
+}
+
+template<class Archive>
+void load(Archive& ar, QDate& d)
+{
+    qint64 jd;
+    ar(jd);
+    d = QDate::fromJulianDay(jd);
+}
+
+/**
+ * Time spec (-1 for an invalid date-time), milliseconds since the epoch and offset from UTC in seconds.
+ * A Qt::TimeZone date-time is restored with its offset from UTC, as a Qt::OffsetFromUTC one.
+ */
+template<class Archive>
+void save(Archive& ar, const QDateTime& dt)
+{
+    qint8 spec = dt.isValid() ? static_cast<qint8>(dt.timeSpec()) : qint8(-1);
+    qint64 msecs = dt.isValid() ? dt.toMSecsSinceEpoch() : 0;
+    qint32 offset = dt.isValid() ? dt.offsetFromUtc() : 0;
+    ar(spec, msecs, offset);
+}
+
+template<class Archive>
+void load(Archive& ar, QDateTime& dt)
+{
+    qint8 spec;
+    qint64 msecs;
+    qint32 offset;
+    ar(spec, msecs, offset);
+    switch (spec) {
+        case Qt::LocalTime:
+            dt = QDateTime::fromMSecsSinceEpoch(msecs, Qt::LocalTime);
+            break;
+        case Qt::UTC:
+            dt = QDateTime::fromMSecsSinceEpoch(msecs, Qt::UTC);
+            break;
+        case Qt::OffsetFromUTC:
+        case Qt::TimeZone:
+            dt = QDateTime::fromMSecsSinceEpoch(msecs, Qt::OffsetFromUTC, offset);
+            break;
+        default:
+            dt = QDateTime();
+            break;
+    }
+}
+
+/**
+ * Vectors of arithmetic types go to binary archives as one block of memory.
+ */
+template<class Archive, typename T>
+typename std::enable_if<traits::is_output_serializable<BinaryData<T>, Archive>::value
+                        && std::is_arithmetic<T>::value, void>::type
+save(Archive& ar, const QVector<T>& v)
+{
+    ar(make_size_tag(static_cast<size_type>(v.size())));
+    ar(binary_data(v.constData(), static_cast<std::size_t>(v.size()) * sizeof(T)));
+}
+
+template<class Archive, typename T>
+typename std::enable_if<traits::is_input_serializable<BinaryData<T>, Archive>::value
+                        && std::is_arithmetic<T>::value, void>::type
+load(Archive& ar, QVector<T>& v)
+{
+    size_type size;
+    ar(make_size_tag(size));
+    qt_detail::load_binary(ar, v, size);
+}
+
+template<class Archive, typename T>
+typename std::enable_if<!traits::is_output_serializable<BinaryData<T>, Archive>::value
+                        || !std::is_arithmetic<T>::value, void>::type
+save(Archive& ar, const QVector<T>& v)
+{
+    ar(make_size_tag(static_cast<size_type>(v.size())));
+    for (const T& elem : v) {
+        ar(elem);
+    }
+}
+
+template<class Archive, typename T>
+typename std::enable_if<!traits::is_input_serializable<BinaryData<T>, Archive>::value
+                        || !std::is_arithmetic<T>::value, void>::type
+load(Archive& ar, QVector<T>& v)
+{
+    size_type size;
+    ar(make_size_tag(size));
+    v.clear();
+    v.reserve(qt_detail::reserve_size<T>(size));
+    for (size_type i = 0; i < size; ++i) {
+        v.append(T {});
+        ar(v.last());
+    }
+}
+
+template<class Archive, typename T>
+void save(Archive& ar, const QList<T>& l)
+{
+    ar(make_size_tag(static_cast<size_type>(l.size())));
+    for (const T& elem : l) {
+        ar(elem);
+    }
+}
+
+template<class Archive, typename T>
+void load(Archive& ar, QList<T>& l)
+{
+    size_type size;
+    ar(make_size_tag(size));
+    l.clear();
+    l.reserve(qt_detail::reserve_size<T>(size));
+    for (size_type i = 0; i < size; ++i) {
+        l.append(T {});
+        ar(l.last());
+    }
+}
+
+template<class Archive, typename K, typename V>
+void save(Archive& ar, const QHash<K, V>& h)
+{
+    ar(make_size_tag(static_cast<size_type>(h.size())));
+    for (auto it = h.constBegin(); it != h.constEnd(); ++it) {
+        ar(make_map_item(it.key(), it.value()));
+    }
+}
+
+template<class Archive, typename K, typename V>
+void load(Archive& ar, QHash<K, V>& h)
 {
-    QString tStr;
-    archive(tStr);
-    t = QTime::fromString(tStr);
+    size_type size;
+    ar(make_size_tag(size));
+    h.clear();
+    h.reserve(qt_detail::reserve_size<std::pair<K, V>>(size));
+    for (size_type i = 0; i < size; ++i) {
+        K key;
+        V value;
+        ar(make_map_item(key, value));
+        h.insert(key, value);
+    }
 }
 
 }   //namespace cereal
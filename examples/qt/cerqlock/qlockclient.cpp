@@ -12,6 +12,7 @@
 #include <QHostAddress>
 #include "debug.h"
 #include "qlockclient.h"
+#include "qlockmulticast.h"
 #include "cercall/qt/tcptransport.h"
 #include "qlockapplication.h"
 
@@ -26,30 +27,32 @@ struct QlockListener : public QlockClient::ServiceListener
     QlockListener(std::shared_ptr<QlockClient>& cc) : myClient(cc) {}
     void on_service_event(std::unique_ptr<QlockClient::EventType> event) override
     {
-        const QlockAlarmEvent* clockEvent = event->get_as<QlockAlarmEvent>();
-        if (clockEvent != nullptr) {
-            log<debug>(O_LOG_TOKEN, "received alarm event %s", clockEvent->myTag.toStdString().c_str());
-            if (clockEvent->myAlarmId == stopAlarm) {
-                myClient->close_service([](const cercall::Result<int>& result) {
-                    if (!result) {
-                        log<error>(O_LOG_TOKEN, "close_service error - %s",
-                                   result.error().message().c_str());
-                    }
-                    if (result.get_value() != 0) {
-                        log<error>(O_LOG_TOKEN, "close_service result: %d", result.get_value());
-                    }
-                    log<debug>(O_LOG_TOKEN, "finish client program now");
-                    QTimer::singleShot(10u, [](){ QCoreApplication::instance()->quit(); });
-                });
-            }
-        } else {
-            const QlockTickEvent* clockTickEvent = event->get_as<QlockTickEvent>();
-            if (clockTickEvent != nullptr) {
-                log<debug>(O_LOG_TOKEN, "tick time: %s",
-                           clockTickEvent->myTickTime.toString().toStdString().c_str());
-            }
+        event->visit(*this);
+    }
+
+    void operator()(const QlockAlarmEvent& clockEvent)
+    {
+        log<debug>(O_LOG_TOKEN, "received alarm event %s", clockEvent.myTag);
+        if (clockEvent.myAlarmId == stopAlarm) {
+            myClient->close_service([](const cercall::Result<int>& result) {
+                if (!result) {
+                    log<error>(O_LOG_TOKEN, "close_service error - %s",
+                               result.error().message().c_str());
+                }
+                if (result.get_value() != 0) {
+                    log<error>(O_LOG_TOKEN, "close_service result: %d", result.get_value());
+                }
+                log<debug>(O_LOG_TOKEN, "finish client program now");
+                QTimer::singleShot(10u, [](){ QCoreApplication::instance()->quit(); });
+            });
         }
     }
+
+    void operator()(const QlockTickEvent& clockTickEvent)
+    {
+        log<debug>(O_LOG_TOKEN, "tick time: %s", [&clockTickEvent]() { return clockTickEvent.myTickTime.toString(); });
+    }
+
 private:
     std::shared_ptr<QlockClient> myClient;
 };
@@ -62,7 +65,7 @@ void get_time(std::shared_ptr<QlockClient>& cc)
                 log<error>(O_LOG_TOKEN, "error - %s", res.error().message().c_str());
                 throw std::runtime_error(res.error().message());
             } else {
-                log<debug>(O_LOG_TOKEN, "Current time: %s", res.get_value().toString().toStdString().c_str());
+                log<debug>(O_LOG_TOKEN, "Current time: %s", [&res]() { return res.get_value().toString(); });
             }
         });
     });
@@ -77,13 +80,26 @@ void set_stop_alarm(std::shared_ptr<QlockClient>& cc, QTime after)
                 log<error>(O_LOG_TOKEN, "set_alarm failed: %s", result.error().message().c_str());
                 throw std::runtime_error(result.error().message());
             } else {
-                log<debug>(O_LOG_TOKEN, "stop alarm set in %s", after.toString().toStdString().c_str());
+                log<debug>(O_LOG_TOKEN, "stop alarm set in %s", [&after]() { return after.toString(); });
                 stopAlarm = result.get_value();
             }
         });
     });
 }
 
+void subscribe(std::shared_ptr<QlockClient>& cc, const QlockSubscription& subscription)
+{
+    QTimer::singleShot(10, [cc, subscription]() {
+        log<debug>(O_LOG_TOKEN, "call subscribe");
+        cc->subscribe(subscription, [](const cercall::Result<void>& result){
+            if ( result.error() ) {
+                log<error>(O_LOG_TOKEN, "subscribe failed: %s", result.error().message().c_str());
+                throw std::runtime_error ( result.error().message() );
+            }
+        });
+    });
+}
+
 void set_clock_tick(std::shared_ptr<QlockClient>& cc, std::chrono::milliseconds interval)
 {
     QTimer::singleShot(10, [cc, interval]() {
@@ -118,14 +134,29 @@ int main(int ac, char **av)
 
         client->add_listener(clockListener);
 
-        while ( !client->is_open()) {
-            app.processEvents();
-        }
-
         log<debug>(O_LOG_TOKEN, "client is open");
 
         get_time(client);
 
+        QlockSubscription stopAlarmEvents;
+        stopAlarmEvents.myEvent = ClockAlarmEvent;
+        stopAlarmEvents.myTag = "stopClient";
+        subscribe(client, stopAlarmEvents);
+
+        //With "--multicast <group>:<port>" the tick events come from the group, or over TCP as a fallback.
+        std::unique_ptr<QlockMulticastEvents> multicastTicks;
+        QStringList args = app.arguments();
+        int pos = args.indexOf("--multicast");
+        if (pos >= 0 && pos + 1 < args.size()) {
+            int colon = args[pos + 1].lastIndexOf(':');
+            multicastTicks = cercall::make_unique<QlockMulticastEvents>(
+                        client, clockListener, QHostAddress(args[pos + 1].left(colon)),
+                        static_cast<quint16>(args[pos + 1].mid(colon + 1).toUInt()));
+            multicastTicks->start();
+        } else {
+            subscribe(client, QlockSubscription::ticks());
+        }
+
         set_stop_alarm(client, QTime(0, 0, 16, 0));
 
         set_clock_tick(client, std::chrono::milliseconds(2000));
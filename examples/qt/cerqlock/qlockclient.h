@@ -13,13 +13,46 @@
 
 #include "qlockinterface.h"
 #include "cercall/client.h"
+#include "cercall/qt/corkscope.h"
+#include "cercall/qt/localtransport.h"
+#include "cercall/qt/tcptransport.h"
 #include "cereal_setup.h"
 
 class QlockClient : public cercall::Client<QlockInterface, QlockSerialization>
 {
 public:
-    QlockClient(std::unique_ptr<cercall::Transport> tr)
-        : cercall::Client<QlockInterface, QlockSerialization>(std::move(tr)) {}
+    QlockClient(std::unique_ptr<cercall::Transport> tr) : QlockClient(tr.get(), std::move(tr)) {}
+
+    /**
+     * Collects the calls made through the client during its lifetime, which are then written to the
+     * transport together, normally with a single system call. The results come back as usual, each to
+     * the closure of its call; the service sends the results of calls which arrive together at once.
+     *
+     *     {
+     *         QlockClient::Batch batch(client);
+     *         for (...) {
+     *             client.set_alarm(tag, after, closure);
+     *         }
+     *     }
+     *
+     * Only Qt socket transports can be batched; with other transports the calls are sent one by one.
+     */
+    class Batch
+    {
+    public:
+        explicit Batch(QlockClient& client)
+        {
+            if (auto tcp = dynamic_cast<cercall::qt::TcpTransport*>(client.myTransport)) {
+                myTcp = cercall::make_unique<cercall::qt::CorkScope<cercall::qt::TcpTransport>>(*tcp);
+            } else if (auto local = dynamic_cast<cercall::qt::LocalTransport*>(client.myTransport)) {
+                myLocal = cercall::make_unique<cercall::qt::CorkScope<cercall::qt::LocalTransport>>(*local);
+            }
+        }
+
+    private:
+        std::unique_ptr<cercall::qt::CorkScope<cercall::qt::TcpTransport>> myTcp;
+        std::unique_ptr<cercall::qt::CorkScope<cercall::qt::LocalTransport>> myLocal;
+    };
 
     void get_time(Closure<QTime> closure) override
     {
@@ -41,10 +74,37 @@ public:
         send_call(__func__, closure, alarm);
     }
 
+    void set_alarms(std::vector<QlockAlarmRequest> alarms, Closure<std::vector<ClockAlarmId>> closure) override
+    {
+        send_call(__func__, closure, alarms);
+    }
+
+    void cancel_alarms(std::vector<ClockAlarmId> alarms, Closure<std::vector<bool>> closure) override
+    {
+        send_call(__func__, closure, alarms);
+    }
+
+    void subscribe(QlockSubscription subscription, Closure<void> closure) override
+    {
+        send_call(__func__, closure, subscription);
+    }
+
+    void unsubscribe(QlockSubscription subscription, Closure<void> closure) override
+    {
+        send_call(__func__, closure, subscription);
+    }
+
     void close_service(cercall::Closure<int> closure) override
     {
         send_call(__func__, closure);
     }
+
+private:
+    cercall::Transport* myTransport;    //Owned by the base class.
+
+    //The transport is also passed by plain pointer, so that its address is kept once the unique_ptr moves to the base.
+    QlockClient(cercall::Transport* transport, std::unique_ptr<cercall::Transport>&& tr)
+        : cercall::Client<QlockInterface, QlockSerialization>(std::move(tr)), myTransport(transport) {}
 };
 
 #endif // CERQALL_QLOCKCLIENT_H
@@ -15,7 +15,9 @@
 #include <QString>
 #include <QTime>
 #include <chrono>
+#include <vector>
 #include "cercall/cercall.h"
+#include "cercall/qt/eventset.h"
 
 using ClockAlarmId = qint32;
 
@@ -24,75 +26,105 @@ enum EventNames {
     ClockTickEvent = QEvent::User + 101U
 };
 
-class QlockEvent : public QEvent
+O_REGISTER_TYPE(QlockAlarmEvent);
+
+class QlockAlarmEvent
 {
 public:
-    QlockEvent() : QEvent(QEvent::None)
-    {
-    }
-
-    QlockEvent(QEvent::Type et) : QEvent(et)
-    {
-    }
+    QlockAlarmEvent() = default;
+    QlockAlarmEvent(ClockAlarmId alarm, const QString &tag) : myAlarmId(alarm), myTag(tag) {}
 
-    //QEvent already has a virtual destructor.
-
-    template<class DerivedEvent>
-    const DerivedEvent* get_as() const
-    {
-        return dynamic_cast<const DerivedEvent*>(this);
-    }
+    ClockAlarmId myAlarmId = 0;
+    QString myTag;
 
     template<class A>
     void serialize(A& ar)
     {
-        ar(t);
+        ar(myTag, myAlarmId);
     }
 };
 
-O_REGISTER_TYPE(QlockAlarmEvent);
 
-class QlockAlarmEvent : public QlockEvent
+O_REGISTER_TYPE(QlockTickEvent);
+
+class QlockTickEvent
 {
-    static QEvent::Type myEventType;
 public:
-    QlockAlarmEvent() : QlockEvent(myEventType) {}
-    QlockAlarmEvent(ClockAlarmId alarm, const QString &tag) : QlockEvent(myEventType), myAlarmId(alarm), myTag(tag) {}
+    QlockTickEvent() = default;
+    QlockTickEvent(const QTime& time) : myTickTime(time) {}
 
-    ClockAlarmId myAlarmId;
-    QString myTag;
+    QTime myTickTime;
 
     template<class A>
     void serialize(A& ar)
     {
-        ar(myTag, myAlarmId);
+        ar(myTickTime);
     }
 };
 
-QEvent::Type QlockAlarmEvent::myEventType
-    = static_cast<QEvent::Type>(QEvent::registerEventType(QEvent::User + 100U));
-
+/**
+ * The events of the clock service. New event types are added at the end, so that the tags of the others stay.
+ */
+using QlockEvent = cercall::qt::EventSet<QlockAlarmEvent, QlockTickEvent>;
 
-O_REGISTER_TYPE(QlockTickEvent);
+O_REGISTER_TYPE(QlockSubscription);
 
-class QlockTickEvent : public QlockEvent
+/**
+ * Selects the events which a client receives. Alarm events may be narrowed down to a tag or an alarm id;
+ * an empty tag and a zero id match any alarm.
+ */
+struct QlockSubscription
 {
-    static QEvent::Type myEventType;
-public:
-    QlockTickEvent() : QlockEvent(myEventType) {}
-    QlockTickEvent(const QTime& time) : QlockEvent(myEventType), myTickTime(time) {}
+    qint32 myEvent = ClockAlarmEvent;   //ClockAlarmEvent or ClockTickEvent
+    QString myTag;
+    ClockAlarmId myAlarmId = 0;
 
-    QTime myTickTime;
+    static QlockSubscription ticks()
+    {
+        QlockSubscription subscription;
+        subscription.myEvent = ClockTickEvent;
+        return subscription;
+    }
+
+    bool matches_tick() const
+    {
+        return myEvent == ClockTickEvent;
+    }
+
+    bool matches_alarm(ClockAlarmId alarm, const QString& tag) const
+    {
+        return myEvent == ClockAlarmEvent && (myAlarmId == 0 || myAlarmId == alarm)
+                && (myTag.isEmpty() || myTag == tag);
+    }
+
+    bool operator==(const QlockSubscription& other) const
+    {
+        return myEvent == other.myEvent && myTag == other.myTag && myAlarmId == other.myAlarmId;
+    }
 
     template<class A>
     void serialize(A& ar)
     {
-        ar(myTickTime);
+        ar(myEvent, myTag, myAlarmId);
     }
 };
 
-QEvent::Type QlockTickEvent::myEventType
-    = static_cast<QEvent::Type>(QEvent::registerEventType(QEvent::User + 101U));
+O_REGISTER_TYPE(QlockAlarmRequest);
+
+/**
+ * One alarm of QlockInterface::set_alarms().
+ */
+struct QlockAlarmRequest
+{
+    QString myTag;
+    QTime myAfter;
+
+    template<class A>
+    void serialize(A& ar)
+    {
+        ar(myTag, myAfter);
+    }
+};
 
 O_REGISTER_TYPE(QlockInterface);
 
@@ -103,7 +135,6 @@ public:
     template<typename T>
     using Closure = typename cercall::Closure<T>;
 
-    //QEvent can't be the EventType because it has no default (parameterless) constructor.
     using EventType = QlockEvent;
 
     virtual void get_time(Closure<QTime> closure) = 0;
@@ -114,6 +145,23 @@ public:
 
     virtual void cancel_alarm(ClockAlarmId alarm, Closure<void> closure) = 0;
 
+    /**
+     * Sets all the alarms with one call, giving their ids in the order of the requests.
+     */
+    virtual void set_alarms(std::vector<QlockAlarmRequest> alarms, Closure<std::vector<ClockAlarmId>> closure) = 0;
+
+    /**
+     * Cancels all the alarms with one call, telling for each of them whether it was still pending.
+     */
+    virtual void cancel_alarms(std::vector<ClockAlarmId> alarms, Closure<std::vector<bool>> closure) = 0;
+
+    /**
+     * Events are sent only to the clients which subscribed to them.
+     */
+    virtual void subscribe(QlockSubscription subscription, Closure<void> closure) = 0;
+
+    virtual void unsubscribe(QlockSubscription subscription, Closure<void> closure) = 0;
+
     virtual void close_service(cercall::Closure<int> closure) = 0;
 };
 
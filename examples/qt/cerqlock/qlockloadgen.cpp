@@ -0,0 +1,712 @@
+/*!
+ * \file
+ * \brief     CerQall example - Qt clock load generator
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ *
+ * Drives a clock service with many QlockClient connections spread over several threads. Each thread sends
+ * calls at a fixed rate whatever the response time of the service (open loop), picks them at random from
+ * the call mix, and may replace its connections at a fixed rate. The latency of a call is counted from the
+ * time at which it was due to be sent, so that a stalled service shows up in the histograms rather than
+ * slowing down the load.
+ *
+ * Options (defaults in brackets):
+ *   --host <address>       service address [127.0.0.1]
+ *   --port <port>          service port [4321]
+ *   --clients <n>          connections, over all threads [100]
+ *   --threads <n>          client threads [4]
+ *   --rate <n>             calls per second, over all threads [1000]
+ *   --duration <sec>       time of the run, from the moment the connections are open [10]
+ *   --mix <call=weight,..> call mix [get_time=70,set_alarm=15,cancel_alarm=10,set_tick_interval=5]
+ *   --churn <n>            connections replaced per second, over all threads [0]
+ *   --alarm-ms <ms>        alarms are set to fire after 50 to this many milliseconds [1000]
+ *   --tick-ms <ms>         interval passed to set_tick_interval [1000]
+ *   --ticks                subscribe every connection to tick events
+ *   --json <file>          write the report to the file instead of stdout
+ */
+
+#include <QtCore>
+#include <QHostAddress>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <unordered_map>
+#include "debug.h"
+#include "qlockclient.h"
+#include "cercall/qt/tcptransport.h"
+#include "qlockapplication.h"
+
+using cercall::log;
+using cercall::debug;
+using cercall::error;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum Call { GetTime, SetAlarm, CancelAlarm, SetTickInterval, CallCount };
+
+const char* const CallNames[CallCount] = { "get_time", "set_alarm", "cancel_alarm", "set_tick_interval" };
+
+const int MinAlarmMs = 50;
+const int ConnectTimeoutMs = 5000;
+const int DrainTimeoutMs = 2000;
+
+struct Options
+{
+    QHostAddress myHost { QHostAddress::LocalHost };
+    quint16 myPort = 4321;
+    int myClients = 100;
+    int myThreads = 4;
+    double myRate = 1000.0;
+    int myDurationSec = 10;
+    std::array<int, CallCount> myMix {{ 70, 15, 10, 5 }};
+    double myChurn = 0.0;
+    int myAlarmMs = 1000;
+    int myTickMs = 1000;
+    bool myTicks = false;
+    QString myJson;
+};
+
+/**
+ * Histogram of microsecond values with 8 buckets per power of two, so that a value is off by at most 1/8
+ * of itself. Recording a value is a few instructions, and histograms of several threads can be merged.
+ */
+class Histogram
+{
+public:
+    static constexpr int SubBits = 3;
+    static constexpr int SubBuckets = 1 << SubBits;
+
+    void record(int64_t usec)
+    {
+        uint64_t v = usec > 0 ? static_cast<uint64_t>(usec) : 0u;
+        ++myBuckets[index(v)];
+        ++myCount;
+        mySum += v;
+        myMax = std::max(myMax, v);
+    }
+
+    void merge(const Histogram& other)
+    {
+        for (size_t i = 0; i < myBuckets.size(); ++i) {
+            myBuckets[i] += other.myBuckets[i];
+        }
+        myCount += other.myCount;
+        mySum += other.mySum;
+        myMax = std::max(myMax, other.myMax);
+    }
+
+    uint64_t count() const
+    {
+        return myCount;
+    }
+
+    /**
+     * The upper bound of the bucket holding the p-th percentile (0 < p <= 100).
+     */
+    double percentile(double p) const
+    {
+        uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100.0 * myCount));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < myBuckets.size(); ++i) {
+            seen += myBuckets[i];
+            if (seen >= rank && seen > 0) {
+                return static_cast<double>(std::min(upper(i), myMax));
+            }
+        }
+        return 0.0;
+    }
+
+    QJsonObject to_json() const
+    {
+        QJsonObject obj;
+        obj["count"] = static_cast<double>(myCount);
+        obj["mean_us"] = myCount > 0 ? static_cast<double>(mySum) / myCount : 0.0;
+        obj["p50_us"] = percentile(50);
+        obj["p90_us"] = percentile(90);
+        obj["p99_us"] = percentile(99);
+        obj["p999_us"] = percentile(99.9);
+        obj["max_us"] = static_cast<double>(myMax);
+        QJsonArray buckets;
+        for (size_t i = 0; i < myBuckets.size(); ++i) {
+            if (myBuckets[i] != 0u) {
+                buckets.append(QJsonArray { static_cast<double>(upper(i)), static_cast<double>(myBuckets[i]) });
+            }
+        }
+        obj["buckets"] = buckets;
+        return obj;
+    }
+
+private:
+    std::array<uint64_t, (64 - SubBits + 1) * SubBuckets> myBuckets {};
+    uint64_t myCount = 0u;
+    uint64_t mySum = 0u;
+    uint64_t myMax = 0u;
+
+    static size_t index(uint64_t v)
+    {
+        if (v < SubBuckets) {
+            return static_cast<size_t>(v);
+        }
+        const int msb = 63 - __builtin_clzll(v);
+        const uint64_t sub = (v >> (msb - SubBits)) & (SubBuckets - 1);
+        return static_cast<size_t>((msb - SubBits + 1) * SubBuckets + sub);
+    }
+
+    //The largest value which goes to bucket i.
+    static uint64_t upper(size_t i)
+    {
+        const size_t group = i / SubBuckets;
+        const uint64_t sub = i % SubBuckets;
+        if (group == 0u) {
+            return sub;
+        }
+        return ((SubBuckets + sub + 1) << (group - 1)) - 1u;
+    }
+};
+
+struct Stats
+{
+    std::array<uint64_t, CallCount> myCalls {};
+    std::array<uint64_t, CallCount> myErrors {};
+    std::array<Histogram, CallCount> myLatency;
+    Histogram myAlarmLag;           //From the time the alarm was due to its event.
+    Histogram myTickLag;            //From the tick time in the event to its arrival.
+    uint64_t myMissed = 0u;         //Calls due while no connection was open.
+    uint64_t myUnanswered = 0u;     //Calls without a reply at the end of the run.
+    uint64_t myConnects = 0u;
+    uint64_t myConnectErrors = 0u;
+    uint64_t myDisconnects = 0u;
+    uint64_t myChurned = 0u;
+    double mySeconds = 0.0;
+
+    void merge(const Stats& other)
+    {
+        for (int c = 0; c < CallCount; ++c) {
+            myCalls[c] += other.myCalls[c];
+            myErrors[c] += other.myErrors[c];
+            myLatency[c].merge(other.myLatency[c]);
+        }
+        myAlarmLag.merge(other.myAlarmLag);
+        myTickLag.merge(other.myTickLag);
+        myMissed += other.myMissed;
+        myUnanswered += other.myUnanswered;
+        myConnects += other.myConnects;
+        myConnectErrors += other.myConnectErrors;
+        myDisconnects += other.myDisconnects;
+        myChurned += other.myChurned;
+        mySeconds = std::max(mySeconds, other.mySeconds);
+    }
+};
+
+int64_t usec_between(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+}
+
+/**
+ * The connections of one thread and the timers which drive them.
+ */
+class LoadWorker
+{
+public:
+    LoadWorker(const Options& opt, int index, int clients, Stats& stats)
+        : myOptions(opt), myIndex(index), myStats(stats), myRng(static_cast<std::mt19937::result_type>(index + 1)),
+          myMix(opt.myMix.begin(), opt.myMix.end()), myAlarmDelay(MinAlarmMs, std::max(opt.myAlarmMs, MinAlarmMs))
+    {
+        myRate = opt.myRate / opt.myThreads;
+        myCreated = Clock::now();
+        for (int i = 0; i < clients; ++i) {
+            myConnections.push_back(connect());
+        }
+
+        myTimer.setTimerType(Qt::PreciseTimer);
+        QObject::connect(&myTimer, &QTimer::timeout, [this]() { on_timer(); });
+        myTimer.start(1);
+
+        if (opt.myChurn > 0.0) {
+            QObject::connect(&myChurnTimer, &QTimer::timeout, [this]() { churn(); });
+        }
+    }
+
+    ~LoadWorker()
+    {
+        for (auto& conn : myConnections) {
+            drop(conn);
+        }
+    }
+
+private:
+    struct Connection : public QlockClient::ServiceListener
+    {
+        Connection(LoadWorker& worker, const QString& tag) : myWorker(worker), myTag(tag) {}
+
+        void on_service_event(std::unique_ptr<QlockClient::EventType> event) override
+        {
+            myWorker.on_event(*this, *event);
+        }
+
+        LoadWorker& myWorker;
+        QString myTag;
+        cercall::Transport* myTransport = nullptr;
+        std::shared_ptr<QlockClient> myClient;
+        bool myReady = false;
+        bool myFailed = false;
+        uint64_t myInFlight = 0u;
+        std::unordered_map<ClockAlarmId, Clock::time_point> myAlarms;   //Time at which the alarms are due.
+    };
+
+    const Options& myOptions;
+    const int myIndex;
+    Stats& myStats;
+    std::mt19937 myRng;
+    std::discrete_distribution<int> myMix;
+    std::uniform_int_distribution<int> myAlarmDelay;
+    std::vector<std::unique_ptr<Connection>> myConnections;
+    size_t myNext = 0u;
+    int myPending = 0;                  //Connections being opened.
+    int myTagCount = 0;
+    double myRate;
+    Clock::time_point myCreated;
+    Clock::time_point myStart;
+    bool myRunning = false;
+    bool myStopped = false;
+    uint64_t mySent = 0u;
+    uint64_t myInFlight = 0u;
+    QTimer myTimer;
+    QTimer myChurnTimer;
+
+    std::unique_ptr<Connection> connect()
+    {
+        auto conn = cercall::make_unique<Connection>(*this, QString("loadgen-%1-%2").arg(myIndex).arg(myTagCount++));
+        auto transport = cercall::make_unique<cercall::qt::TcpTransport>(myOptions.myHost, myOptions.myPort);
+        transport->set_connect_timeout(std::chrono::milliseconds(ConnectTimeoutMs));
+        conn->myTransport = transport.get();
+        conn->myClient = std::make_shared<QlockClient>(std::move(transport));
+        conn->myClient->add_listener(*conn);
+        //A failed connection is replaced by the timer, not in the closure, which runs inside the transport.
+        Connection* c = conn.get();
+        conn->myTransport->open([this, c](const cercall::Result<bool>& res) {
+            if (res && res.get_value()) {
+                opened(*c);
+            } else {
+                c->myFailed = true;
+            }
+        });
+        ++myPending;
+        return conn;
+    }
+
+    /**
+     * Closes the connection and gives up the calls still waiting for a reply on it.
+     */
+    void drop(std::unique_ptr<Connection>& conn)
+    {
+        if ( !conn->myReady) {
+            --myPending;
+        }
+        //The client may fail the waiting calls when it is closed, which completes them.
+        conn->myClient->close();
+        myInFlight -= conn->myInFlight;
+        myStats.myUnanswered += conn->myInFlight;
+        conn.reset();
+    }
+
+    void replace(std::unique_ptr<Connection>& conn)
+    {
+        drop(conn);
+        conn = connect();
+    }
+
+    void opened(Connection& conn)
+    {
+        conn.myReady = true;
+        --myPending;
+        ++myStats.myConnects;
+        subscribe(conn);
+    }
+
+    void check_failed()
+    {
+        for (auto& conn : myConnections) {
+            if (conn->myFailed) {
+                ++myStats.myConnectErrors;
+                replace(conn);
+            }
+        }
+    }
+
+    void subscribe(Connection& conn)
+    {
+        auto failed = [](const cercall::Result<void>& res) {
+            if (res.error()) {
+                log<error>(O_LOG_TOKEN, "subscribe failed: %s", res.error().message().c_str());
+            }
+        };
+        QlockSubscription alarms;
+        alarms.myEvent = ClockAlarmEvent;
+        alarms.myTag = conn.myTag;
+        conn.myClient->subscribe(alarms, failed);
+        if (myOptions.myTicks) {
+            QlockSubscription ticks;
+            ticks.myEvent = ClockTickEvent;
+            conn.myClient->subscribe(ticks, failed);
+        }
+    }
+
+    void on_timer()
+    {
+        const Clock::time_point now = Clock::now();
+        if (myStopped) {
+            drain(now);
+            return;
+        }
+        if (myPending > 0) {
+            check_failed();
+        }
+        if ( !myRunning) {
+            //The load starts when all connections are open, or when the slow ones have had their time.
+            if (myPending > 0 && now - myCreated < std::chrono::milliseconds(ConnectTimeoutMs)) {
+                return;
+            }
+            start(now);
+        }
+        if (now - myStart >= std::chrono::seconds(myOptions.myDurationSec)) {
+            stop(now);
+            return;
+        }
+        const double secs = std::chrono::duration<double>(now - myStart).count();
+        const uint64_t due = static_cast<uint64_t>(secs * myRate);
+        while (mySent < due) {
+            Clock::time_point callTime = myStart + std::chrono::duration_cast<Clock::duration>(
+                        std::chrono::duration<double>(mySent / myRate));
+            ++mySent;
+            Connection* conn = next_ready();
+            if (conn == nullptr) {
+                ++myStats.myMissed;
+                continue;
+            }
+            send(*conn, static_cast<Call>(myMix(myRng)), callTime);
+        }
+    }
+
+    void start(Clock::time_point now)
+    {
+        myRunning = true;
+        myStart = now;
+        if (myOptions.myChurn > 0.0) {
+            myChurnTimer.start(std::max(1, static_cast<int>(1000.0 * myOptions.myThreads / myOptions.myChurn)));
+        }
+    }
+
+    void stop(Clock::time_point now)
+    {
+        myStopped = true;
+        myChurnTimer.stop();
+        myStats.mySeconds = std::chrono::duration<double>(now - myStart).count();
+        myTimer.start(10);
+    }
+
+    //Waits for the replies still on the way.
+    void drain(Clock::time_point now)
+    {
+        if (myInFlight == 0u || now - myStart > std::chrono::seconds(myOptions.myDurationSec)
+                                                + std::chrono::milliseconds(DrainTimeoutMs)) {
+            myTimer.stop();
+            QThread::currentThread()->quit();
+        }
+    }
+
+    Connection* next_ready()
+    {
+        for (size_t n = 0; n < myConnections.size(); ++n) {
+            myNext = (myNext + 1) % myConnections.size();
+            std::unique_ptr<Connection>& conn = myConnections[myNext];
+            if ( !conn->myReady) {
+                continue;
+            }
+            if ( !conn->myClient->is_open()) {
+                ++myStats.myDisconnects;
+                replace(conn);
+                continue;
+            }
+            return conn.get();
+        }
+        return nullptr;
+    }
+
+    void churn()
+    {
+        if (myConnections.empty()) {
+            return;
+        }
+        std::uniform_int_distribution<size_t> pick(0, myConnections.size() - 1);
+        replace(myConnections[pick(myRng)]);
+        ++myStats.myChurned;
+    }
+
+    void send(Connection& conn, Call call, Clock::time_point callTime)
+    {
+        if (call == CancelAlarm && conn.myAlarms.empty()) {
+            //Nothing to cancel on this connection yet.
+            call = SetAlarm;
+        }
+        ++myStats.myCalls[call];
+        ++myInFlight;
+        ++conn.myInFlight;
+        Connection* c = &conn;
+        switch (call) {
+        case GetTime:
+            conn.myClient->get_time([this, c, callTime](const cercall::Result<QTime>& res) {
+                completed(*c, GetTime, callTime, res.error());
+            });
+            break;
+        case SetAlarm: {
+            const int delay = myAlarmDelay(myRng);
+            const Clock::time_point fireTime = Clock::now() + std::chrono::milliseconds(delay);
+            conn.myClient->set_alarm(conn.myTag, QTime::fromMSecsSinceStartOfDay(delay),
+                                     [this, c, callTime, fireTime](const cercall::Result<ClockAlarmId>& res) {
+                if ( !res.error()) {
+                    c->myAlarms[res.get_value()] = fireTime;
+                }
+                completed(*c, SetAlarm, callTime, res.error());
+            });
+            break;
+        }
+        case CancelAlarm: {
+            auto it = conn.myAlarms.begin();
+            ClockAlarmId alarm = it->first;
+            conn.myAlarms.erase(it);
+            conn.myClient->cancel_alarm(alarm, [this, c, callTime](const cercall::Result<void>& res) {
+                completed(*c, CancelAlarm, callTime, res.error());
+            });
+            break;
+        }
+        case SetTickInterval:
+            conn.myClient->set_tick_interval(std::chrono::milliseconds(myOptions.myTickMs),
+                                             [this, c, callTime](const cercall::Result<void>& res) {
+                completed(*c, SetTickInterval, callTime, res.error());
+            });
+            break;
+        default:
+            break;
+        }
+    }
+
+    void completed(Connection& conn, Call call, Clock::time_point callTime, const cercall::Error& err)
+    {
+        --myInFlight;
+        --conn.myInFlight;
+        if (err) {
+            ++myStats.myErrors[call];
+            log<debug>(O_LOG_TOKEN, "%s failed: %s", CallNames[call], err.message().c_str());
+        } else {
+            myStats.myLatency[call].record(usec_between(callTime, Clock::now()));
+        }
+    }
+
+    void on_event(Connection& conn, const QlockEvent& event)
+    {
+        const Clock::time_point now = Clock::now();
+        if (const QlockAlarmEvent* alarm = event.get_as<QlockAlarmEvent>()) {
+            auto it = conn.myAlarms.find(alarm->myAlarmId);
+            if (it != conn.myAlarms.end()) {
+                myStats.myAlarmLag.record(usec_between(it->second, now));
+                conn.myAlarms.erase(it);
+            }
+        } else if (const QlockTickEvent* tick = event.get_as<QlockTickEvent>()) {
+            //The tick time has a resolution of a millisecond, and the service runs on the same clock.
+            myStats.myTickLag.record(int64_t(tick->myTickTime.msecsTo(QTime::currentTime())) * 1000);
+        }
+    }
+};
+
+class LoadThread : public QThread
+{
+public:
+    LoadThread(const Options& opt, int index, int clients) : myOptions(opt), myIndex(index), myClients(clients) {}
+
+    const Stats& stats() const
+    {
+        return myStats;
+    }
+
+protected:
+    void run() override
+    {
+        LoadWorker worker(myOptions, myIndex, myClients, myStats);
+        exec();
+    }
+
+private:
+    const Options& myOptions;
+    const int myIndex;
+    const int myClients;
+    Stats myStats;
+};
+
+QString string_option(const QStringList& args, const QString& name, const QString& defaultValue)
+{
+    int pos = args.indexOf("--" + name);
+    return (pos >= 0 && pos + 1 < args.size()) ? args[pos + 1] : defaultValue;
+}
+
+bool parse_options(const QStringList& args, Options& opt)
+{
+    bool ok = true;
+    auto number = [&](const QString& name, double defaultValue) {
+        bool valid = true;
+        double v = string_option(args, name, QString::number(defaultValue)).toDouble(&valid);
+        if ( !valid || v < 0) {
+            fprintf(stderr, "invalid value of --%s\n", name.toStdString().c_str());
+            ok = false;
+        }
+        return v;
+    };
+
+    opt.myHost = QHostAddress(string_option(args, "host", opt.myHost.toString()));
+    opt.myPort = static_cast<quint16>(number("port", opt.myPort));
+    opt.myClients = static_cast<int>(number("clients", opt.myClients));
+    opt.myThreads = std::max(1, static_cast<int>(number("threads", opt.myThreads)));
+    opt.myRate = number("rate", opt.myRate);
+    opt.myDurationSec = static_cast<int>(number("duration", opt.myDurationSec));
+    opt.myChurn = number("churn", opt.myChurn);
+    opt.myAlarmMs = static_cast<int>(number("alarm-ms", opt.myAlarmMs));
+    opt.myTickMs = static_cast<int>(number("tick-ms", opt.myTickMs));
+    opt.myTicks = args.contains("--ticks");
+    opt.myJson = string_option(args, "json", QString());
+    if (opt.myHost.isNull()) {
+        fprintf(stderr, "invalid value of --host\n");
+        ok = false;
+    }
+
+    QString mix = string_option(args, "mix", QString());
+    if ( !mix.isEmpty()) {
+        opt.myMix.fill(0);
+        for (const QString& item : mix.split(',', QString::SkipEmptyParts)) {
+            QStringList kv = item.split('=');
+            const char* const* name = std::find(std::begin(CallNames), std::end(CallNames), kv[0].trimmed());
+            bool valid = kv.size() == 2 && name != std::end(CallNames);
+            int weight = valid ? kv[1].toInt(&valid) : 0;
+            if ( !valid || weight < 0) {
+                fprintf(stderr, "invalid call mix item: %s\n", item.toStdString().c_str());
+                ok = false;
+            } else {
+                opt.myMix[static_cast<size_t>(name - std::begin(CallNames))] = weight;
+            }
+        }
+    }
+    if (std::accumulate(opt.myMix.begin(), opt.myMix.end(), 0) == 0) {
+        fprintf(stderr, "the call mix is empty\n");
+        ok = false;
+    }
+    return ok;
+}
+
+QJsonObject report(const Options& opt, const Stats& stats)
+{
+    QJsonObject config;
+    config["host"] = opt.myHost.toString();
+    config["port"] = opt.myPort;
+    config["clients"] = opt.myClients;
+    config["threads"] = opt.myThreads;
+    config["rate"] = opt.myRate;
+    config["duration_sec"] = opt.myDurationSec;
+    config["churn"] = opt.myChurn;
+    config["ticks"] = opt.myTicks;
+    QJsonObject mix;
+    for (int c = 0; c < CallCount; ++c) {
+        mix[CallNames[c]] = opt.myMix[c];
+    }
+    config["mix"] = mix;
+
+    uint64_t sent = 0u;
+    QJsonObject calls;
+    for (int c = 0; c < CallCount; ++c) {
+        QJsonObject call;
+        call["calls"] = static_cast<double>(stats.myCalls[c]);
+        call["errors"] = static_cast<double>(stats.myErrors[c]);
+        call["latency"] = stats.myLatency[c].to_json();
+        calls[CallNames[c]] = call;
+        sent += stats.myCalls[c];
+    }
+
+    QJsonObject events;
+    events["alarm_lag"] = stats.myAlarmLag.to_json();
+    events["tick_lag"] = stats.myTickLag.to_json();
+
+    QJsonObject connections;
+    connections["opened"] = static_cast<double>(stats.myConnects);
+    connections["failed"] = static_cast<double>(stats.myConnectErrors);
+    connections["dropped"] = static_cast<double>(stats.myDisconnects);
+    connections["churned"] = static_cast<double>(stats.myChurned);
+
+    QJsonObject doc;
+    doc["config"] = config;
+    doc["seconds"] = stats.mySeconds;
+    doc["calls_sent"] = static_cast<double>(sent);
+    doc["calls_per_sec"] = stats.mySeconds > 0.0 ? sent / stats.mySeconds : 0.0;
+    doc["missed"] = static_cast<double>(stats.myMissed);
+    doc["unanswered"] = static_cast<double>(stats.myUnanswered);
+    doc["calls"] = calls;
+    doc["events"] = events;
+    doc["connections"] = connections;
+    return doc;
+}
+
+}   //namespace
+
+int main(int argc, char** argv)
+{
+    cercall_user_log::programName = "qlockloadgen";
+
+    try {
+        QlockApplication app(argc, argv);
+
+        Options opt;
+        if ( !parse_options(app.arguments(), opt)) {
+            return 1;
+        }
+
+        std::vector<std::unique_ptr<LoadThread>> threads;
+        for (int t = 0; t < opt.myThreads; ++t) {
+            int clients = opt.myClients / opt.myThreads + (t < opt.myClients % opt.myThreads ? 1 : 0);
+            threads.push_back(cercall::make_unique<LoadThread>(opt, t, clients));
+            threads.back()->start();
+        }
+        Stats total;
+        for (auto& thread : threads) {
+            thread->wait();
+            total.merge(thread->stats());
+        }
+
+        for (int c = 0; c < CallCount; ++c) {
+            fprintf(stderr, "%-18s calls %8llu  errors %6llu  p50 %8.0f us  p99 %8.0f us  max %8.0f us\n",
+                    CallNames[c], static_cast<unsigned long long>(total.myCalls[c]),
+                    static_cast<unsigned long long>(total.myErrors[c]), total.myLatency[c].percentile(50),
+                    total.myLatency[c].percentile(99), total.myLatency[c].percentile(100));
+        }
+
+        QByteArray json = QJsonDocument(report(opt, total)).toJson();
+        if (opt.myJson.isEmpty()) {
+            fwrite(json.constData(), 1, json.size(), stdout);
+        } else {
+            QFile f(opt.myJson);
+            if ( !f.open(QIODevice::WriteOnly | QIODevice::Truncate) || f.write(json) != json.size()) {
+                log<error>(O_LOG_TOKEN, "cannot write %s", opt.myJson);
+                return 1;
+            }
+        }
+    } catch (std::exception& e) {
+        log<error>(O_LOG_TOKEN, "Exception: %s", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*!
+ * \file
+ * \brief     CerQall example - Qt clock events over multicast
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERQALL_QLOCKMULTICAST_H
+#define CERQALL_QLOCKMULTICAST_H
+
+#include <QTimer>
+#include "qlockclient.h"
+#include "cercall/qt/multicasttransport.h"
+
+/**
+ * Receives the events which the clock service multicasts, see QlockService::set_multicast(), through a
+ * QlockClient over a receiving MulticastTransport, and falls back to the event stream of the connected client
+ * when the multicast does not work out: when nothing arrives for the silence timeout, not even the keepalives
+ * which the sender multicasts in quiet periods, or when more than the allowed share of the messages went
+ * missing. The client is then subscribed to the events over its own
+ * transport. The listener gets the events either way.
+ */
+class QlockMulticastEvents
+{
+public:
+    struct Fallback
+    {
+        std::chrono::milliseconds mySilenceTimeout { 5000 };  //Longer than the keepalive interval of the sender.
+        double myMaxLossRatio = 0.1;
+        uint64_t myMinMessages = 100u;  //Received or missed before the loss ratio counts.
+    };
+
+    QlockMulticastEvents(std::shared_ptr<QlockClient> control, QlockClient::ServiceListener& listener,
+                         const QHostAddress& group, quint16 port,
+                         const std::vector<QlockSubscription>& events = { QlockSubscription::ticks() },
+                         const Fallback& fallback = Fallback {},
+                         const cercall::qt::MulticastOptions& options = cercall::qt::MulticastOptions {})
+        : myControl(std::move(control)), myForwarder(std::make_shared<Forwarder>(listener)), myEvents(events),
+          myFallback(fallback)
+    {
+        auto tr = cercall::make_unique<cercall::qt::MulticastTransport>(
+                    cercall::qt::MulticastTransport::Role::Receiver, group, port, options);
+        myTransport = tr.get();
+        myTransport->set_gap_handler([this](uint64_t, uint64_t) { check_loss(); });
+        myMulticast = std::make_shared<QlockClient>(std::move(tr));
+        mySilenceTimer.setInterval(static_cast<int>(myFallback.mySilenceTimeout.count()));
+        QObject::connect(&mySilenceTimer, &QTimer::timeout, [this]() {
+            if (myTransport->datagrams() == myDatagramsSeen) {
+                fall_back("nothing multicast");
+            }
+            myDatagramsSeen = myTransport->datagrams();
+        });
+    }
+
+    QlockMulticastEvents(const QlockMulticastEvents&) = delete;
+    QlockMulticastEvents& operator=(const QlockMulticastEvents&) = delete;
+
+    ~QlockMulticastEvents()
+    {
+        if (myMulticast) {
+            myMulticast->close();
+        }
+    }
+
+    /**
+     * Joins the group, or falls back at once if it cannot.
+     */
+    void start()
+    {
+        if (myMulticast->open()) {
+            myMulticast->add_listener(*myForwarder);
+            mySilenceTimer.start();
+        } else {
+            fall_back("cannot join the multicast group");
+        }
+    }
+
+    bool on_multicast() const
+    {
+        return myMulticast != nullptr;
+    }
+
+    /**
+     * Messages which went missing on the multicast channel.
+     */
+    uint64_t missed() const
+    {
+        return myMulticast ? myTransport->missed() : myMissed;
+    }
+
+private:
+    /**
+     * Passes the multicast events on until the client falls back.
+     */
+    struct Forwarder : public QlockClient::ServiceListener
+    {
+        explicit Forwarder(QlockClient::ServiceListener& listener) : myListener(listener) {}
+
+        void on_service_event(std::unique_ptr<QlockClient::EventType> event) override
+        {
+            if (myActive) {
+                myListener.on_service_event(std::move(event));
+            }
+        }
+
+        QlockClient::ServiceListener& myListener;
+        bool myActive = true;
+    };
+
+    std::shared_ptr<QlockClient> myControl;
+    std::shared_ptr<Forwarder> myForwarder;
+    std::vector<QlockSubscription> myEvents;
+    Fallback myFallback;
+    std::shared_ptr<QlockClient> myMulticast;
+    cercall::qt::MulticastTransport* myTransport;     //Owned by myMulticast.
+    QTimer mySilenceTimer;
+    uint64_t myDatagramsSeen = 0u;
+    uint64_t myMissed = 0u;
+
+    void check_loss()
+    {
+        const uint64_t missed = myTransport->missed();
+        const uint64_t total = missed + myTransport->messages();
+        if (total >= myFallback.myMinMessages && missed > myFallback.myMaxLossRatio * total) {
+            fall_back("too many multicast events missed");
+        }
+    }
+
+    /**
+     * Leaves the group, from the event loop since the multicast client may be delivering an event, and
+     * subscribes to the events over the connected client instead.
+     */
+    void fall_back(const char* reason)
+    {
+        if ( !myMulticast) {
+            return;
+        }
+        cercall::log<cercall::error>(O_LOG_TOKEN, "%s, falling back to TCP", reason);
+        mySilenceTimer.stop();
+        myMissed = myTransport->missed();
+        myForwarder->myActive = false;
+        std::shared_ptr<QlockClient> multicast = std::move(myMulticast);
+        std::shared_ptr<Forwarder> forwarder = myForwarder;
+        myMulticast = nullptr;
+        QTimer::singleShot(0, [multicast, forwarder]() { multicast->close(); });
+        for (const QlockSubscription& subscription : myEvents) {
+            myControl->subscribe(subscription, [](const cercall::Result<void>& result) {
+                if (result.error()) {
+                    cercall::log<cercall::error>(O_LOG_TOKEN, "subscribe failed: %s",
+                                                 result.error().message().c_str());
+                }
+            });
+        }
+    }
+};
+
+#endif // CERQALL_QLOCKMULTICAST_H
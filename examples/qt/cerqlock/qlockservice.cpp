@@ -9,125 +9,386 @@
  */
 
 #include <QtCore>
-#include <csignal>
-#include <cassert>
+#include <atomic>
 #include "debug.h"
-#include "cercall/qt/tcpacceptor.h"
 #include "cercall/service.h"
 #include "qlockservice.h"
-#include "qlockapplication.h"
 
-static ClockAlarmId nextAlarmId = 1U;
+static std::atomic<ClockAlarmId> nextAlarmId { 1 };
 
 using cercall::log;
 using cercall::debug;
 using cercall::error;
 
 QlockService::QlockService(std::unique_ptr<cercall::Acceptor> ac)
-    : Service<QlockInterface, QlockSerialization>(std::move(ac)), myTickTimer()
+    : Service<QlockInterface, QlockSerialization>(std::move(ac)),
+      myAlarms([this](const ClockAlarmId& alarm, QString&& tag) { alarm_timeout(alarm, tag); }),
+      myTickTimer(),
+      myFanoutTime(cercall::qt::metrics::Registry::global().histogram(
+                       "cerqall_broadcast_fanout_seconds", "Time to queue a broadcast event for all its subscribers.")),
+      myFanoutDeliveries(cercall::qt::metrics::Registry::global().counter(
+                             "cerqall_broadcast_deliveries_total", "Broadcast events queued for subscribers."))
 {
     O_ADD_SERVICE_FUNCTIONS_OF(QlockInterface, false, get_time, set_tick_interval, set_alarm, cancel_alarm);
-    O_ADD_SERVICE_FUNCTIONS_OF(QlockInterface, false, close_service);
+    O_ADD_SERVICE_FUNCTIONS_OF(QlockInterface, false, set_alarms, cancel_alarms);
+    O_ADD_SERVICE_FUNCTIONS_OF(QlockInterface, false, subscribe, unsubscribe, close_service);
     QObject::connect(&myTickTimer, &QTimer::timeout, [this] () { tickTimer(); });
 }
 
+void QlockService::set_multicast(std::shared_ptr<cercall::qt::MulticastTransport> channel,
+                                 const std::vector<QlockSubscription>& events)
+{
+    //The service only ever writes to the channel; the base class closes it when the service stops.
+    const cercall::Transport* tr = channel.get();
+    Service<QlockInterface, QlockSerialization>::on_client_accepted(std::move(channel));
+    mySubscriptions[tr] = events;
+}
+
 void QlockService::get_time(cercall::Closure<QTime> closure)
 {
+    auto timer = time_call(__func__);
     log<debug>(O_LOG_TOKEN, "");
     closure(QTime::currentTime());
 }
 
 void QlockService::tickTimer()
 {
-    broadcast_event<QlockTickEvent>(QTime::currentTime());
+    //Only the latest tick matters to a client which is behind.
+    broadcast_shared(event_key(ClockTickEvent), [](const QlockSubscription& s) { return s.matches_tick(); },
+                     QlockTickEvent(QTime::currentTime()));
 }
 
 void QlockService::set_tick_interval(std::chrono::milliseconds tickInterval, cercall::Closure<void> closure)
 {
+    auto timer = time_call(__func__);
     log<debug>(O_LOG_TOKEN, "");
+    apply_tick_interval(tickInterval);
+    if (myGroup) {
+        myGroup->for_each_other(this, [tickInterval](QlockService& s) { s.apply_tick_interval(tickInterval); });
+    }
+    closure();
+}
+
+void QlockService::apply_tick_interval(std::chrono::milliseconds tickInterval)
+{
     if (tickInterval != std::chrono::milliseconds::zero()) {
         myTickTimer.setInterval(tickInterval);
         myTickTimer.start();
     } else {
         myTickTimer.stop();
     }
+}
+
+void QlockService::set_alarm(QString tag, QTime after, cercall::Closure<ClockAlarmId> closure)
+{
+    auto timer = time_call(__func__);
+    log<debug>(O_LOG_TOKEN, " in %d seconds", QTime(0,0,0).secsTo(after));
+    std::chrono::milliseconds interval = static_cast<std::chrono::milliseconds>(QTime(0,0,0).msecsTo(after));
+    ClockAlarmId id = nextAlarmId++;
+    myAlarms.set(id, tag, interval);
+    closure(id);
+}
+
+void QlockService::alarm_timeout(ClockAlarmId alarm, const QString& tag)
+{
+    log<debug>(O_LOG_TOKEN, "alarm timer for %s", tag);
+    broadcast_alarm(alarm, tag);
+    if (myGroup) {
+        QString tagCopy = tag;
+        myGroup->for_each_other(this, [alarm, tagCopy](QlockService& s) { s.broadcast_alarm(alarm, tagCopy); });
+    }
+}
+
+void QlockService::cancel_alarm(ClockAlarmId alarm, cercall::Closure<void> closure)
+{
+    auto timer = time_call(__func__);
+    if ( !cancel_local_alarm(alarm) && myGroup) {
+        //The alarm was set through the service of another worker thread.
+        myGroup->for_each_other(this, [alarm](QlockService& s) { s.cancel_local_alarm(alarm); });
+    }
     closure();
 }
 
-auto QlockService::find_alarm(ClockAlarmId alarmId) -> std::list<QlockService::Alarm>::iterator
+bool QlockService::cancel_local_alarm(ClockAlarmId alarm)
 {
-    return std::find_if(myAlarms.begin(), myAlarms.end(), [alarmId](const Alarm& a) {
-                                   return a.myId == alarmId;
-                               });
+    return myAlarms.cancel(alarm);
 }
 
-void QlockService::set_alarm(QString tag, QTime after, cercall::Closure<ClockAlarmId> closure)
+void QlockService::set_alarms(std::vector<QlockAlarmRequest> alarms,
+                              cercall::Closure<std::vector<ClockAlarmId>> closure)
 {
-    log<debug>(O_LOG_TOKEN, " in %d seconds", QTime(0,0,0).secsTo(after));
-    std::chrono::milliseconds interval = static_cast<std::chrono::milliseconds>(QTime(0,0,0).msecsTo(after));
-    auto shared_this = shared_from_this();
-    myAlarms.emplace(myAlarms.end(), nextAlarmId++, interval, tag);
-    Alarm& theAlarm = myAlarms.back();
-    theAlarm.set_action([shared_this, &theAlarm](){
-        log<debug>(O_LOG_TOKEN, "alarm timer for %s", theAlarm.myTag.toStdString().c_str());
-        shared_this->broadcast_event<QlockAlarmEvent>(theAlarm.myId, theAlarm.myTag);
-        //Purge the alarm.
-        auto it = shared_this->find_alarm(theAlarm.myId);
-        assert(it != shared_this->myAlarms.end());
-        shared_this->myAlarms.erase(it);
-        log<debug>(O_LOG_TOKEN, "alarm purged");
+    auto timer = time_call(__func__);
+    log<debug>(O_LOG_TOKEN, "%d alarms", static_cast<int>(alarms.size()));
+    //The ids of the batch are taken at once.
+    ClockAlarmId id = nextAlarmId.fetch_add(static_cast<ClockAlarmId>(alarms.size()));
+    std::vector<ClockAlarmId> ids;
+    ids.reserve(alarms.size());
+    std::vector<AlarmScheduler<ClockAlarmId, QString>::Alarm> batch;
+    batch.reserve(alarms.size());
+    for (QlockAlarmRequest& alarm : alarms) {
+        ids.push_back(id);
+        batch.push_back({ id++, std::move(alarm.myTag),
+                          std::chrono::milliseconds(QTime(0,0,0).msecsTo(alarm.myAfter)) });
+    }
+    myAlarms.set(std::move(batch));
+    closure(ids);
+}
+
+/**
+ * The alarms of a cancel_alarms() call which were not found by the service of the calling client, and are
+ * looked for by the other services of the group. Only used on the thread of the calling service, but for
+ * myRemote, which is not changed once the other services are asked.
+ */
+struct QlockService::CancelBatch
+{
+    std::vector<ClockAlarmId> myRemote;
+    std::vector<size_t> myIndexes;      //Of the remote alarms in the call.
+    std::vector<bool> myCancelled;
+    cercall::Closure<std::vector<bool>> myClosure;
+    size_t myReplies = 0u;
+};
+
+void QlockService::cancel_alarms(std::vector<ClockAlarmId> alarms, cercall::Closure<std::vector<bool>> closure)
+{
+    auto timer = time_call(__func__);
+    log<debug>(O_LOG_TOKEN, "%d alarms", static_cast<int>(alarms.size()));
+    auto batch = std::make_shared<CancelBatch>();
+    batch->myCancelled = myAlarms.cancel(alarms);
+    for (size_t i = 0; i < alarms.size(); ++i) {
+        if ( !batch->myCancelled[i]) {
+            batch->myRemote.push_back(alarms[i]);
+            batch->myIndexes.push_back(i);
+        }
+    }
+    if (batch->myRemote.empty() || !myGroup) {
+        closure(batch->myCancelled);
+        return;
+    }
+    //Some alarms were set through the services of other worker threads; the result waits for all of them.
+    batch->myClosure = std::move(closure);
+    cancel_remote_alarms(batch);
+}
+
+void QlockService::cancel_remote_alarms(const std::shared_ptr<CancelBatch>& batch)
+{
+    std::shared_ptr<QlockServiceGroup> group = myGroup;
+    const QlockService* self = this;
+    batch->myReplies = group->for_each_other(this, [group, self, batch](QlockService& other) {
+        std::vector<bool> cancelled = other.myAlarms.cancel(batch->myRemote);
+        group->post_to(self, [batch, cancelled]() {
+            for (size_t i = 0; i < cancelled.size(); ++i) {
+                if (cancelled[i]) {
+                    batch->myCancelled[batch->myIndexes[i]] = true;
+                }
+            }
+            if (--batch->myReplies == 0u) {
+                batch->myClosure(batch->myCancelled);
+            }
+        });
     });
-    closure(theAlarm.myId);
+    if (batch->myReplies == 0u) {
+        batch->myClosure(batch->myCancelled);
+    }
 }
 
-void QlockService::cancel_alarm(ClockAlarmId alarm, cercall::Closure<void> closure)
+void QlockService::broadcast_alarm(ClockAlarmId alarm, const QString& tag)
+{
+    broadcast_shared(0u, [alarm, &tag](const QlockSubscription& s) { return s.matches_alarm(alarm, tag); },
+                     QlockAlarmEvent(alarm, tag));
+}
+
+void QlockService::subscribe(QlockSubscription subscription, cercall::Closure<void> closure)
+{
+    auto timer = time_call(__func__);
+    log<debug>(O_LOG_TOKEN, "event %d", subscription.myEvent);
+    if (myCallingClient != nullptr) {
+        Subscriptions& subs = mySubscriptions[myCallingClient];
+        if (std::find(subs.begin(), subs.end(), subscription) == subs.end()) {
+            subs.push_back(subscription);
+        }
+    } else {
+        log<error>(O_LOG_TOKEN, "no calling client");
+    }
+    closure();
+}
+
+void QlockService::unsubscribe(QlockSubscription subscription, cercall::Closure<void> closure)
 {
-    auto it = find_alarm(alarm);
-    if (it != myAlarms.end()) {
-        it->myTimer.stop();
+    auto timer = time_call(__func__);
+    auto it = mySubscriptions.find(myCallingClient);
+    if (it != mySubscriptions.end()) {
+        Subscriptions& subs = it->second;
+        subs.erase(std::remove(subs.begin(), subs.end(), subscription), subs.end());
+        if (subs.empty()) {
+            mySubscriptions.erase(it);
+        }
     }
     closure();
 }
 
-void QlockService::on_connection_error(cercall::Transport&, const cercall::Error& e)
+cercall::qt::metrics::ScopedTimer QlockService::time_call(const char* function)
+{
+#ifdef CERQALL_NO_METRICS
+    (void)function;
+    return cercall::qt::metrics::ScopedTimer(nullptr);
+#else
+    cercall::qt::metrics::Histogram*& histogram = myCallDurations[function];
+    if (histogram == nullptr) {
+        histogram = &cercall::qt::metrics::Registry::global().histogram(
+                    "cerqall_call_duration_seconds", "Time spent executing service calls.",
+                    std::string("function=\"") + function + "\"");
+    }
+    return cercall::qt::metrics::ScopedTimer(histogram);
+#endif
+}
+
+auto QlockService::find_subscribers(const std::function<bool(const QlockSubscription&)>& wanted) const
+    -> std::vector<const cercall::Transport*>
 {
-    log<error>(O_LOG_TOKEN, "client connection error: ", e.message().c_str());
+    std::vector<const cercall::Transport*> result;
+    for (const auto& entry : mySubscriptions) {
+        if (std::any_of(entry.second.begin(), entry.second.end(), wanted)) {
+            result.push_back(entry.first);
+        }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+void QlockService::on_client_accepted(std::shared_ptr<cercall::Transport> tr)
+{
+    if (auto tcp = dynamic_cast<cercall::qt::TcpTransport*>(tr.get())) {
+        tcp->set_flow_control(myFlowControl);
+    }
+    Service<QlockInterface, QlockSerialization>::on_client_accepted(tr);
+}
+
+void QlockService::on_incoming_data(cercall::Transport& tr, size_t len)
+{
+    //Calls are dispatched from here, so the subscription functions can tell which client called them.
+    myCallingClient = &tr;
+    Service<QlockInterface, QlockSerialization>::on_incoming_data(tr, len);
+    myCallingClient = nullptr;
+}
+
+void QlockService::on_disconnected(cercall::Transport& tr)
+{
+    mySubscriptions.erase(&tr);
+    Service<QlockInterface, QlockSerialization>::on_disconnected(tr);
+}
+
+void QlockService::on_connection_error(cercall::Transport& tr, const cercall::Error& e)
+{
+    log<error>(O_LOG_TOKEN, "client connection error: %s", e.message().c_str());
+    mySubscriptions.erase(&tr);
 }
 
 void QlockService::close_service(cercall::Closure<int> closure)
 {
-    QTimer::singleShot(100u, [](){ QCoreApplication::instance()->quit(); });
+    QTimer::singleShot(100u, QCoreApplication::instance(), [](){ QCoreApplication::instance()->quit(); });
     closure(0);
 }
 
-int main(int argc, char *argv[])
+void QlockService::post(std::function<void()> fn)
 {
-    int res;
+    //The tick timer lives in the thread of the service; pending calls are dropped with it.
+    QMetaObject::invokeMethod(&myTickTimer, std::move(fn), Qt::QueuedConnection);
+}
 
-    cercall_user_log::programName = "qlockservice";
+void QlockServiceGroup::add(const std::shared_ptr<QlockService>& service)
+{
+    std::lock_guard<std::mutex> lock(myMutex);
+    myServices.push_back(service);
+}
+
+void QlockServiceGroup::remove(const QlockService* service)
+{
+    std::lock_guard<std::mutex> lock(myMutex);
+    myServices.erase(std::remove_if(myServices.begin(), myServices.end(),
+                                    [service](const std::shared_ptr<QlockService>& s) {
+                                        return s.get() == service;
+                                    }),
+                     myServices.end());
+}
+
+size_t QlockServiceGroup::for_each_other(const QlockService* self, const std::function<void(QlockService&)>& fn)
+{
+    std::lock_guard<std::mutex> lock(myMutex);
+    size_t count = 0u;
+    for (const std::shared_ptr<QlockService>& s : myServices) {
+        if (s.get() != self) {
+            QlockService* other = s.get();
+            other->post([other, fn]() { fn(*other); });
+            ++count;
+        }
+    }
+    return count;
+}
+
+void QlockServiceGroup::post_to(const QlockService* service, std::function<void()> fn)
+{
+    //A service leaves the group before it is destroyed, so it is alive while the lock is held.
+    std::lock_guard<std::mutex> lock(myMutex);
+    for (const std::shared_ptr<QlockService>& s : myServices) {
+        if (s.get() == service) {
+            s->post(std::move(fn));
+            return;
+        }
+    }
+}
 
-    try {
-        QlockApplication app(argc, argv);
+QlockServicePool::QlockServicePool(int workers, const QHostAddress& address, quint16 port,
+                                   const cercall::qt::TcpTransport::FlowControl& flow)
+    : myPool(workers, address, port), myGroup(std::make_shared<QlockServiceGroup>()),
+      myServices(static_cast<size_t>(workers))
+{
+    for (int i = 0; i < workers; ++i) {
+        myPool.run_on_worker(i, [this, i, &flow]() {
+            auto service = std::make_shared<QlockService>(myPool.make_acceptor(i));
+            service->set_flow_control(flow);
+            service->set_group(myGroup);
+            myGroup->add(service);
+            service->start();
+            myServices[static_cast<size_t>(i)] = service;
+        }, true);
+    }
+}
 
-        auto sigHandler = [](int) { QCoreApplication::instance()->quit(); };
-        signal(SIGTERM, sigHandler);
-        signal(SIGINT, sigHandler);
+void QlockServicePool::set_conflation(qint32 eventName, bool on)
+{
+    for (int i = 0; i < myPool.worker_count(); ++i) {
+        myPool.run_on_worker(i, [this, i, eventName, on]() {
+            myServices[static_cast<size_t>(i)]->set_conflation(eventName, on);
+        }, true);
+    }
+}
 
-        log<debug>(O_LOG_TOKEN, "Start qlock service");
-        auto acceptor = cercall::make_unique<cercall::qt::TcpAcceptor>(QHostAddress::LocalHost, 4321);
-        std::shared_ptr<QlockService> service = std::make_shared<QlockService>(std::move(acceptor));
+bool QlockServicePool::set_multicast(const QHostAddress& group, quint16 port,
+                                     const cercall::qt::MulticastOptions& options)
+{
+    //A single sender per group, so that the receivers see one sequence of events.
+    bool ok = false;
+    myPool.run_on_worker(0, [this, &group, port, &options, &ok]() {
+        auto channel = std::make_shared<cercall::qt::MulticastTransport>(
+                    cercall::qt::MulticastTransport::Role::Sender, group, port, options);
+        ok = channel->open();
+        if (ok) {
+            myServices.front()->set_multicast(channel);
+        }
+    }, true);
+    return ok;
+}
 
-        service->start();
-        res = app.exec();
-        log<debug>(O_LOG_TOKEN, "finished app loop");
-        service->stop();
-    } catch (const QException& e) {
-        std::cerr << "QT exception: " << e.what() << "\n";
-    } catch (const std::exception& e) {
-        std::cerr << "Exception: " << e.what() << "\n";
-    } catch (...) {
-        std::cerr << "Unknown exception\n";
+QlockServicePool::~QlockServicePool()
+{
+    myPool.close();
+    for (int i = 0; i < myPool.worker_count(); ++i) {
+        myPool.run_on_worker(i, [this, i]() {
+            std::shared_ptr<QlockService>& service = myServices[static_cast<size_t>(i)];
+            service->stop();
+            myGroup->remove(service.get());
+            service->set_group(nullptr);
+            service.reset();
+        }, true);
     }
-    log<debug>(O_LOG_TOKEN, "Exit qlock service");
-    return res;
 }
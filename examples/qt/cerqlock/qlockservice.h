@@ -12,16 +12,85 @@
 #define CERQALL_QLOCKSERVICE_H
 
 #include <QList>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include "qlockinterface.h"
+#include "alarmscheduler.h"
 #include "cercall/service.h"
+#include "cercall/qt/broadcastscope.h"
+#include "cercall/qt/metrics.h"
+#include "cercall/qt/multicasttransport.h"
+#include "cercall/qt/tcpacceptorpool.h"
 #include "cereal_setup.h"
 
+class QlockService;
+
+/**
+ * The services of one clock, when the clock runs one service per worker thread.
+ * Tick interval changes, alarm cancellations and alarm events are forwarded between them.
+ */
+class QlockServiceGroup
+{
+public:
+    void add(const std::shared_ptr<QlockService>& service);
+
+    void remove(const QlockService* service);
+
+    /**
+     * Runs the function for every service of the group but the given one, each on its own thread.
+     * Returns the number of services it is run for.
+     */
+    size_t for_each_other(const QlockService* self, const std::function<void(QlockService&)>& fn);
+
+    /**
+     * Runs the function on the thread of the service, unless the service has left the group.
+     */
+    void post_to(const QlockService* service, std::function<void()> fn);
+
+private:
+    std::mutex myMutex;
+    std::vector<std::shared_ptr<QlockService>> myServices;
+};
+
 class QlockService : public cercall::Service<QlockInterface, QlockSerialization>,
                      public std::enable_shared_from_this<QlockService>
 {
 public:
     QlockService(std::unique_ptr<cercall::Acceptor> ac);
 
+    /**
+     * Sets the write flow control of the TCP connections of clients accepted from now on.
+     */
+    void set_flow_control(const cercall::qt::TcpTransport::FlowControl& flow)
+    {
+        myFlowControl = flow;
+    }
+
+    /**
+     * Switches conflation of an event type (EventNames) on or off. A conflated event which is still waiting
+     * to be sent to a slow client is replaced by the next one, so that the client only gets the latest.
+     * Only tick events can be conflated; every alarm event counts.
+     */
+    void set_conflation(qint32 eventName, bool on)
+    {
+        if (on) {
+            myConflatedEvents.insert(eventName);
+        } else {
+            myConflatedEvents.erase(eventName);
+        }
+    }
+
+    /**
+     * Sends the events of the given subscriptions, tick events by default, to a multicast group as well,
+     * through a sender channel which is open. The channel takes the events like the client of a subscription,
+     * with the frame shared with the TCP clients; the clients which receive the group do not subscribe to
+     * these events, unless they fall back to TCP. Events stay on the channel until it is closed.
+     */
+    void set_multicast(std::shared_ptr<cercall::qt::MulticastTransport> channel,
+                       const std::vector<QlockSubscription>& events = { QlockSubscription::ticks() });
+
     void get_time(Closure<QTime> closure) override;
 
     void set_tick_interval(std::chrono::milliseconds tickInterval, Closure<void> closure) override;
@@ -30,44 +99,167 @@ public:
 
     void cancel_alarm(ClockAlarmId alarm, Closure<void> closure) override;
 
+    void set_alarms(std::vector<QlockAlarmRequest> alarms, Closure<std::vector<ClockAlarmId>> closure) override;
+
+    void cancel_alarms(std::vector<ClockAlarmId> alarms, Closure<std::vector<bool>> closure) override;
+
+    void subscribe(QlockSubscription subscription, Closure<void> closure) override;
+
+    void unsubscribe(QlockSubscription subscription, Closure<void> closure) override;
+
+    void on_client_accepted(std::shared_ptr<cercall::Transport> tr) override;
+
+    void on_incoming_data(cercall::Transport& tr, size_t len) override;
+
+    void on_disconnected(cercall::Transport& tr) override;
+
     void on_connection_error(cercall::Transport&, const cercall::Error&) override;
 
     void close_service(cercall::Closure<int> closure) override;
 
+    void set_group(std::shared_ptr<QlockServiceGroup> group)
+    {
+        myGroup = group;
+    }
+
+    /**
+     * Runs the function on the thread of this service.
+     */
+    void post(std::function<void()> fn);
+
 private:
-    struct Alarm
+    AlarmScheduler<ClockAlarmId, QString> myAlarms;
+
+    QTimer myTickTimer;
+
+    std::chrono::milliseconds myTickInterval { 0 };
+
+    std::shared_ptr<QlockServiceGroup> myGroup;
+
+    cercall::qt::TcpTransport::FlowControl myFlowControl;
+
+    std::unordered_set<qint32> myConflatedEvents;
+
+    using Subscriptions = std::vector<QlockSubscription>;
+
+    std::unordered_map<const cercall::Transport*, Subscriptions> mySubscriptions;
+
+    /**
+     * Transport of the client whose call is being executed.
+     */
+    const cercall::Transport* myCallingClient = nullptr;
+
+    /**
+     * Call duration histograms by the __func__ of the service functions, see time_call().
+     */
+    std::unordered_map<const char*, cercall::qt::metrics::Histogram*> myCallDurations;
+
+    cercall::qt::metrics::Histogram& myFanoutTime;
+
+    cercall::qt::metrics::Counter& myFanoutDeliveries;
+
+    /**
+     * Measures the execution of a service function until the returned timer goes out of scope. Results
+     * which wait for the other services of the group are not included.
+     */
+    cercall::qt::metrics::ScopedTimer time_call(const char* function);
+
+    /**
+     * Broadcasts the event to the clients with a matching subscription, with a single frame shared by all
+     * their transports. The event is not even serialized if no client wants it. Events with the same
+     * non-zero key, made by event_key(), make the older ones obsolete, see cercall::qt::BroadcastScope.
+     */
+    void broadcast_shared(uint64_t eventKey, const std::function<bool(const QlockSubscription&)>& wanted,
+                          const QlockEvent& event)
     {
-        QTimer myTimer;
-        QString myTag;
-        ClockAlarmId myId;
-        std::function<void()> myAlarmAction;
-        explicit Alarm(ClockAlarmId id, std::chrono::milliseconds interval, QString tag)
-        : myTimer(), myTag(tag), myId(id)
-        {
-            myTimer.singleShot(interval, [this] () { timeout(); });
+        auto subscribers = std::make_shared<std::vector<const cercall::Transport*>>(find_subscribers(wanted));
+        if (subscribers->empty()) {
+            return;
         }
+        //Recorded after the scope has ended, when the event is queued for all subscribers.
+        cercall::qt::metrics::ScopedTimer timer(&myFanoutTime);
+        myFanoutDeliveries.add(subscribers->size());
+        cercall::qt::BroadcastScope scope([subscribers](const cercall::Transport& tr) {
+            return std::binary_search(subscribers->begin(), subscribers->end(), &tr);
+        });
+        scope.set_event_key(eventKey);
+        scope.set_conflation(myConflatedEvents.count(static_cast<qint32>(eventKey >> 32)) != 0u);
+        broadcast_event<QlockEvent>(event);
+    }
 
-        void set_action(std::function<void()> action)
-        {
-            myAlarmAction = action;
-        }
+    static uint64_t event_key(qint32 eventName, uint32_t subKey = 0u)
+    {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(eventName)) << 32) | subKey;
+    }
 
-        void timeout()
-        {
-            myAlarmAction();
-        }
-    };
+    /**
+     * Returns the sorted transports of the clients with a matching subscription.
+     */
+    std::vector<const cercall::Transport*>
+    find_subscribers(const std::function<bool(const QlockSubscription&)>& wanted) const;
 
-    std::list<Alarm> myAlarms;
+    void broadcast_alarm(ClockAlarmId alarm, const QString& tag);
 
-    QTimer myTickTimer;
+    void alarm_timeout(ClockAlarmId alarm, const QString& tag);
 
-    std::chrono::milliseconds myTickInterval { 0 };
+    void apply_tick_interval(std::chrono::milliseconds tickInterval);
+
+    bool cancel_local_alarm(ClockAlarmId alarm);
 
-    std::list<Alarm>::iterator find_alarm(ClockAlarmId alarmId);
+    struct CancelBatch;
+
+    void cancel_remote_alarms(const std::shared_ptr<CancelBatch>& batch);
 
     void tickTimer();
 };
 
+/**
+ * Runs one clock service per worker thread of a TcpAcceptorPool, all in one QlockServiceGroup.
+ * The services are stopped when the pool is destroyed.
+ */
+class QlockServicePool
+{
+public:
+    QlockServicePool(int workers, const QHostAddress& address, quint16 port,
+                     const cercall::qt::TcpTransport::FlowControl& flow = {});
+
+    QlockServicePool(const QlockServicePool&) = delete;
+    QlockServicePool& operator=(const QlockServicePool&) = delete;
+
+    ~QlockServicePool();
+
+    bool listen()
+    {
+        return myPool.listen();
+    }
+
+    quint16 port() const
+    {
+        return myPool.port();
+    }
+
+    QString error_string() const
+    {
+        return myPool.error_string();
+    }
+
+    /**
+     * Sets the conflation of an event type in all services, see QlockService::set_conflation().
+     */
+    void set_conflation(qint32 eventName, bool on);
+
+    /**
+     * Multicasts events to the group through the service of the first worker, see QlockService::set_multicast().
+     * Returns false if the sender socket cannot be opened.
+     */
+    bool set_multicast(const QHostAddress& group, quint16 port,
+                       const cercall::qt::MulticastOptions& options = cercall::qt::MulticastOptions {});
+
+private:
+    cercall::qt::TcpAcceptorPool myPool;
+    std::shared_ptr<QlockServiceGroup> myGroup;
+    std::vector<std::shared_ptr<QlockService>> myServices;
+};
+
 #endif //CERQALL_QLOCKSERVICE_H
 
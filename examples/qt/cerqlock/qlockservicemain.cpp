@@ -0,0 +1,157 @@
+/*!
+ * \file
+ * \brief     CerQall example - QT clock service program
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#include <QtCore>
+#include <csignal>
+#include <iostream>
+#include "debug.h"
+#include "cercall/qt/metricsserver.h"
+#include "cercall/qt/tcpacceptor.h"
+#include "qlockservice.h"
+#include "qlockapplication.h"
+
+using cercall::log;
+using cercall::debug;
+using cercall::error;
+
+/**
+ * Returns the flow control of client connections given by the "--overflow drop|conflate|disconnect" option.
+ */
+static cercall::qt::TcpTransport::FlowControl flow_control(const QStringList& args)
+{
+    using Policy = cercall::qt::TcpTransport::OverflowPolicy;
+    cercall::qt::TcpTransport::FlowControl flow;
+    int pos = args.indexOf("--overflow");
+    QString policy = (pos >= 0 && pos + 1 < args.size()) ? args[pos + 1] : QString("drop");
+    if (policy == "conflate") {
+        flow.myPolicy = Policy::Conflate;
+    } else if (policy == "disconnect") {
+        flow.myPolicy = Policy::Disconnect;
+    } else if (policy != "drop") {
+        log<error>(O_LOG_TOKEN, "unknown overflow policy %s, dropping the oldest events", policy);
+    }
+    return flow;
+}
+
+/**
+ * Starts the metrics endpoint if the "--metrics-port <port>" option is given.
+ */
+static bool start_metrics(cercall::qt::MetricsServer& server, const QStringList& args)
+{
+    int pos = args.indexOf("--metrics-port");
+    if (pos < 0 || pos + 1 >= args.size()) {
+        return true;
+    }
+    if ( !server.listen(QHostAddress::LocalHost, static_cast<quint16>(args[pos + 1].toUInt()))) {
+        log<error>(O_LOG_TOKEN, "cannot serve metrics: %s", server.error_string());
+        return false;
+    }
+    log<debug>(O_LOG_TOKEN, "metrics on port %d", server.port());
+    return true;
+}
+
+/**
+ * Returns the group and port given by the "--multicast <group>:<port>" option, or a null address.
+ */
+static std::pair<QHostAddress, quint16> multicast_group(const QStringList& args)
+{
+    int pos = args.indexOf("--multicast");
+    if (pos < 0 || pos + 1 >= args.size()) {
+        return { QHostAddress {}, 0u };
+    }
+    const QString& value = args[pos + 1];
+    int colon = value.lastIndexOf(':');
+    QHostAddress group(value.left(colon));
+    quint16 port = static_cast<quint16>(value.mid(colon + 1).toUInt());
+    if (colon < 0 || !group.isMulticast() || port == 0u) {
+        log<error>(O_LOG_TOKEN, "not a multicast group and port: %s", value);
+        return { QHostAddress {}, 0u };
+    }
+    return { group, port };
+}
+
+/**
+ * Runs one service per worker thread of the acceptor pool.
+ */
+static int run_worker_services(QlockApplication& app, int workers)
+{
+    QlockServicePool services(workers, QHostAddress::LocalHost, 4321, flow_control(app.arguments()));
+    services.set_conflation(ClockTickEvent, app.arguments().contains("--conflate-ticks"));
+    if ( !services.listen()) {
+        log<error>(O_LOG_TOKEN, "cannot listen: %s", services.error_string());
+        return 1;
+    }
+    std::pair<QHostAddress, quint16> multicast = multicast_group(app.arguments());
+    if ( !multicast.first.isNull() && !services.set_multicast(multicast.first, multicast.second)) {
+        return 1;
+    }
+
+    int res = app.exec();
+    log<debug>(O_LOG_TOKEN, "finished app loop");
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    int res;
+
+    cercall_user_log::programName = "qlockservice";
+
+    try {
+        QlockApplication app(argc, argv);
+
+        auto sigHandler = [](int) { QCoreApplication::instance()->quit(); };
+        signal(SIGTERM, sigHandler);
+        signal(SIGINT, sigHandler);
+
+        log<debug>(O_LOG_TOKEN, "Start qlock service");
+
+        QStringList args = app.arguments();
+        cercall::qt::MetricsServer metrics;
+        if ( !start_metrics(metrics, args)) {
+            return 1;
+        }
+        int pos = args.indexOf("--workers");
+        int workers = (pos >= 0 && pos + 1 < args.size()) ? args[pos + 1].toInt() : 0;
+        if (workers > 0) {
+            res = run_worker_services(app, workers);
+            log<debug>(O_LOG_TOKEN, "Exit qlock service");
+            return res;
+        }
+
+        auto acceptor = cercall::make_unique<cercall::qt::TcpAcceptor>(QHostAddress::LocalHost, 4321);
+        std::shared_ptr<QlockService> service = std::make_shared<QlockService>(std::move(acceptor));
+        service->set_flow_control(flow_control(app.arguments()));
+        service->set_conflation(ClockTickEvent, app.arguments().contains("--conflate-ticks"));
+
+        service->start();
+        std::pair<QHostAddress, quint16> multicast = multicast_group(args);
+        if ( !multicast.first.isNull()) {
+            auto channel = std::make_shared<cercall::qt::MulticastTransport>(
+                        cercall::qt::MulticastTransport::Role::Sender, multicast.first, multicast.second);
+            if ( !channel->open()) {
+                service->stop();
+                return 1;
+            }
+            service->set_multicast(channel);
+        }
+        res = app.exec();
+        log<debug>(O_LOG_TOKEN, "finished app loop");
+        service->stop();
+    } catch (const QException& e) {
+        std::cerr << "QT exception: " << e.what() << "\n";
+    } catch (const std::exception& e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+    } catch (...) {
+        std::cerr << "Unknown exception\n";
+    }
+    log<debug>(O_LOG_TOKEN, "Exit qlock service");
+    return res;
+}
@@ -0,0 +1,157 @@
+/*!
+ * \file
+ * \brief     CerQall shared frames for broadcasts to many transports
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_BROADCASTSCOPE_H
+#define CERCALL_QT_BROADCASTSCOPE_H
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include "cercall/transport.h"
+
+namespace cercall {
+namespace qt {
+
+/**
+ * Marks a broadcast in progress on the current thread.
+ *
+ * While a scope is active, the Qt socket transports do not copy the messages written to them. The first
+ * transport turns the frame into an immutable, reference counted buffer, and every following transport
+ * which is given the same frame queues a reference to that buffer. Put a scope around the broadcast_event()
+ * call of the service:
+ *
+ *     {
+ *         cercall::qt::BroadcastScope scope;
+ *         broadcast_event<MyEvent>(args...);
+ *     }
+ *
+ * A scope may be given a filter, which selects the transports that get the broadcast. The others are
+ * skipped without an error, so that a service can send events only to the clients that want them.
+ *
+ * The frames of a broadcast are events, which a transport may drop when its outbound queue overflows.
+ * An event key marks events of the same kind, of which only the latest one matters, such as the state of
+ * something; a transport may then replace a queued event by a newer one with the same key. It does so when
+ * its queue overflows, or always if the scope asks for conflation.
+ *
+ * Scopes may be nested; the innermost one is active.
+ */
+class BroadcastScope
+{
+public:
+    using Filter = std::function<bool(const Transport&)>;
+
+    explicit BroadcastScope(Filter filter = Filter {}) : myPrevious(current()), myFilter(std::move(filter))
+    {
+        current() = this;
+    }
+
+    BroadcastScope(const BroadcastScope&) = delete;
+    BroadcastScope& operator=(const BroadcastScope&) = delete;
+
+    ~BroadcastScope()
+    {
+        current() = myPrevious;
+    }
+
+    /**
+     * The active scope of the calling thread, or nullptr.
+     */
+    static BroadcastScope* active()
+    {
+        return current();
+    }
+
+    /**
+     * Returns true if the transport takes part in the broadcast.
+     */
+    bool wants(const Transport& tr) const
+    {
+        return !myFilter || myFilter(tr);
+    }
+
+    /**
+     * Sets the key of the events of this broadcast. Zero, the default, means that they are all different.
+     */
+    void set_event_key(uint64_t key)
+    {
+        myEventKey = key;
+    }
+
+    uint64_t event_key() const
+    {
+        return myEventKey;
+    }
+
+    /**
+     * Makes the transports replace an event with the same key which is still waiting in their outbound queue
+     * by the new one, in its place, instead of queueing it behind. Events already handed to the socket are
+     * not affected. Has no effect without an event key.
+     */
+    void set_conflation(bool on)
+    {
+        myConflation = on;
+    }
+
+    bool conflates() const
+    {
+        return myConflation && myEventKey != 0u;
+    }
+
+    /**
+     * Returns the shared buffer holding the frame. The frame is copied only if it differs from the previous one.
+     */
+    std::shared_ptr<const std::string> share(const std::string& frame)
+    {
+        if ( !myFrame || myFrame->size() != frame.size()
+             || (myFrame->data() != frame.data() && std::memcmp(myFrame->data(), frame.data(), frame.size()) != 0)) {
+            myFrame = std::make_shared<const std::string>(frame);
+            ++myFrameCount;
+        }
+        return myFrame;
+    }
+
+    /**
+     * Makes a frame which is already in a shared buffer the previous one, so that share() returns that buffer
+     * for it instead of a copy. For transports which write the frames of a broadcast to other transports.
+     */
+    void set_shared_frame(std::shared_ptr<const std::string> frame)
+    {
+        myFrame = std::move(frame);
+    }
+
+    /**
+     * Number of distinct frames copied in this scope.
+     */
+    size_t frame_count() const
+    {
+        return myFrameCount;
+    }
+
+private:
+    BroadcastScope* myPrevious;
+    Filter myFilter;
+    std::shared_ptr<const std::string> myFrame;
+    size_t myFrameCount = 0u;
+    uint64_t myEventKey = 0u;
+    bool myConflation = false;
+
+    static BroadcastScope*& current()
+    {
+        static thread_local BroadcastScope* scope = nullptr;
+        return scope;
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif // CERCALL_QT_BROADCASTSCOPE_H
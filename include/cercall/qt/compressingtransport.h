@@ -0,0 +1,621 @@
+/*!
+ * \file
+ * \brief     CerQall Transport wrapper which compresses large messages
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_COMPRESSINGTRANSPORT_H
+#define CERCALL_QT_COMPRESSINGTRANSPORT_H
+
+#include <QByteArray>
+#include <QTimer>
+#include <QtEndian>
+#include <algorithm>
+#include <memory>
+#include <string>
+#ifdef HAS_LZ4
+#include <lz4.h>
+#endif
+#include "cercall/transport.h"
+#include "cercall/acceptor.h"
+#include "cercall/qt/error.h"
+#include "cercall/qt/broadcastscope.h"
+#include "cercall/qt/tcptransport.h"
+#include "cercall/log.h"
+
+namespace cercall {
+namespace qt {
+
+/**
+ * Compression methods of a CompressingTransport.
+ */
+enum class Codec : uint8_t
+{
+    None = 0,
+    Zlib = 1,   //!< qCompress()
+    Lz4 = 2     //!< Only if built with HAS_LZ4.
+};
+
+struct CompressionOptions
+{
+    size_t myThreshold = 1024u;     //!< Smaller messages are always sent as they are.
+    int myZlibLevel = 1;            //!< Fastest; 9 compresses best.
+    bool myZlib = true;             //!< Codecs offered to the peer.
+    bool myLz4 = true;
+};
+
+/**
+ * Transport which compresses the messages written to another transport, and decompresses what it reads.
+ *
+ * Every message goes out as a frame with a 5-byte header: the codec and the length of what follows. Messages
+ * smaller than the threshold, and those which do not get smaller, are sent as they are. When the inner
+ * transport is connected, both ends send a hello frame with the codecs they offer, and each end compresses
+ * with the best codec offered by both: LZ4, then zlib. Until the hello of the peer has arrived nothing is
+ * compressed, so the connection is usable right away. Both ends must use a CompressingTransport; the service
+ * gets them from a CompressingAcceptor.
+ *
+ * Incompressible data costs a compression attempt per message. After an attempt which did not pay off,
+ * the next few messages are sent uncompressed, up to 64 after repeated failures.
+ *
+ * Within a BroadcastScope a message is compressed once for all the transports of the broadcast, and the
+ * inner transports share the compressed frame. Each transport backs off from an incompressible broadcast
+ * as if it had compressed the message itself.
+ */
+class CompressingTransport : public Transport, private TransportListener
+{
+public:
+    static constexpr size_t HeaderSize = 5u;
+
+    /**
+     * Largest frame and largest decompressed message accepted from the peer.
+     */
+    static constexpr uint32_t MaxFrameSize = 256u * 1024u * 1024u;
+
+    static constexpr uint8_t ProtocolVersion = 1u;
+
+    CompressingTransport(std::shared_ptr<Transport> inner, const CompressionOptions& options = CompressionOptions {})
+        : myInner(std::move(inner)), myOptions(options)
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        o_assert(myInner != nullptr);
+        myTcp = dynamic_cast<TcpTransport*>(myInner.get());
+        myDeliverTimer.setSingleShot(true);
+        myDeliverTimer.setInterval(0);
+        QObject::connect(&myDeliverTimer, &QTimer::timeout, [this]() { deliver(); });
+        myInner->set_listener(this);
+        if (myInner->is_open()) {
+            start();
+        }
+    }
+
+    CompressingTransport(const CompressingTransport&) = delete;
+    CompressingTransport& operator=(const CompressingTransport&) = delete;
+    virtual ~CompressingTransport()
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        close();
+    }
+
+    /**
+     * The wrapped transport, for settings such as the flow control of a TcpTransport.
+     */
+    Transport& inner()
+    {
+        return *myInner;
+    }
+
+    /**
+     * The codec used for the messages sent, None until the hello of the peer has arrived.
+     */
+    Codec codec() const
+    {
+        return myCodec;
+    }
+
+    uint64_t compressed_messages() const
+    {
+        return myCompressedMessages;
+    }
+
+    /**
+     * Bytes of the messages written, and of the frames they were sent as, headers included.
+     */
+    uint64_t message_bytes() const
+    {
+        return myMessageBytes;
+    }
+
+    uint64_t frame_bytes() const
+    {
+        return myFrameBytes;
+    }
+
+    bool is_open() override
+    {
+        return myInner->is_open();
+    }
+
+    bool open() override
+    {
+        return myInner->open();
+    }
+
+    void open(const cercall::Closure<bool>& cl) override
+    {
+        myInner->open(cl);
+    }
+
+    void close() override
+    {
+        myDeliverTimer.stop();
+        myInner->close();
+        reset();
+    }
+
+    void read(uint32_t len) override
+    {
+        o_assert(len > 0);
+        if ( is_open()) {
+            myReadLength = len;
+            //The message may already be decompressed, in which case no data is coming for it.
+            if ( !myDelivering && available() >= len && !myDeliverTimer.isActive()) {
+                myDeliverTimer.start();
+            }
+        } else {
+            throw std::runtime_error("cercall::qt::CompressingTransport: cannot read from a closed transport");
+        }
+    }
+
+    const std::string& get_read_data() override
+    {
+        if (myReadLength > 0 && available() >= myReadLength) {
+            myReadData.assign(myDecoded, myDecodedPos, myReadLength);
+            myDecodedPos += myReadLength;
+            myReadLength = 0u;
+            ++myReadCount;
+        } else {
+            log<error>(O_LOG_TOKEN, "no data to read");
+        }
+        return myReadData;
+    }
+
+    Error write(const std::string& msg) override
+    {
+        if (BroadcastScope* broadcast = BroadcastScope::active()) {
+            if ( !broadcast->wants(*this)) {
+                return Error {};
+            }
+            std::shared_ptr<const std::string> frame = broadcast_frame(*broadcast, msg);
+            //The filter of the scope knows this transport, not the inner one.
+            BroadcastScope scope;
+            scope.set_event_key(broadcast->event_key());
+            scope.set_conflation(broadcast->conflates());
+            scope.set_shared_frame(frame);
+            return myInner->write(*frame);
+        }
+        std::string frame = encode(msg);
+        if (myTcp != nullptr) {
+            return myTcp->write(std::move(frame));
+        }
+        return myInner->write(frame);
+    }
+
+private:
+    enum FrameType : uint8_t
+    {
+        RawFrame = static_cast<uint8_t>(Codec::None),
+        ZlibFrame = static_cast<uint8_t>(Codec::Zlib),
+        Lz4Frame = static_cast<uint8_t>(Codec::Lz4),
+        HelloFrame = 0x7fu
+    };
+
+    /**
+     * The last message broadcast by the thread, and its frame.
+     */
+    struct BroadcastFrame
+    {
+        std::shared_ptr<const std::string> myMessage;
+        Codec myCodec = Codec::None;
+        std::shared_ptr<const std::string> myFrame;
+    };
+
+    std::shared_ptr<Transport> myInner;
+    TcpTransport* myTcp = nullptr;  //The inner transport, if it takes messages without a copy.
+    const CompressionOptions myOptions;
+    Codec myCodec = Codec::None;
+    unsigned myFailures = 0u;       //Compression attempts in a row which did not pay off.
+    unsigned mySkip = 0u;           //Messages to send uncompressed before the next attempt.
+    uint64_t myCompressedMessages = 0u;
+    uint64_t myMessageBytes = 0u;
+    uint64_t myFrameBytes = 0u;
+
+    bool myInHeader = true;
+    uint8_t myFrameType = RawFrame;
+    std::string myDecoded;          //Decompressed data not yet read by the listener starts at myDecodedPos.
+    size_t myDecodedPos = 0u;
+    uint32_t myReadLength = 0u;
+    std::string myReadData;
+    uint64_t myReadCount = 0u;
+    bool myDelivering = false;
+    QTimer myDeliverTimer;
+
+    static uint8_t offered_codecs(const CompressionOptions& options)
+    {
+        uint8_t mask = options.myZlib ? (1u << static_cast<int>(Codec::Zlib)) : 0u;
+#ifdef HAS_LZ4
+        mask |= options.myLz4 ? (1u << static_cast<int>(Codec::Lz4)) : 0u;
+#endif
+        return mask;
+    }
+
+    static void put_u32(char* p, uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i) {
+            p[i] = static_cast<char>((v >> (8 * i)) & 0xffu);
+        }
+    }
+
+    static uint32_t get_u32(const char* p)
+    {
+        uint32_t v = 0u;
+        for (int i = 0; i < 4; ++i) {
+            v |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+        }
+        return v;
+    }
+
+    static std::string make_frame(uint8_t type, const char* data, size_t len)
+    {
+        std::string frame(HeaderSize + len, '\0');
+        frame[0] = static_cast<char>(type);
+        put_u32(&frame[1], static_cast<uint32_t>(len));
+        std::copy(data, data + len, &frame[HeaderSize]);
+        return frame;
+    }
+
+    size_t available() const
+    {
+        return myDecoded.size() - myDecodedPos;
+    }
+
+    void reset()
+    {
+        myCodec = Codec::None;
+        myFailures = mySkip = 0u;
+        myInHeader = true;
+        myDecoded.clear();
+        myDecodedPos = 0u;
+        myReadLength = 0u;
+    }
+
+    /**
+     * Starts reading frames from the inner transport, which has just been connected, and says hello.
+     */
+    void start()
+    {
+        reset();
+        myInner->read(static_cast<uint32_t>(HeaderSize));
+        const char hello[2] = { static_cast<char>(ProtocolVersion), static_cast<char>(offered_codecs(myOptions)) };
+        myInner->write(make_frame(HelloFrame, hello, sizeof(hello)));
+    }
+
+    /**
+     * Picks the codec of the next message, None if it is not to be compressed.
+     */
+    Codec codec_for(size_t len)
+    {
+        if (myCodec == Codec::None || len < myOptions.myThreshold) {
+            return Codec::None;
+        }
+        if (mySkip > 0u) {
+            --mySkip;
+            return Codec::None;
+        }
+        return myCodec;
+    }
+
+    /**
+     * Counts the outcome of a compression attempt, and sets the number of messages to skip after a failure.
+     */
+    void compressed(bool paidOff)
+    {
+        if (paidOff) {
+            myFailures = 0u;
+            ++myCompressedMessages;
+        } else {
+            mySkip = std::min(1u << std::min(myFailures, 6u), 64u);
+            ++myFailures;
+        }
+    }
+
+    std::string encode(const std::string& msg)
+    {
+        myMessageBytes += msg.size();
+        std::string frame;
+        Codec codec = codec_for(msg.size());
+        if (codec != Codec::None) {
+            if (compress(codec, msg, frame)) {
+                compressed(true);
+            } else {
+                compressed(false);
+                frame.clear();
+            }
+        }
+        if (frame.empty()) {
+            frame = make_frame(RawFrame, msg.data(), msg.size());
+        }
+        myFrameBytes += frame.size();
+        return frame;
+    }
+
+    /**
+     * Compresses the message into a frame. Returns false if it does not get smaller.
+     */
+    static bool compress(Codec codec, const std::string& msg, std::string& frame, int zlibLevel)
+    {
+        switch (codec) {
+            case Codec::Zlib: {
+                //The data of qCompress() starts with the length of the message, which qUncompress() needs.
+                QByteArray z = qCompress(reinterpret_cast<const uchar*>(msg.data()), static_cast<int>(msg.size()),
+                                         zlibLevel);
+                if (static_cast<size_t>(z.size()) >= msg.size()) {
+                    return false;
+                }
+                frame = make_frame(ZlibFrame, z.constData(), static_cast<size_t>(z.size()));
+                return true;
+            }
+#ifdef HAS_LZ4
+            case Codec::Lz4: {
+                const int bound = LZ4_compressBound(static_cast<int>(msg.size()));
+                frame.resize(HeaderSize + 4u + static_cast<size_t>(bound));
+                int n = LZ4_compress_default(msg.data(), &frame[HeaderSize + 4u], static_cast<int>(msg.size()), bound);
+                if (n <= 0 || static_cast<size_t>(n) + 4u >= msg.size()) {
+                    return false;
+                }
+                frame.resize(HeaderSize + 4u + static_cast<size_t>(n));
+                frame[0] = static_cast<char>(Lz4Frame);
+                put_u32(&frame[1], static_cast<uint32_t>(n) + 4u);
+                put_u32(&frame[HeaderSize], static_cast<uint32_t>(msg.size()));
+                return true;
+            }
+#endif
+            default:
+                return false;
+        }
+    }
+
+    bool compress(Codec codec, const std::string& msg, std::string& frame)
+    {
+        return compress(codec, msg, frame, myOptions.myZlibLevel);
+    }
+
+    /**
+     * Returns the frame of a broadcast message. The frame is made once for all transports with the same codec.
+     */
+    std::shared_ptr<const std::string> broadcast_frame(BroadcastScope& broadcast, const std::string& msg)
+    {
+        static thread_local BroadcastFrame last;
+        std::shared_ptr<const std::string> shared = broadcast.share(msg);
+        const Codec codec = codec_for(msg.size());
+        if (last.myMessage != shared || last.myCodec != codec) {
+            last.myMessage = shared;
+            last.myCodec = codec;
+            std::string frame;
+            if (codec == Codec::None || !compress(codec, msg, frame)) {
+                frame = make_frame(RawFrame, msg.data(), msg.size());
+            }
+            last.myFrame = std::make_shared<const std::string>(std::move(frame));
+        }
+        if (codec != Codec::None) {
+            compressed(last.myFrame->size() < msg.size() + HeaderSize);
+        }
+        myMessageBytes += msg.size();
+        myFrameBytes += last.myFrame->size();
+        return last.myFrame;
+    }
+
+    void on_connected(Transport&) override
+    {
+        start();
+        if (myListener != nullptr) {
+            myListener->on_connected(*this);
+        }
+    }
+
+    void on_disconnected(Transport&) override
+    {
+        myDeliverTimer.stop();
+        myCodec = Codec::None;
+        if (myListener != nullptr) {
+            myListener->on_disconnected(*this);
+        }
+    }
+
+    void on_connection_error(Transport&, const Error& err) override
+    {
+        if (myListener != nullptr) {
+            myListener->on_connection_error(*this, err);
+        }
+    }
+
+    /**
+     * Reads the frames from the inner transport, header and body in turn.
+     */
+    void on_incoming_data(Transport& tr, size_t) override
+    {
+        const std::string& data = tr.get_read_data();
+        uint32_t next = static_cast<uint32_t>(HeaderSize);
+        if (myInHeader) {
+            if (data.size() < HeaderSize) {
+                return protocol_error("truncated frame header");
+            }
+            myFrameType = static_cast<uint8_t>(data[0]);
+            uint32_t len = get_u32(&data[1]);
+            if (len > MaxFrameSize) {
+                return protocol_error("frame too large");
+            }
+            if (len > 0u) {
+                myInHeader = false;
+                next = len;
+            }
+        } else {
+            myInHeader = true;
+            if ( !decode(data)) {
+                return;
+            }
+        }
+        if (tr.is_open()) {
+            tr.read(next);
+        }
+        deliver();
+    }
+
+    bool decode(const std::string& data)
+    {
+        switch (myFrameType) {
+            case RawFrame:
+                myDecoded.append(data);
+                return true;
+            case ZlibFrame: {
+                //qUncompress() allocates the size given by the peer in the first 4 bytes, so check it first.
+                const uint32_t len = data.size() > 4u ? qFromBigEndian<quint32>(data.data()) : 0u;
+                if (len == 0u || len > MaxFrameSize) {
+                    protocol_error("invalid zlib frame");
+                    return false;
+                }
+                QByteArray raw = qUncompress(reinterpret_cast<const uchar*>(data.data()),
+                                             static_cast<int>(data.size()));
+                if (static_cast<uint32_t>(raw.size()) != len) {
+                    protocol_error("invalid zlib frame");
+                    return false;
+                }
+                myDecoded.append(raw.constData(), static_cast<size_t>(raw.size()));
+                return true;
+            }
+#ifdef HAS_LZ4
+            case Lz4Frame: {
+                uint32_t len = data.size() > 4u ? get_u32(data.data()) : 0u;
+                if (len == 0u || len > MaxFrameSize) {
+                    protocol_error("invalid LZ4 frame");
+                    return false;
+                }
+                const size_t end = myDecoded.size();
+                myDecoded.resize(end + len);
+                int n = LZ4_decompress_safe(data.data() + 4, &myDecoded[end], static_cast<int>(data.size() - 4u),
+                                            static_cast<int>(len));
+                if (n != static_cast<int>(len)) {
+                    myDecoded.resize(end);
+                    protocol_error("invalid LZ4 frame");
+                    return false;
+                }
+                return true;
+            }
+#endif
+            case HelloFrame:
+                if (data.size() >= 2u) {
+                    const uint8_t common = offered_codecs(myOptions) & static_cast<uint8_t>(data[1]);
+                    myCodec = (common & (1u << static_cast<int>(Codec::Lz4))) != 0u ? Codec::Lz4
+                            : (common & (1u << static_cast<int>(Codec::Zlib))) != 0u ? Codec::Zlib : Codec::None;
+                    log<debug>(O_LOG_TOKEN, "compression codec %d", static_cast<int>(myCodec));
+                }
+                return true;
+            default:
+                protocol_error("unknown frame type");
+                return false;
+        }
+    }
+
+    void protocol_error(const char* what)
+    {
+        Error err { QAbstractSocket::UnknownSocketError, std::string("Compression protocol error: ") + what };
+        log<error>(O_LOG_TOKEN, "%s", err.message().c_str());
+        if (myListener != nullptr) {
+            myListener->on_connection_error(*this, err);
+        }
+        close();
+    }
+
+    /**
+     * Hands the decompressed data to the listener, message by message, as long as it asks for more.
+     */
+    void deliver()
+    {
+        if (myDelivering) {
+            return;
+        }
+        myDelivering = true;
+        while (myListener != nullptr && available() > 0u && available() >= myReadLength) {
+            uint64_t readCount = myReadCount;
+            myListener->on_incoming_data(*this, available());
+            if (myReadCount == readCount || myReadLength == 0u || !is_open()) {
+                break;
+            }
+        }
+        //The buffer keeps its capacity; data still to be read moves to the front once most of it is read.
+        if (myDecodedPos == myDecoded.size()) {
+            myDecoded.clear();
+            myDecodedPos = 0u;
+        } else if (myDecodedPos > myDecoded.size() / 2u) {
+            myDecoded.erase(0, myDecodedPos);
+            myDecodedPos = 0u;
+        }
+        myDelivering = false;
+    }
+};
+
+/**
+ * Acceptor which wraps the transports of another acceptor in CompressingTransports.
+ */
+class CompressingAcceptor : public cercall::Acceptor, private AcceptorListener
+{
+public:
+    CompressingAcceptor(std::unique_ptr<cercall::Acceptor> inner,
+                        const CompressionOptions& options = CompressionOptions {})
+        : myInner(std::move(inner)), myOptions(options)
+    {
+        myInner->set_listener(this);
+    }
+
+    bool is_open() const override
+    {
+        return myInner->is_open();
+    }
+
+    void open(int maxPendingClientConnections = -1) override
+    {
+        if (myListener == nullptr) {
+            throw std::logic_error("cercall::qt::CompressingAcceptor::open(): listener is NULL");
+        }
+        myInner->open(maxPendingClientConnections);
+    }
+
+    void close() override
+    {
+        myInner->close();
+    }
+
+private:
+    std::unique_ptr<cercall::Acceptor> myInner;
+    const CompressionOptions myOptions;
+
+    void on_client_accepted(std::shared_ptr<Transport> tr) override
+    {
+        myListener->on_client_accepted(std::make_shared<CompressingTransport>(std::move(tr), myOptions));
+    }
+
+    void on_accept_error(const Error& err) override
+    {
+        if (myListener != nullptr) {
+            myListener->on_accept_error(err);
+        }
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_COMPRESSINGTRANSPORT_H
@@ -0,0 +1,57 @@
+/*!
+ * \file
+ * \brief     CerQall scoped corking of Qt socket transports
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_CORKSCOPE_H
+#define CERCALL_QT_CORKSCOPE_H
+
+namespace cercall {
+namespace qt {
+
+/**
+ * Corks a TcpTransport or LocalTransport for its lifetime. The messages written meanwhile, for example
+ * the calls of a client, are queued and handed to the socket together when the scope ends, normally with
+ * a single system call. The previous write mode is then restored.
+ *
+ *     {
+ *         cercall::qt::CorkScope<cercall::qt::TcpTransport> batch(transport);
+ *         client.set_alarm(...);
+ *         client.set_alarm(...);
+ *     }
+ */
+template<typename TransportType>
+class CorkScope
+{
+public:
+    explicit CorkScope(TransportType& tr) : myTransport(tr), myPrevious(tr.cork_mode())
+    {
+        tr.set_cork_mode(TransportType::CorkMode::Manual);
+    }
+
+    CorkScope(const CorkScope&) = delete;
+    CorkScope& operator=(const CorkScope&) = delete;
+
+    ~CorkScope()
+    {
+        //Switching the cork off flushes.
+        myTransport.set_cork_mode(myPrevious);
+        if (myPrevious == TransportType::CorkMode::EventLoop) {
+            myTransport.flush();
+        }
+    }
+
+private:
+    TransportType& myTransport;
+    const typename TransportType::CorkMode myPrevious;
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif // CERCALL_QT_CORKSCOPE_H
@@ -0,0 +1,875 @@
+/*!
+ * \file
+ * \brief     CerQall Transport over a Qt socket, the common part of TcpTransport and LocalTransport
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_DETAILS_SOCKETTRANSPORT_H
+#define CERCALL_QT_DETAILS_SOCKETTRANSPORT_H
+
+#include <QTimer>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <random>
+#include <vector>
+#include "cercall/transport.h"
+#include "cercall/qt/error.h"
+#include "cercall/qt/broadcastscope.h"
+#include "cercall/qt/details/writequeue.h"
+#include "cercall/qt/metrics.h"
+#include "cercall/log.h"
+
+namespace cercall {
+namespace qt {
+namespace details {
+
+/**
+ * What SocketTransport needs to know about a socket type, specialized next to the transport using it:
+ * the SocketError type of its error signal, kind() for the logs and metrics, and disconnect(), which closes
+ * the socket gracefully.
+ */
+template<class Socket>
+struct SocketTraits;
+
+/**
+ * Transport over a QTcpSocket or a QLocalSocket, which have the same interface but for a few names. It reads
+ * and writes the messages, with corking and flow control, and connects, with a timeout and reconnection.
+ * The derived class knows where to connect to, and configures the connected socket.
+ */
+template<class Socket>
+class SocketTransport : public Transport
+{
+    using Traits = SocketTraits<Socket>;
+
+public:
+    using SocketType = Socket*;
+
+    /**
+     * Initial capacity of the buffer returned by get_read_data(). It grows to the largest message seen.
+     */
+    static constexpr size_t InitialReadCapacity = 4096u;
+
+    /**
+     * Default size of the socket read buffer. It allows Qt to buffer many messages between two readyRead
+     * notifications, which are then all delivered to the listener at once.
+     */
+    static constexpr qint64 DefaultReadBufferSize = 256 * 1024;
+
+    /**
+     * Write modes. In the corked modes written messages are queued and then handed to the socket
+     * together, normally with a single system call.
+     */
+    enum class CorkMode
+    {
+        Off,        //!< Every message is written to the socket immediately.
+        Manual,     //!< Messages are queued until flush() is called.
+        EventLoop   //!< Messages are queued until control returns to the event loop.
+    };
+
+    /**
+     * Connection states of a client-side transport. Transports made by the acceptor start out connected
+     * and are closed for good once the connection is lost.
+     */
+    enum class State
+    {
+        Closed,
+        Connecting,
+        Connected,
+        WaitingToReconnect  //!< The connection failed or was lost, and the next attempt is scheduled.
+    };
+
+    /**
+     * Automatic reconnection of client-side transports. After a failed attempt or a lost connection, the
+     * transport waits and tries again. The wait starts at myInitialDelay and grows by myMultiplier with every
+     * failed attempt, up to myMaxDelay. Then a random part of up to myJitter of it is taken off, so that the
+     * clients of a service which went down do not all come back at the same moment.
+     *
+     * The messages still queued when the connection is lost are dropped with it, including a partly sent one,
+     * since the new connection starts a new stream. Only those written while connecting or waiting to
+     * reconnect are sent once the transport is connected.
+     */
+    struct ReconnectPolicy
+    {
+        bool myEnabled = false;
+        std::chrono::milliseconds myInitialDelay { 100 };
+        std::chrono::milliseconds myMaxDelay { 10000 };
+        double myMultiplier = 2.0;
+        double myJitter = 0.5;
+    };
+
+    /**
+     * What the transport does with an event which does not fit in its outbound queue.
+     */
+    enum class OverflowPolicy
+    {
+        DropOldest,     //!< Queued events are dropped, the oldest first, to make room for the new one.
+        Conflate,       //!< A queued event with the same key is replaced by the new one, otherwise as DropOldest.
+        Disconnect      //!< The connection is aborted.
+    };
+
+    /**
+     * Write flow control. Messages are handed to the socket while its write buffer holds less than
+     * myHighWatermark bytes. Beyond that they wait in the outbound queue of the transport, until the socket
+     * has sent enough to get down to myLowWatermark. When an event does not fit in myMaxQueuedBytes of
+     * outbound queue, the overflow policy applies. Other messages, such as call results, are always queued.
+     */
+    struct FlowControl
+    {
+        qint64 myHighWatermark = 1024 * 1024;
+        qint64 myLowWatermark = 256 * 1024;
+        size_t myMaxQueuedBytes = 4u * 1024u * 1024u;
+        OverflowPolicy myPolicy = OverflowPolicy::DropOldest;
+    };
+
+    static constexpr int DefaultConnectTimeoutMs = 10000;
+
+    /**
+     * Default limit of the messages written while the transport is connecting, which are sent as soon as
+     * it is connected.
+     */
+    static constexpr size_t DefaultMaxPendingBytes = 4u * 1024u * 1024u;
+
+    SocketTransport(const SocketTransport&) = delete;
+    SocketTransport& operator=(const SocketTransport&) = delete;
+
+    bool is_open() override
+    {
+        return mySocket != nullptr && mySocket->state() == Socket::ConnectedState;
+    }
+
+    /**
+     * Connects and waits for the connection, at most for the connect timeout. This blocks the event loop
+     * of the thread; the asynchronous open() does not. If reconnection is enabled and the attempt fails,
+     * the transport keeps trying in the background.
+     */
+    bool open() override
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        if (myState != State::Closed) {
+            return false;
+        }
+        start_connect();
+        if (mySocket != nullptr && !mySocket->waitForConnected(myConnectTimeoutMs) && myState == State::Connecting) {
+            //The connect timer could not run while waiting.
+            connect_failed(connect_timeout());
+        }
+        return is_open();
+    }
+
+    /**
+     * Starts connecting and returns. The closure gets true once the transport is connected, or false with
+     * the error if the first attempt fails. Messages written in the meantime are sent when it is connected.
+     */
+    void open(const cercall::Closure<bool>& cl) override
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        if (myState == State::Closed) {
+            myOpenClosure = cl;
+            start_connect();
+        } else {
+            Result<bool> result { false, Error { Socket::UnknownSocketError, "Socket is already connected" } };
+            cl(result);
+        }
+    }
+
+    void close() override
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        myState = State::Closed;
+        myConnectTimer.stop();
+        myReconnectTimer.stop();
+        complete_open(Result<bool> { false, Error { Socket::OperationError, "Transport closed" } });
+        if (mySocket != nullptr) {
+            bool connected = mySocket->state() == Socket::ConnectedState;
+            if (connected) {
+                //Everything goes to the socket, which sends it before it disconnects.
+                flush_to(std::numeric_limits<qint64>::max());
+                log<debug>(O_LOG_TOKEN, "disconnect %s socket", Traits::kind());
+            }
+            release_socket();
+            if (connected && myListener != nullptr) {
+                myListener->on_disconnected(*this);
+            }
+        }
+        myWriteQueue.clear();
+        myMetrics.queued(0u);
+    }
+
+    State state() const
+    {
+        return myState;
+    }
+
+    void set_connect_timeout(std::chrono::milliseconds timeout)
+    {
+        myConnectTimeoutMs = static_cast<int>(std::max<std::chrono::milliseconds::rep>(timeout.count(), 1));
+    }
+
+    void set_reconnect_policy(const ReconnectPolicy& policy)
+    {
+        myReconnect = policy;
+    }
+
+    /**
+     * Sets the limit of the messages queued while the transport is connecting. Writes beyond it fail.
+     */
+    void set_max_pending_bytes(size_t bytes)
+    {
+        myMaxPendingBytes = bytes;
+    }
+
+    void set_flow_control(const FlowControl& flow)
+    {
+        myFlow = flow;
+        myFlow.myHighWatermark = std::max<qint64>(myFlow.myHighWatermark, 1);
+        myFlow.myLowWatermark = std::min(std::max<qint64>(myFlow.myLowWatermark, 0), myFlow.myHighWatermark);
+    }
+
+    const FlowControl& flow_control() const
+    {
+        return myFlow;
+    }
+
+    /**
+     * Sets a function which is called when the transport had to hold messages back and has drained its
+     * outbound queue and socket buffer to the low watermark again.
+     */
+    void set_writable_handler(std::function<void()> handler)
+    {
+        myWritableHandler = std::move(handler);
+    }
+
+    /**
+     * Returns true if a message written now goes straight to the socket.
+     */
+    bool is_writable()
+    {
+        return is_open() && myWriteQueue.empty() && mySocket->bytesToWrite() < myFlow.myHighWatermark;
+    }
+
+    /**
+     * Bytes waiting to be sent, in the outbound queue and in the socket buffer.
+     */
+    size_t pending_bytes() const
+    {
+        return myWriteQueue.bytes() + (mySocket != nullptr ? static_cast<size_t>(mySocket->bytesToWrite()) : 0u);
+    }
+
+    /**
+     * Number of events dropped, or replaced by newer ones, because the outbound queue was full.
+     */
+    uint64_t dropped_events() const
+    {
+        return myDroppedEvents;
+    }
+
+    /**
+     * Number of events replaced in the outbound queue by newer ones of a broadcast with conflation.
+     */
+    uint64_t conflated_events() const
+    {
+        return myConflatedEvents;
+    }
+
+    /**
+     * Counters of the messages and bytes read and written, and of the readyRead notifications.
+     */
+    const metrics::ConnectionMetrics& metrics() const
+    {
+        return myMetrics;
+    }
+
+    void read(uint32_t len) override
+    {
+        o_assert(len > 0);
+        if ( is_open()) {
+            //The read buffer must be able to hold the whole message.
+            qint64 bufSize = mySocket->readBufferSize();
+            if (bufSize > 0 && bufSize < len) {
+                mySocket->setReadBufferSize(len);
+            }
+            myReadLength = len;
+        } else {
+            throw std::runtime_error("cercall::qt::SocketTransport: cannot read from a closed transport");
+        }
+    }
+
+    const std::string& get_read_data() override
+    {
+        if (mySocket != nullptr && myReadLength > 0) {
+            /* QIODevice has an internal buffer and offers no means to access its contents without copying data.
+            * Hence a copy of the data has to be made, but it goes straight into myReadData. The string keeps
+            * its capacity between reads, so in steady state no heap allocation takes place.
+            */
+            myReadData.resize(myReadLength);
+            qint64 n = mySocket->read(&myReadData[0], myReadLength);
+            myReadData.resize(n > 0 ? static_cast<size_t>(n) : 0u);
+            myReadLength = 0u;
+            ++myReadCount;
+            myMetrics.frame_in(myReadData.size());
+        } else {
+            log<error>(O_LOG_TOKEN, "no data to read");
+        }
+        return myReadData;
+    }
+
+    /**
+     * Sets the maximum number of bytes which Qt reads from the kernel ahead of the listener.
+     * Zero means unlimited. The default is DefaultReadBufferSize.
+     */
+    void set_read_buffer_size(qint64 size)
+    {
+        myReadBufferSize = size;
+        if (mySocket != nullptr) {
+            mySocket->setReadBufferSize(size > 0 ? std::max<qint64>(size, myReadLength) : 0);
+        }
+    }
+
+    /**
+     * Sets the write mode. Switching the cork off flushes the queued messages.
+     */
+    void set_cork_mode(CorkMode mode)
+    {
+        myCorkMode = mode;
+        if (mode == CorkMode::Off) {
+            flush();
+        }
+    }
+
+    CorkMode cork_mode() const
+    {
+        return myCorkMode;
+    }
+
+    /**
+     * Writes a copy of the message. Within a BroadcastScope the message is queued as a buffer shared with
+     * the other transports of the broadcast instead, or dropped if the scope filters this transport out.
+     * While the transport is connecting, or holding messages back for flow control, the message is queued.
+     */
+    Error write(const std::string& msg) override
+    {
+        if (BroadcastScope* broadcast = BroadcastScope::active()) {
+            if ( !broadcast->wants(*this)) {
+                return Error {};
+            }
+            if ( !is_open()) {
+                return not_connected();
+            }
+            return enqueue_event(broadcast->share(msg), broadcast->event_key(), broadcast->conflates());
+        }
+        if (myCorkMode != CorkMode::Off || myDelivering || !is_writable()) {
+            return enqueue(std::string(msg));
+        }
+        Error result;   //no error by default
+        if ( is_open()) {
+            if (mySocket->write(msg.data(), msg.length()) < 0) {
+                Error err { mySocket->error(), mySocket->errorString().toStdString() };
+                result = err;
+            } else {
+                myMetrics.frame_out(msg.length());
+            }
+        } else {
+            Error err { Socket::UnknownSocketError, "Socket is not connected" };
+            result = err;
+        }
+        if ( result) {
+            log<error>(O_LOG_TOKEN, "write error - %s", result.message().c_str());
+        }
+        return result;
+    }
+
+    /**
+     * Writes a message without copying it. The buffer is sent directly, if possible, or kept until it is.
+     */
+    Error write(std::string&& msg)
+    {
+        return enqueue(std::move(msg));
+    }
+
+    /**
+     * Writes a message made of several segments, for example a header and a payload, without
+     * concatenating them.
+     */
+    Error write_segments(std::vector<std::string>&& segments)
+    {
+        size_t len = 0u;
+        for (const std::string& seg : segments) {
+            len += seg.size();
+        }
+        Error err = check_writable(len);
+        if (err) {
+            return err;
+        }
+        for (std::string& seg : segments) {
+            myWriteQueue.push(std::move(seg));
+        }
+        myMetrics.frame_out(len);
+        return queued();
+    }
+
+    /**
+     * Hands the queued messages to the socket, up to the high watermark. The rest follows as the socket
+     * sends its data.
+     */
+    Error flush()
+    {
+        return flush_to(myFlow.myHighWatermark);
+    }
+
+protected:
+    /**
+     * For transports made by the acceptor, which takes s over.
+     */
+    explicit SocketTransport(Socket* s) : mySocket { s }
+    {
+        myReadData.reserve(InitialReadCapacity);
+        init_timers();
+        log<trace>(O_LOG_TOKEN, "socket param");
+        o_assert(s != nullptr);
+        s->setParent(nullptr);
+        myState = s->state() == Socket::ConnectedState ? State::Connected : State::Closed;
+        init_socket();
+    }
+
+    /**
+     * For client-side transports, which connect in open().
+     */
+    SocketTransport() : mySocket(nullptr), myClientSide(true)
+    {
+        myReadData.reserve(InitialReadCapacity);
+        init_timers();
+    }
+
+    /**
+     * The derived class closes the transport in its destructor, while it can still make the listener calls.
+     */
+    ~SocketTransport() = default;
+
+    Socket* socket() const
+    {
+        return mySocket;
+    }
+
+    /**
+     * Starts connecting the new socket of a client-side transport to the peer.
+     */
+    virtual void connect_socket(Socket& s) = 0;
+
+    /**
+     * Called when the socket is connected, before the listener is told.
+     */
+    virtual void configure_socket(Socket&) {}
+
+private:
+
+    Socket* mySocket;
+    uint32_t myReadLength = 0u;
+    std::string myReadData;
+    qint64 myReadBufferSize = DefaultReadBufferSize;
+    uint64_t myReadCount = 0u;
+    details::WriteQueue myWriteQueue;
+    CorkMode myCorkMode = CorkMode::Off;
+    QTimer myCorkTimer;
+
+    const bool myClientSide = false;
+    cercall::Closure<bool> myOpenClosure;
+    State myState = State::Closed;
+    int myConnectTimeoutMs = DefaultConnectTimeoutMs;
+    QTimer myConnectTimer;
+    ReconnectPolicy myReconnect;
+    QTimer myReconnectTimer;
+    int myReconnectAttempts = 0;
+    size_t myMaxPendingBytes = DefaultMaxPendingBytes;
+    FlowControl myFlow;
+    std::function<void()> myWritableHandler;
+    bool myDraining = false;        //The queue is flushed whenever the socket has sent data.
+    bool myHeldBack = false;        //Messages were held back since the last writable notification.
+    bool myOverflowed = false;
+    bool myDelivering = false;      //Incoming messages are being delivered, writes are flushed afterwards.
+    uint64_t myDroppedEvents = 0u;
+    uint64_t myConflatedEvents = 0u;
+    metrics::ConnectionMetrics myMetrics { Traits::kind() };
+
+    static constexpr int DisconnectTimeoutMs = 30000;
+
+    void init_timers()
+    {
+        myCorkTimer.setSingleShot(true);
+        myCorkTimer.setInterval(0);
+        QObject::connect(&myCorkTimer, &QTimer::timeout, [this]() { flush(); });
+        myConnectTimer.setSingleShot(true);
+        QObject::connect(&myConnectTimer, &QTimer::timeout, [this]() {
+            if (myState == State::Connecting) {
+                connect_failed(connect_timeout());
+            }
+        });
+        myReconnectTimer.setSingleShot(true);
+        QObject::connect(&myReconnectTimer, &QTimer::timeout, [this]() {
+            if (myState == State::WaitingToReconnect) {
+                start_connect();
+            }
+        });
+    }
+
+    bool connecting() const
+    {
+        return myState == State::Connecting || myState == State::WaitingToReconnect;
+    }
+
+    void start_connect()
+    {
+        release_socket();
+        myState = State::Connecting;
+        myReadLength = 0u;
+        myDraining = myHeldBack = myOverflowed = false;
+        log<debug>(O_LOG_TOKEN, "new %s socket", Traits::kind());
+        mySocket = new Socket(nullptr);
+        init_socket();
+        myConnectTimer.start(myConnectTimeoutMs);
+        connect_socket(*mySocket);
+    }
+
+    Error connect_timeout() const
+    {
+        return Error { Socket::SocketTimeoutError, "Connection timed out" };
+    }
+
+    void connect_failed(const Error& err)
+    {
+        log<error>(O_LOG_TOKEN, "connect error - %s", err.message().c_str());
+        myConnectTimer.stop();
+        release_socket();
+        if (myReconnect.myEnabled) {
+            schedule_reconnect();
+        } else {
+            myState = State::Closed;
+            myWriteQueue.clear();
+        }
+        if (myListener != nullptr) {
+            myListener->on_connection_error(*this, err);
+        }
+        complete_open(Result<bool> { false, err });
+    }
+
+    void schedule_reconnect()
+    {
+        if (myState == State::Connected) {
+            //What is left of the lost connection, possibly the rest of a frame, is no use to the next one.
+            myWriteQueue.clear();
+            myMetrics.queued(0u);
+        }
+        release_socket();
+        myState = State::WaitingToReconnect;
+        const int delay = reconnect_delay(myReconnectAttempts++);
+        log<debug>(O_LOG_TOKEN, "reconnect in %d ms", delay);
+        myReconnectTimer.start(delay);
+    }
+
+    int reconnect_delay(int attempt) const
+    {
+        static thread_local std::minstd_rand rng { std::random_device {}() };
+        double delay = myReconnect.myInitialDelay.count() * std::pow(myReconnect.myMultiplier, std::min(attempt, 32));
+        delay = std::min(delay, static_cast<double>(myReconnect.myMaxDelay.count()));
+        std::uniform_real_distribution<double> jitter(1.0 - std::min(std::max(myReconnect.myJitter, 0.0), 1.0), 1.0);
+        return static_cast<int>(std::max(delay * jitter(rng), 0.0));
+    }
+
+    void complete_open(const Result<bool>& result)
+    {
+        if (myOpenClosure) {
+            cercall::Closure<bool> cl = std::move(myOpenClosure);
+            myOpenClosure = nullptr;
+            cl(result);
+        }
+    }
+
+    /**
+     * Detaches the socket from the transport. A connected socket is closed gracefully, after it has sent
+     * what it still has to send, and deleted once it is disconnected or after DisconnectTimeoutMs.
+     */
+    void release_socket()
+    {
+        if (mySocket == nullptr) {
+            return;
+        }
+        Socket* socket = mySocket;
+        mySocket = nullptr;
+        QObject::disconnect(socket, nullptr, nullptr, nullptr);
+        if (socket->state() == Socket::ConnectedState) {
+            QObject::connect(socket, &Socket::disconnected, socket, &QObject::deleteLater);
+            Traits::disconnect(*socket);
+            if (socket->state() != Socket::UnconnectedState) {
+                QTimer::singleShot(DisconnectTimeoutMs, socket, [socket]() {
+                    socket->abort();
+                    socket->deleteLater();
+                });
+                return;
+            }
+        } else {
+            socket->abort();
+        }
+        socket->deleteLater();
+    }
+
+    /**
+     * Returns no error if a message of the given length can be written now, or queued until the transport
+     * is connected.
+     */
+    Error check_writable(size_t len)
+    {
+        if (is_open()) {
+            return Error {};
+        }
+        if ( !connecting()) {
+            return not_connected();
+        }
+        if (myWriteQueue.bytes() + len > myMaxPendingBytes) {
+            Error err { Socket::SocketResourceError, "Too many messages written while connecting" };
+            log<error>(O_LOG_TOKEN, "write error - %s", err.message().c_str());
+            return err;
+        }
+        return Error {};
+    }
+
+    Error not_connected()
+    {
+        Error err { Socket::UnknownSocketError, "Socket is not connected" };
+        log<error>(O_LOG_TOKEN, "write error - %s", err.message().c_str());
+        return err;
+    }
+
+    Error enqueue(std::string&& msg)
+    {
+        Error err = check_writable(msg.size());
+        if (err) {
+            return err;
+        }
+        myMetrics.frame_out(msg.size());
+        myWriteQueue.push(std::move(msg));
+        return queued();
+    }
+
+    Error flush_to(qint64 maxBuffered)
+    {
+        Error result;
+        myCorkTimer.stop();
+        if ( !myWriteQueue.empty()) {
+            if ( !is_open()) {
+                //While connecting, the messages are kept until the connection is up.
+                if ( !connecting()) {
+                    myWriteQueue.clear();
+                    result = not_connected();
+                }
+            } else {
+                if ( !myWriteQueue.flush(*mySocket, mySocket->socketDescriptor(), maxBuffered)) {
+                    Error err { mySocket->error(), mySocket->errorString().toStdString() };
+                    log<error>(O_LOG_TOKEN, "write error - %s", err.message().c_str());
+                    result = err;
+                }
+                myDraining = !myWriteQueue.empty();
+                myHeldBack = myHeldBack || myDraining;
+            }
+            myMetrics.queued(myWriteQueue.bytes());
+        }
+        return result;
+    }
+
+    /**
+     * Queues a broadcast event, or puts it in the place of a queued one with the same key if the broadcast
+     * conflates. Applies the overflow policy if the outbound queue is full.
+     */
+    Error enqueue_event(std::shared_ptr<const std::string> frame, uint64_t key, bool conflate)
+    {
+        if (myOverflowed) {
+            return Error { Socket::SocketResourceError, "Outbound queue full" };
+        }
+        const details::WriteQueue::Tag tag { true, key };
+        if (conflate && myWriteQueue.replace(tag, frame)) {
+            ++myConflatedEvents;
+            myMetrics.frame_conflated();
+            return Error {};
+        }
+        if (myWriteQueue.bytes() + frame->size() > myFlow.myMaxQueuedBytes) {
+            switch (myFlow.myPolicy) {
+                case OverflowPolicy::Disconnect:
+                    return overflow();
+                case OverflowPolicy::Conflate:
+                    if (myWriteQueue.replace(tag, frame)) {
+                        dropped(1u);
+                        return Error {};
+                    }
+                    //fall through
+                case OverflowPolicy::DropOldest:
+                    dropped(myWriteQueue.drop_events(
+                                myFlow.myMaxQueuedBytes - std::min(frame->size(), myFlow.myMaxQueuedBytes)));
+                    if (myWriteQueue.bytes() + frame->size() > myFlow.myMaxQueuedBytes) {
+                        //The queue is full of other messages, or the event is too big anyway.
+                        dropped(1u);
+                        return Error {};
+                    }
+                    break;
+            }
+        }
+        myMetrics.frame_out(frame->size());
+        myWriteQueue.push(std::move(frame), tag);
+        return queued();
+    }
+
+    void dropped(uint64_t count)
+    {
+        myDroppedEvents += count;
+        myMetrics.frames_dropped(count);
+    }
+
+    /**
+     * Aborts the connection, from the event loop, since the service may be iterating over its transports.
+     */
+    Error overflow()
+    {
+        Error err { Socket::SocketResourceError, "Outbound queue full" };
+        log<error>(O_LOG_TOKEN, "write error - %s, disconnecting", err.message().c_str());
+        myOverflowed = true;
+        myWriteQueue.clear();
+        Socket* socket = mySocket;
+        QMetaObject::invokeMethod(socket, [socket]() { socket->abort(); }, Qt::QueuedConnection);
+        return err;
+    }
+
+    void on_bytes_written()
+    {
+        if (mySocket == nullptr || mySocket->bytesToWrite() > myFlow.myLowWatermark) {
+            return;
+        }
+        if (myDraining) {
+            flush();
+        }
+        if (myHeldBack && !myDraining && mySocket != nullptr && mySocket->bytesToWrite() <= myFlow.myLowWatermark) {
+            myHeldBack = false;
+            if (myWritableHandler) {
+                myWritableHandler();
+            }
+        }
+    }
+
+    Error queued()
+    {
+        myMetrics.queued(myWriteQueue.bytes());
+        if (myDelivering) {
+            return Error {};
+        }
+        switch (myCorkMode) {
+            case CorkMode::Off:
+                return flush();
+            case CorkMode::EventLoop:
+                if ( !myCorkTimer.isActive()) {
+                    myCorkTimer.start();
+                }
+                break;
+            case CorkMode::Manual:
+                break;
+        }
+        return Error {};
+    }
+
+    void init_socket()
+    {
+        mySocket->setReadBufferSize(myReadBufferSize);
+        connect_signals();
+    }
+
+    void connect_signals()
+    {
+        using SocketError = typename Traits::SocketError;
+        QObject::connect(mySocket, &Socket::readyRead, [this]() { notify_incoming_data(); });
+        QObject::connect(mySocket, &Socket::bytesWritten, [this](qint64) { on_bytes_written(); });
+        QObject::connect(mySocket, &Socket::connected, [this]() { notify_connected(); });
+        QObject::connect(mySocket, &Socket::disconnected, [this]() { notify_disconnected(); });
+        QObject::connect(mySocket, QOverload<SocketError>::of(&Socket::error),
+                                         [this](SocketError e) { notify_error(e); });
+    }
+
+    void notify_connected()
+    {
+        if (mySocket != nullptr) {
+            o_assert(myListener != nullptr);
+            log<debug>(O_LOG_TOKEN, "%s socket connected", Traits::kind());
+            configure_socket(*mySocket);
+            myState = State::Connected;
+            myConnectTimer.stop();
+            myReconnectAttempts = 0;
+            myListener->on_connected(*this);
+            complete_open(Result<bool> { true, Error {} });
+            //The messages written while connecting go out together.
+            flush();
+        }
+    }
+
+    void notify_disconnected()
+    {
+        if (mySocket != nullptr) {
+            o_assert(myListener != nullptr);
+            log<debug>(O_LOG_TOKEN, "%s socket disconnected", Traits::kind());
+            if (myState == State::Connected) {
+                if (myClientSide && myReconnect.myEnabled) {
+                    schedule_reconnect();
+                } else {
+                    myState = State::Closed;
+                }
+            }
+            myListener->on_disconnected(*this);
+        }
+    }
+
+    void notify_incoming_data()
+    {
+        /* Deliver every complete message already buffered, not just the first one. The listener consumes
+         * a message with get_read_data() and asks for the next one with read(); stop when it does neither.
+         * The messages written meanwhile, such as the results of the calls delivered, are sent together
+         * at the end.
+         */
+        myMetrics.wakeup();
+        const bool outermost = !myDelivering;
+        myDelivering = true;
+        while (mySocket != nullptr && mySocket->bytesAvailable() >= myReadLength) {
+            o_assert(myListener != nullptr);
+            uint64_t readCount = myReadCount;
+            myListener->on_incoming_data(*this, mySocket->bytesAvailable());
+            if (myReadCount == readCount || myReadLength == 0u || !is_open()) {
+                break;
+            }
+        }
+        if (outermost) {
+            myDelivering = false;
+            if ( !myWriteQueue.empty()) {
+                queued();
+            }
+        }
+    }
+
+    void notify_error(typename Traits::SocketError e)
+    {
+        if (mySocket != nullptr) {
+            o_assert(myListener != nullptr);
+            Error err { e, mySocket->errorString().toStdString() };
+            if (myState == State::Connecting) {
+                connect_failed(err);
+                return;
+            }
+            log<error>(O_LOG_TOKEN, "%s socket error - %s", Traits::kind(), err.message().c_str());
+            myListener->on_connection_error(*this, err);
+        }
+    }
+};
+
+}   //namespace details
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_DETAILS_SOCKETTRANSPORT_H
@@ -0,0 +1,173 @@
+/*!
+ * \file
+ * \brief     CerQall single-producer single-consumer byte ring for shared memory
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_DETAILS_SPSCRING_H
+#define CERCALL_QT_DETAILS_SPSCRING_H
+
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace cercall {
+namespace qt {
+namespace details {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "the shared memory ring needs lock-free atomics");
+
+/**
+ * Lock-free byte ring with one producer and one consumer, which may live in different processes.
+ *
+ * The object is placed at the start of a memory block of size_for(capacity) bytes, normally in shared memory,
+ * and the ring data follows it. Head and tail are free-running byte counters, so the ring never needs a spare
+ * slot. The waiting flags let each side ask the other for a wake-up, see want_data() and ShmTransport.
+ */
+class SpscRing
+{
+public:
+    explicit SpscRing(uint32_t capacity) : myCapacity(capacity)
+    {
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    /**
+     * Size of the memory block for a ring of the given capacity, which must be a power of two.
+     */
+    static size_t size_for(uint32_t capacity)
+    {
+        return sizeof(SpscRing) + capacity;
+    }
+
+    uint32_t capacity() const
+    {
+        return myCapacity;
+    }
+
+    /**
+     * Number of bytes the consumer can read.
+     */
+    size_t readable() const
+    {
+        return static_cast<size_t>(myHead.load(std::memory_order_acquire) - myTail.load(std::memory_order_relaxed));
+    }
+
+    /**
+     * Number of bytes written to the ring since it was made, for the consumer to tell whether data came in.
+     */
+    uint64_t written() const
+    {
+        return myHead.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Copies as much of the data into the ring as fits, returns the number of bytes copied. Producer only.
+     */
+    size_t write(const char* data, size_t len)
+    {
+        uint64_t head = myHead.load(std::memory_order_relaxed);
+        uint64_t tail = myTail.load(std::memory_order_acquire);
+        size_t n = std::min(len, static_cast<size_t>(myCapacity - (head - tail)));
+        copy_in(head, data, n);
+        myHead.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    /**
+     * Copies up to len bytes out of the ring, returns the number of bytes copied. Consumer only.
+     */
+    size_t read(char* data, size_t len)
+    {
+        uint64_t tail = myTail.load(std::memory_order_relaxed);
+        uint64_t head = myHead.load(std::memory_order_acquire);
+        size_t n = std::min(len, static_cast<size_t>(head - tail));
+        copy_out(tail, data, n);
+        myTail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    /**
+     * The wake-up handshake. A side which finds nothing to do asks the other one for a wake-up, then looks at
+     * the ring again, and the other side takes the request after it has changed the ring. Each side stores,
+     * then loads what the other side stores, so a full fence goes between the two: then at least one of them
+     * sees the store of the other, and no data nor room goes unnoticed.
+     *
+     * Consumer: asks for a wake-up when data is written. Check readable() afterwards.
+     */
+    void want_data()
+    {
+        myConsumerWaiting.store(1u, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    /**
+     * Producer, after writing: returns true if the consumer asked for a wake-up, and clears the request.
+     */
+    bool take_data_request()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return myConsumerWaiting.exchange(0u, std::memory_order_relaxed) != 0u;
+    }
+
+    /**
+     * Producer: asks for a wake-up when room is made, because the ring is full. Try to write afterwards.
+     */
+    void want_space()
+    {
+        myProducerWaiting.store(1u, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    /**
+     * Consumer, after reading: returns true if the producer asked for a wake-up, and clears the request.
+     */
+    bool take_space_request()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return myProducerWaiting.exchange(0u, std::memory_order_relaxed) != 0u;
+    }
+
+private:
+    alignas(64) std::atomic<uint64_t> myHead { 0u };
+    alignas(64) std::atomic<uint64_t> myTail { 0u };
+    alignas(64) std::atomic<uint32_t> myConsumerWaiting { 1u };
+    std::atomic<uint32_t> myProducerWaiting { 0u };
+    const uint32_t myCapacity;
+    alignas(64) char myData[1];     //Actually myCapacity bytes.
+
+    char* data()
+    {
+        return myData;
+    }
+
+    void copy_in(uint64_t pos, const char* src, size_t n)
+    {
+        size_t offset = static_cast<size_t>(pos & (myCapacity - 1u));
+        size_t first = std::min(n, myCapacity - offset);
+        std::memcpy(data() + offset, src, first);
+        std::memcpy(data(), src + first, n - first);
+    }
+
+    void copy_out(uint64_t pos, char* dst, size_t n)
+    {
+        size_t offset = static_cast<size_t>(pos & (myCapacity - 1u));
+        size_t first = std::min(n, myCapacity - offset);
+        std::memcpy(dst, data() + offset, first);
+        std::memcpy(dst + first, data(), n - first);
+    }
+};
+
+}   //namespace details
+}   //namespace qt
+}   //namespace cercall
+
+#endif // CERCALL_QT_DETAILS_SPSCRING_H
@@ -0,0 +1,275 @@
+/*!
+ * \file
+ * \brief     CerQall io_uring instance of a Qt thread
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_DETAILS_URINGLOOP_H
+#define CERCALL_QT_DETAILS_URINGLOOP_H
+
+#include <QSocketNotifier>
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace cercall {
+namespace qt {
+namespace details {
+
+/**
+ * Owner of operations submitted to a UringLoop. The operation kind is passed back with every completion.
+ * A handler must outlive its operations; it is told to flush or resume only while it is registered for it.
+ */
+class UringHandler
+{
+public:
+    virtual ~UringHandler() = default;
+
+    virtual void complete(int op, int res, unsigned flags) = 0;
+
+    /**
+     * Called before the loop submits, if the handler asked for it with UringLoop::defer().
+     */
+    virtual void flush() {}
+
+    /**
+     * Called at the next submission, if the handler ran out of receive buffers.
+     */
+    virtual void resume() {}
+};
+
+/**
+ * An io_uring driven by the Qt event loop of a thread. The ring signals completions through an eventfd,
+ * watched by a single QSocketNotifier, and they are all handled in one go. Submissions are collected and
+ * made with one system call at the end of the completions, or from the event loop.
+ *
+ * Data is received into a ring of buffers provided to the kernel once, shared by all the connections of the
+ * thread. A connection holds on to the buffers of the data it has received only while it delivers the data,
+ * and gives them back with recycle().
+ */
+class UringLoop : public std::enable_shared_from_this<UringLoop>
+{
+public:
+    static constexpr unsigned Entries = 256u;
+    static constexpr unsigned BufferCount = 256u;          //A power of two.
+    static constexpr unsigned BufferSize = 16u * 1024u;
+    static constexpr int BufferGroup = 0;
+    static constexpr int OpBits = 3;
+
+    /**
+     * Returns the loop of the calling thread, which lives as long as it is used.
+     */
+    static std::shared_ptr<UringLoop> for_current_thread()
+    {
+        static thread_local std::weak_ptr<UringLoop> current;
+        std::shared_ptr<UringLoop> loop = current.lock();
+        if ( !loop) {
+            loop = std::make_shared<UringLoop>();
+            current = loop;
+        }
+        return loop;
+    }
+
+    /**
+     * Throws std::runtime_error if the kernel does not support what the loop needs (Linux 5.19 or newer).
+     */
+    UringLoop() : myBuffers(new char[BufferCount * BufferSize])
+    {
+        int ret = io_uring_queue_init(Entries, &myRing, 0);
+        if (ret < 0) {
+            throw std::runtime_error(std::string("cercall::qt::UringLoop: ") + std::strerror(-ret));
+        }
+        myBufferRing = io_uring_setup_buf_ring(&myRing, BufferCount, BufferGroup, 0, &ret);
+        myEventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (myBufferRing == nullptr || myEventFd < 0 || io_uring_register_eventfd(&myRing, myEventFd) < 0) {
+            std::string err = myBufferRing == nullptr ? std::strerror(-ret) : std::strerror(errno);
+            release();
+            throw std::runtime_error("cercall::qt::UringLoop: " + err);
+        }
+        for (unsigned bid = 0u; bid < BufferCount; ++bid) {
+            add_buffer(bid, static_cast<int>(bid));
+        }
+        io_uring_buf_ring_advance(myBufferRing, static_cast<int>(BufferCount));
+        myNotifier.reset(new QSocketNotifier(myEventFd, QSocketNotifier::Read));
+        QObject::connect(myNotifier.get(), &QSocketNotifier::activated, [this]() { process(); });
+    }
+
+    UringLoop(const UringLoop&) = delete;
+    UringLoop& operator=(const UringLoop&) = delete;
+
+    ~UringLoop()
+    {
+        myNotifier.reset();
+        release();
+    }
+
+    /**
+     * Returns a submission entry for an operation of the handler, to be submitted soon. Throws
+     * std::runtime_error if the submission queue is full and cannot be submitted.
+     */
+    io_uring_sqe* get_sqe(UringHandler* handler, int op)
+    {
+        io_uring_sqe* sqe = io_uring_get_sqe(&myRing);
+        if (sqe == nullptr) {
+            //The submission queue is full.
+            int ret = io_uring_submit(&myRing);
+            sqe = io_uring_get_sqe(&myRing);
+            if (sqe == nullptr) {
+                throw std::runtime_error(std::string("cercall::qt::UringLoop: submission queue full - ")
+                                         + std::strerror(ret < 0 ? -ret : EBUSY));
+            }
+        }
+        io_uring_sqe_set_data64(sqe, user_data(handler, op));
+        schedule_submit();
+        return sqe;
+    }
+
+    static uint64_t user_data(const UringHandler* handler, int op)
+    {
+        return reinterpret_cast<uintptr_t>(handler) | static_cast<uintptr_t>(op);
+    }
+
+    const char* buffer(unsigned bid) const
+    {
+        return myBuffers.get() + static_cast<size_t>(bid) * BufferSize;
+    }
+
+    void recycle(unsigned bid)
+    {
+        add_buffer(bid, 0);
+        io_uring_buf_ring_advance(myBufferRing, 1);
+    }
+
+    /**
+     * Has the handler flushed before the next submission.
+     */
+    void defer(UringHandler* handler)
+    {
+        myDeferred.push_back(handler);
+        schedule_submit();
+    }
+
+    /**
+     * Has the handler resumed at the next submission. The connections give their buffers back as soon as they
+     * have delivered the data, so the buffers the handler found missing are back by then.
+     */
+    void starve(UringHandler* handler)
+    {
+        myStarved.push_back(handler);
+        schedule_submit();
+    }
+
+    /**
+     * Called by a handler which is going away.
+     */
+    void forget(UringHandler* handler)
+    {
+        myDeferred.erase(std::remove(myDeferred.begin(), myDeferred.end(), handler), myDeferred.end());
+        myStarved.erase(std::remove(myStarved.begin(), myStarved.end(), handler), myStarved.end());
+    }
+
+private:
+    io_uring myRing;
+    io_uring_buf_ring* myBufferRing = nullptr;
+    std::unique_ptr<char[]> myBuffers;
+    int myEventFd = -1;
+    std::unique_ptr<QSocketNotifier> myNotifier;
+    std::vector<UringHandler*> myDeferred;
+    std::vector<UringHandler*> myStarved;
+    bool myProcessing = false;
+    bool mySubmitScheduled = false;
+
+    /**
+     * Puts the buffer in the ring at the offset from its tail; it is handed to the kernel by advancing the tail.
+     */
+    void add_buffer(unsigned bid, int offset)
+    {
+        io_uring_buf_ring_add(myBufferRing, myBuffers.get() + static_cast<size_t>(bid) * BufferSize, BufferSize,
+                              static_cast<unsigned short>(bid), io_uring_buf_ring_mask(BufferCount), offset);
+    }
+
+    void release()
+    {
+        if (myBufferRing != nullptr) {
+            io_uring_free_buf_ring(&myRing, myBufferRing, BufferCount, BufferGroup);
+            myBufferRing = nullptr;
+        }
+        if (myEventFd >= 0) {
+            ::close(myEventFd);
+            myEventFd = -1;
+        }
+        io_uring_queue_exit(&myRing);
+    }
+
+    void schedule_submit()
+    {
+        if ( !myProcessing && !mySubmitScheduled) {
+            mySubmitScheduled = true;
+            QMetaObject::invokeMethod(myNotifier.get(), [this]() { submit(); }, Qt::QueuedConnection);
+        }
+    }
+
+    /**
+     * Handles all the completions there are, then submits what the handlers have queued meanwhile.
+     */
+    void process()
+    {
+        uint64_t count;
+        while (::read(myEventFd, &count, sizeof(count)) > 0) {}
+        //A handler may drop the last reference to the loop.
+        std::shared_ptr<UringLoop> self = shared_from_this();
+        myProcessing = true;
+        io_uring_cqe* cqe = nullptr;
+        while (io_uring_peek_cqe(&myRing, &cqe) == 0) {
+            const uint64_t data = cqe->user_data;
+            const int res = cqe->res;
+            const unsigned flags = cqe->flags;
+            io_uring_cqe_seen(&myRing, cqe);
+            if (data != 0u) {
+                UringHandler* handler = reinterpret_cast<UringHandler*>(data & ~uint64_t((1u << OpBits) - 1u));
+                handler->complete(static_cast<int>(data & ((1u << OpBits) - 1u)), res, flags);
+            }
+        }
+        myProcessing = false;
+        submit();
+    }
+
+    void submit()
+    {
+        mySubmitScheduled = false;
+        if ( !myStarved.empty()) {
+            std::vector<UringHandler*> starved;
+            starved.swap(myStarved);
+            for (UringHandler* handler : starved) {
+                handler->resume();
+            }
+        }
+        while ( !myDeferred.empty()) {
+            std::vector<UringHandler*> deferred;
+            deferred.swap(myDeferred);
+            for (UringHandler* handler : deferred) {
+                handler->flush();
+            }
+        }
+        if (io_uring_sq_ready(&myRing) > 0u) {
+            io_uring_submit(&myRing);
+        }
+    }
+};
+
+}   //namespace details
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_DETAILS_URINGLOOP_H
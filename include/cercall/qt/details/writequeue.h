@@ -0,0 +1,294 @@
+/*!
+ * \file
+ * \brief     CerQall queue of outgoing messages for Qt socket transports
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_DETAILS_WRITEQUEUE_H
+#define CERCALL_QT_DETAILS_WRITEQUEUE_H
+
+#include <QIODevice>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <string>
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <cerrno>
+#endif
+
+namespace cercall {
+namespace qt {
+namespace details {
+
+/**
+ * Holds the messages written to a transport until they are flushed to its socket.
+ *
+ * The messages are moved or copied in once and never concatenated. A message may also be a shared,
+ * immutable buffer, which is queued by reference; this is how a broadcast frame reaches many transports.
+ * On Unix, if the socket has no data of its own waiting to be written, a flush hands all queued buffers
+ * to the kernel with a single gathering sendmsg() call. Whatever the kernel does not take goes to the
+ * QIODevice write buffer, which preserves the order of the data. A flush may be limited to keep the write
+ * buffer of the device below a watermark; the remaining messages then stay in the queue, where events can
+ * still be dropped or replaced.
+ */
+class WriteQueue
+{
+public:
+    static constexpr int MaxSegments = 64;
+
+    /**
+     * Describes a queued message. Only events may be dropped or replaced, since the other messages, such as
+     * call results, are expected by the peer. Events with the same non-zero key are of the same kind, and
+     * a newer one makes an older one obsolete.
+     */
+    struct Tag
+    {
+        bool myEvent = false;
+        uint64_t myKey = 0u;
+    };
+
+    bool empty() const
+    {
+        return myBuffers.empty();
+    }
+
+    size_t size() const
+    {
+        return myBuffers.size();
+    }
+
+    /**
+     * Number of queued bytes.
+     */
+    size_t bytes() const
+    {
+        return myBytes;
+    }
+
+    void push(std::string&& buf)
+    {
+        push(std::move(buf), Tag {});
+    }
+
+    void push(std::shared_ptr<const std::string> buf)
+    {
+        push(std::move(buf), Tag {});
+    }
+
+    void push(std::string&& buf, const Tag& tag)
+    {
+        if ( !buf.empty()) {
+            myBytes += buf.size();
+            myBuffers.emplace_back(std::move(buf), tag);
+            count_in(myBuffers.back());
+        }
+    }
+
+    void push(std::shared_ptr<const std::string> buf, const Tag& tag)
+    {
+        if (buf && !buf->empty()) {
+            myBytes += buf->size();
+            myBuffers.emplace_back(std::move(buf), tag);
+            count_in(myBuffers.back());
+        }
+    }
+
+    /**
+     * Replaces the newest queued event of the same kind, if it has not been started, by the given one, in
+     * its place in the queue. Returns false if there is no such event.
+     */
+    bool replace(const Tag& tag, std::shared_ptr<const std::string> buf)
+    {
+        if (tag.myKey == 0u || myKeyedEvents == 0u) {
+            return false;
+        }
+        for (auto it = myBuffers.rbegin(); it != myBuffers.rend(); ++it) {
+            if (it->tag().myEvent && it->tag().myKey == tag.myKey) {
+                if (it == std::prev(myBuffers.rend()) && myFrontOffset > 0u) {
+                    return false;
+                }
+                myBytes = myBytes - it->size() + buf->size();
+                *it = Segment(std::move(buf), tag);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Drops queued events, the oldest first, until the queue holds no more than the given number of bytes
+     * or has no events left which have not been started. Returns the number of dropped events.
+     */
+    size_t drop_events(size_t maxBytes)
+    {
+        size_t dropped = 0u;
+        auto it = myBuffers.begin();
+        if (it != myBuffers.end() && myFrontOffset > 0u) {
+            ++it;
+        }
+        while (myBytes > maxBytes && it != myBuffers.end()) {
+            if (it->tag().myEvent) {
+                myBytes -= it->size();
+                count_out(*it);
+                it = myBuffers.erase(it);
+                ++dropped;
+            } else {
+                ++it;
+            }
+        }
+        return dropped;
+    }
+
+    void clear()
+    {
+        myKeyedEvents = 0u;
+        myBuffers.clear();
+        myFrontOffset = 0u;
+        myBytes = 0u;
+    }
+
+    /**
+     * Writes the queued buffers to the device, while its write buffer holds less than maxBuffered bytes.
+     * The native descriptor may be -1 if not available. Returns false if the device reported a write error,
+     * in which case the queue is cleared.
+     */
+    bool flush(QIODevice& dev, qintptr fd, qint64 maxBuffered = std::numeric_limits<qint64>::max())
+    {
+#ifdef Q_OS_UNIX
+        if (fd >= 0 && dev.bytesToWrite() == 0) {
+            send_direct(static_cast<int>(fd));
+        }
+#else
+        (void) fd;
+#endif
+        while ( !myBuffers.empty() && dev.bytesToWrite() < maxBuffered) {
+            const Segment& buf = myBuffers.front();
+            const char* data = buf.data() + myFrontOffset;
+            qint64 len = static_cast<qint64>(buf.size() - myFrontOffset);
+            if (dev.write(data, len) != len) {
+                clear();
+                return false;
+            }
+            myBytes -= static_cast<size_t>(len);
+            myFrontOffset = 0u;
+            count_out(myBuffers.front());
+            myBuffers.pop_front();
+        }
+        return true;
+    }
+
+private:
+    /**
+     * A queued message, either owned by the queue or shared with other queues.
+     */
+    class Segment
+    {
+    public:
+        Segment(std::string&& buf, const Tag& tag) : myOwned(std::move(buf)), myTag(tag) {}
+        Segment(std::shared_ptr<const std::string>&& buf, const Tag& tag) : myShared(std::move(buf)), myTag(tag) {}
+
+        const char* data() const
+        {
+            return myShared ? myShared->data() : myOwned.data();
+        }
+
+        size_t size() const
+        {
+            return myShared ? myShared->size() : myOwned.size();
+        }
+
+        const Tag& tag() const
+        {
+            return myTag;
+        }
+
+    private:
+        std::string myOwned;
+        std::shared_ptr<const std::string> myShared;
+        Tag myTag;
+    };
+
+    std::deque<Segment> myBuffers;
+    size_t myFrontOffset = 0u;
+    size_t myBytes = 0u;
+    size_t myKeyedEvents = 0u;  //Queued events with a key, which replace() looks for.
+
+    void count_in(const Segment& seg)
+    {
+        if (seg.tag().myEvent && seg.tag().myKey != 0u) {
+            ++myKeyedEvents;
+        }
+    }
+
+    void count_out(const Segment& seg)
+    {
+        if (seg.tag().myEvent && seg.tag().myKey != 0u) {
+            --myKeyedEvents;
+        }
+    }
+
+#ifdef Q_OS_UNIX
+    void send_direct(int fd)
+    {
+        while ( !myBuffers.empty()) {
+            iovec iov[MaxSegments];
+            int n = 0;
+            size_t total = 0u;
+            for (auto it = myBuffers.begin(); it != myBuffers.end() && n < MaxSegments; ++it, ++n) {
+                size_t offset = (n == 0) ? myFrontOffset : 0u;
+                iov[n].iov_base = const_cast<char*>(it->data() + offset);
+                iov[n].iov_len = it->size() - offset;
+                total += iov[n].iov_len;
+            }
+            msghdr msg {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            ssize_t sent;
+            do {
+#ifdef MSG_NOSIGNAL
+                sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+                sent = ::sendmsg(fd, &msg, MSG_DONTWAIT);
+#endif
+            } while (sent < 0 && errno == EINTR);
+            if (sent <= 0) {
+                return;     //Let the QIODevice deal with it.
+            }
+            consume(static_cast<size_t>(sent));
+            if (static_cast<size_t>(sent) < total) {
+                return;     //The kernel buffer is full.
+            }
+        }
+    }
+#endif
+
+    void consume(size_t len)
+    {
+        myBytes -= len;
+        while (len > 0u) {
+            size_t frontLen = myBuffers.front().size() - myFrontOffset;
+            if (len >= frontLen) {
+                len -= frontLen;
+                count_out(myBuffers.front());
+                myBuffers.pop_front();
+                myFrontOffset = 0u;
+            } else {
+                myFrontOffset += len;
+                len = 0u;
+            }
+        }
+    }
+};
+
+}   //namespace details
+}   //namespace qt
+}   //namespace cercall
+
+#endif // CERCALL_QT_DETAILS_WRITEQUEUE_H
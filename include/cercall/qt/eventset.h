@@ -0,0 +1,315 @@
+/*!
+ * \file
+ * \brief     CerQall closed set of event types
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_EVENTSET_H
+#define CERCALL_QT_EVENTSET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace cercall {
+namespace qt {
+
+namespace details {
+
+template<typename T, typename... Ts>
+struct TypeIndex;
+
+template<typename T, typename... Ts>
+struct TypeIndex<T, T, Ts...> : std::integral_constant<unsigned, 0u> {};
+
+template<typename T, typename U, typename... Ts>
+struct TypeIndex<T, U, Ts...> : std::integral_constant<unsigned, 1u + TypeIndex<T, Ts...>::value> {};
+
+template<typename T, typename... Ts>
+struct IsOneOf : std::false_type {};
+
+template<typename T, typename U, typename... Ts>
+struct IsOneOf<T, U, Ts...> : std::integral_constant<bool, std::is_same<T, U>::value || IsOneOf<T, Ts...>::value> {};
+
+template<typename T, typename... Ts>
+struct FirstOf
+{
+    using type = T;
+};
+
+template<typename... Ts>
+struct AllNothrowMovable : std::true_type {};
+
+template<typename T, typename... Ts>
+struct AllNothrowMovable<T, Ts...>
+    : std::integral_constant<bool, std::is_nothrow_move_constructible<T>::value && AllNothrowMovable<Ts...>::value> {};
+
+}   //namespace details
+
+/**
+ * An event of one of a closed set of types, to be used as the EventType of a service interface instead of a
+ * polymorphic base class:
+ *
+ *     using ClockEvent = cercall::qt::EventSet<AlarmEvent, TickEvent>;
+ *     ...
+ *     broadcast_event<ClockEvent>(TickEvent { time });
+ *
+ * The event is held in place, with the index of its type in the set as a one byte tag. It is serialized as the
+ * tag followed by the event, with no type name and no registry lookup, and the events need no common base nor
+ * virtual functions. visit() calls the overload of a visitor for the type of the event through a table of
+ * functions made at compile time, so dispatching takes the same time whatever the number of types:
+ *
+ *     struct Handler
+ *     {
+ *         void operator()(const AlarmEvent& alarm);
+ *         void operator()(const TickEvent& tick);
+ *     };
+ *     event.visit(handler);
+ *
+ * A default constructed set holds a default constructed event of the first type. Like std::variant, a set moves
+ * without exceptions when all its event types do, so that containers of events move them when they grow.
+ */
+template<typename... Events>
+class EventSet
+{
+    static_assert(sizeof...(Events) > 0u && sizeof...(Events) <= 256u, "An EventSet has 1 to 256 event types");
+
+    using First = typename details::FirstOf<Events...>::type;
+
+public:
+    using Tag = uint8_t;
+
+    static constexpr size_t size()
+    {
+        return sizeof...(Events);
+    }
+
+    /**
+     * The tag of an event type, which is its index in the set.
+     */
+    template<typename E>
+    static constexpr Tag tag_of()
+    {
+        return static_cast<Tag>(details::TypeIndex<E, Events...>::value);
+    }
+
+    EventSet()
+    {
+        new (&myStorage) First();
+    }
+
+    template<typename E, typename T = typename std::decay<E>::type,
+             typename = typename std::enable_if<details::IsOneOf<T, Events...>::value>::type>
+    EventSet(E&& event) : myTag(tag_of<T>())
+    {
+        new (&myStorage) T(std::forward<E>(event));
+    }
+
+    EventSet(const EventSet& other)
+    {
+        copy_from(other);
+    }
+
+    EventSet(EventSet&& other) noexcept(details::AllNothrowMovable<Events...>::value)
+    {
+        move_from(other);
+    }
+
+    EventSet& operator=(const EventSet& other)
+    {
+        if (this != &other) {
+            destroy();
+            try {
+                copy_from(other);
+            } catch (...) {
+                reset();
+                throw;
+            }
+        }
+        return *this;
+    }
+
+    EventSet& operator=(EventSet&& other) noexcept(details::AllNothrowMovable<Events...>::value)
+    {
+        if (this != &other) {
+            destroy();
+            move_assign(other, details::AllNothrowMovable<Events...>{});
+        }
+        return *this;
+    }
+
+    ~EventSet()
+    {
+        destroy();
+    }
+
+    /**
+     * Replaces the event by one of the given type, made of the arguments.
+     */
+    template<typename E, typename... Args>
+    E& emplace(Args&&... args)
+    {
+        static_assert(details::IsOneOf<E, Events...>::value, "Not an event type of the set");
+        destroy();
+        try {
+            E* event = new (&myStorage) E(std::forward<Args>(args)...);
+            myTag = tag_of<E>();
+            return *event;
+        } catch (...) {
+            reset();
+            throw;
+        }
+    }
+
+    Tag tag() const
+    {
+        return myTag;
+    }
+
+    template<typename E>
+    bool is() const
+    {
+        return myTag == tag_of<E>();
+    }
+
+    /**
+     * Returns the event if it is of the given type, or nullptr.
+     */
+    template<typename E>
+    const E* get_as() const
+    {
+        return is<E>() ? reinterpret_cast<const E*>(&myStorage) : nullptr;
+    }
+
+    template<typename E>
+    E* get_as()
+    {
+        return is<E>() ? reinterpret_cast<E*>(&myStorage) : nullptr;
+    }
+
+    /**
+     * Calls the visitor with the event, as its own type. All the overloads must return the same type.
+     */
+    template<typename Visitor>
+    auto visit(Visitor&& visitor) const -> decltype(visitor(std::declval<const First&>()))
+    {
+        using Result = decltype(visitor(std::declval<const First&>()));
+        static constexpr Result (*call[])(const void*, Visitor&) = { &EventSet::call_as<Events, Visitor, Result>... };
+        return call[myTag](&myStorage, visitor);
+    }
+
+    template<typename Archive>
+    void save(Archive& ar) const
+    {
+        ar(myTag);
+        visit([&ar](const auto& event) { ar(event); });
+    }
+
+    /**
+     * Throws std::out_of_range for a tag which is not in the set.
+     */
+    template<typename Archive>
+    void load(Archive& ar)
+    {
+        Tag tag = 0u;
+        ar(tag);
+        if (tag >= size()) {
+            throw std::out_of_range("cercall::qt::EventSet: unknown event tag");
+        }
+        static constexpr void (*load[])(Archive&, EventSet&) = { &EventSet::load_as<Events, Archive>... };
+        load[tag](ar, *this);
+    }
+
+private:
+    typename std::aligned_union<0u, Events...>::type myStorage;
+    Tag myTag = 0u;
+
+    void destroy()
+    {
+        static constexpr void (*destroy[])(void*) = { &EventSet::destroy_as<Events>... };
+        destroy[myTag](&myStorage);
+    }
+
+    /**
+     * Makes an event of the first type in the storage of one which was destroyed, when replacing it failed.
+     */
+    void reset()
+    {
+        myTag = 0u;
+        new (&myStorage) First();
+    }
+
+    void copy_from(const EventSet& other)
+    {
+        static constexpr void (*copy[])(const void*, void*) = { &EventSet::copy_as<Events>... };
+        copy[other.myTag](&other.myStorage, &myStorage);
+        myTag = other.myTag;
+    }
+
+    void move_from(EventSet& other)
+    {
+        static constexpr void (*move[])(void*, void*) = { &EventSet::move_as<Events>... };
+        move[other.myTag](&other.myStorage, &myStorage);
+        myTag = other.myTag;
+    }
+
+    void move_assign(EventSet& other, std::true_type)
+    {
+        move_from(other);
+    }
+
+    /**
+     * Moves into the storage of a destroyed event, leaving an event of the first type if moving throws.
+     */
+    void move_assign(EventSet& other, std::false_type)
+    {
+        try {
+            move_from(other);
+        } catch (...) {
+            reset();
+            throw;
+        }
+    }
+
+    template<typename E>
+    static void copy_as(const void* from, void* to)
+    {
+        new (to) E(*static_cast<const E*>(from));
+    }
+
+    template<typename E>
+    static void move_as(void* from, void* to)
+    {
+        new (to) E(std::move(*static_cast<E*>(from)));
+    }
+
+    template<typename E>
+    static void destroy_as(void* event)
+    {
+        static_cast<E*>(event)->~E();
+    }
+
+    template<typename E, typename Visitor, typename Result>
+    static Result call_as(const void* event, Visitor& visitor)
+    {
+        return visitor(*static_cast<const E*>(event));
+    }
+
+    template<typename E, typename Archive>
+    static void load_as(Archive& ar, EventSet& set)
+    {
+        ar(set.emplace<E>());
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_EVENTSET_H
@@ -0,0 +1,91 @@
+/*!
+ * \file
+ * \brief     CerQall local socket Acceptor class for Qt
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_LOCALACCEPTOR_H
+#define CERCALL_QT_LOCALACCEPTOR_H
+
+#include <QLocalServer>
+#include "cercall/acceptor.h"
+#include "cercall/qt/localtransport.h"
+
+namespace cercall {
+namespace qt {
+
+class LocalAcceptor : public cercall::Acceptor
+{
+public:
+
+    LocalAcceptor(const QString& serverName) : myServerName { serverName }, myServer {}
+    {
+        QObject::connect(&myServer, &QLocalServer::newConnection, [this]() {
+            notify_new_connection();
+        });
+    }
+
+    bool is_open() const override
+    {
+        return myServer.isListening();
+    }
+
+    void open(int maxPendingClientConnections = -1) override
+    {
+        if (myListener == nullptr) {
+            throw std::logic_error("cercall::qt::LocalAcceptor::open(): listener is NULL");
+        }
+        if ( !is_open()) {
+            if (maxPendingClientConnections > 0) {
+                myServer.setMaxPendingConnections(maxPendingClientConnections);
+            }
+            //Remove a socket file left over by a crashed server, as SO_REUSEADDR does for TCP.
+            QLocalServer::removeServer(myServerName);
+            if (!myServer.listen(myServerName)) {
+                Error err { myServer.serverError(), myServer.errorString().toStdString() };
+                myListener->on_accept_error(err);
+                return;
+            }
+        }
+    }
+
+    void close() override
+    {
+        if (is_open()) {
+            myServer.close();
+        }
+    }
+
+    /**
+     * Full name of the server socket, for example its path on Unix.
+     */
+    QString full_server_name() const
+    {
+        return myServer.fullServerName();
+    }
+
+private:
+    QString myServerName;
+    QLocalServer myServer;
+
+    void notify_new_connection()
+    {
+        if (myListener == nullptr) {
+            throw std::logic_error("cercall::qt::LocalAcceptor::notify_new_connection(): listener is NULL");
+        }
+        QLocalSocket* newClientSock = myServer.nextPendingConnection();
+        if (newClientSock != nullptr) {
+            newClientSock->setParent(nullptr);  //cercall::Service class manages its transport objects.
+            myListener->on_client_accepted(std::make_shared<LocalTransport>(newClientSock));
+        }
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif // CERCALL_QT_LOCALACCEPTOR_H
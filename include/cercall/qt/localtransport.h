@@ -0,0 +1,84 @@
+/*!
+ * \file
+ * \brief     CerQall local socket Transport for Qt
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_LOCALTRANSPORT_H
+#define CERCALL_QT_LOCALTRANSPORT_H
+
+#include <QLocalSocket>
+#include "cercall/qt/details/sockettransport.h"
+
+namespace cercall {
+namespace qt {
+namespace details {
+
+template<>
+struct SocketTraits<QLocalSocket>
+{
+    using SocketError = QLocalSocket::LocalSocketError;
+
+    static const char* kind()
+    {
+        return "local";
+    }
+
+    static void disconnect(QLocalSocket& s)
+    {
+        s.disconnectFromServer();
+    }
+};
+
+}   //namespace details
+
+/**
+ * Transport over a QLocalSocket, that is a Unix domain socket or a Windows named pipe.
+ *
+ * It has the same interface as TcpTransport and is meant for clients running on the same host as the service.
+ */
+class LocalTransport : public details::SocketTransport<QLocalSocket>
+{
+public:
+    /**
+     * For use by the acceptor.
+     */
+    LocalTransport(QLocalSocket* s) : SocketTransport(s)
+    {
+    }
+
+    /**
+     * For client-side connections.
+     */
+    LocalTransport(const QString& serverName) : myServerName(serverName)
+    {
+        log<trace>(O_LOG_TOKEN, "server name param");
+    }
+
+    LocalTransport() = delete;
+    LocalTransport(const LocalTransport&) = delete;
+    LocalTransport& operator=(const LocalTransport&) = delete;
+    virtual ~LocalTransport()
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        close();
+    }
+
+private:
+    QString myServerName;
+
+    void connect_socket(QLocalSocket& s) override
+    {
+        log<debug>(O_LOG_TOKEN, "connect to server %s", [this]() { return myServerName; });
+        s.connectToServer(myServerName);
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_LOCALTRANSPORT_H
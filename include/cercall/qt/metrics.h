@@ -0,0 +1,541 @@
+/*!
+ * \file
+ * \brief     CerQall runtime metrics of transports, acceptors and services
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_METRICS_H
+#define CERCALL_QT_METRICS_H
+
+#include <QtAlgorithms>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace cercall {
+namespace qt {
+
+/**
+ * Counters and histograms which the transports, acceptors and services update as they work, and which a
+ * Registry exports in the Prometheus text format, see MetricsServer.
+ *
+ * Updates are lock-free. The counters of a connection are written only by the thread of the connection, so
+ * an update is a plain load and store; the registry sums up the live connections and those closed when it
+ * is read. Shared counters and histograms are updated with relaxed atomic additions.
+ *
+ * Building with CERQALL_NO_METRICS turns all of it into empty inline functions.
+ */
+namespace metrics {
+
+/**
+ * Totals of the connections of a kind of transport.
+ */
+struct ConnectionStats
+{
+    uint64_t myBytesIn = 0u;
+    uint64_t myBytesOut = 0u;
+    uint64_t myFramesIn = 0u;       //!< Messages read by the listener.
+    uint64_t myFramesOut = 0u;      //!< Messages written to the transport and sent or queued.
+    uint64_t myFramesConflated = 0u;    //!< Events put in the place of a queued one with the same key.
+    uint64_t myFramesDropped = 0u;      //!< Events dropped because the outbound queue was full.
+    uint64_t myWakeups = 0u;        //!< Notifications of incoming data, such as readyRead signals.
+    uint64_t myQueuedBytes = 0u;    //!< In the outbound queues of the transports.
+
+    void add(const ConnectionStats& other)
+    {
+        myBytesIn += other.myBytesIn;
+        myBytesOut += other.myBytesOut;
+        myFramesIn += other.myFramesIn;
+        myFramesOut += other.myFramesOut;
+        myFramesConflated += other.myFramesConflated;
+        myFramesDropped += other.myFramesDropped;
+        myWakeups += other.myWakeups;
+        myQueuedBytes += other.myQueuedBytes;
+    }
+};
+
+#ifndef CERQALL_NO_METRICS
+
+class Counter
+{
+public:
+    void add(uint64_t n = 1u)
+    {
+        myValue.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const
+    {
+        return myValue.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> myValue { 0u };
+};
+
+/**
+ * Histogram of durations. Bucket i counts the durations of up to 2^i microseconds, the last one the longer ones.
+ */
+class Histogram
+{
+public:
+    static constexpr int Buckets = 27;      //Up to 67 seconds.
+
+    void record(std::chrono::nanoseconds d)
+    {
+        const uint64_t ns = static_cast<uint64_t>(std::max<std::chrono::nanoseconds::rep>(d.count(), 0));
+        const uint64_t us = (ns + 999u) / 1000u;
+        const int log2 = us <= 1u ? 0 : 64 - static_cast<int>(qCountLeadingZeroBits(us - 1u));
+        const int bucket = log2 < Buckets ? log2 : Buckets;
+        myCounts[bucket].fetch_add(1u, std::memory_order_relaxed);
+        mySumNs.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    uint64_t count(int bucket) const
+    {
+        return myCounts[bucket].load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum_ns() const
+    {
+        return mySumNs.load(std::memory_order_relaxed);
+    }
+
+    static double upper_bound_sec(int bucket)
+    {
+        return static_cast<double>(uint64_t(1) << bucket) * 1e-6;
+    }
+
+private:
+    std::atomic<uint64_t> myCounts[Buckets + 1] {};
+    std::atomic<uint64_t> mySumNs { 0u };
+};
+
+/**
+ * Records the time from its construction to its destruction in the histogram.
+ */
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(Histogram* histogram)
+        : myHistogram(histogram), myStart(std::chrono::steady_clock::now()) {}
+
+    ScopedTimer(ScopedTimer&& other) : myHistogram(other.myHistogram), myStart(other.myStart)
+    {
+        other.myHistogram = nullptr;
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    ~ScopedTimer()
+    {
+        if (myHistogram != nullptr) {
+            myHistogram->record(std::chrono::steady_clock::now() - myStart);
+        }
+    }
+
+private:
+    Histogram* myHistogram;
+    std::chrono::steady_clock::time_point myStart;
+};
+
+class ConnectionMetrics;
+
+/**
+ * The metrics of a process. Counters and histograms are created on first use and live as long as the registry.
+ */
+class Registry
+{
+public:
+    static Registry& global()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    /**
+     * Returns the counter with the name and labels, such as "reason=\"rate\"". The help text is that of the
+     * first counter of the name.
+     */
+    Counter& counter(const std::string& name, const std::string& help, const std::string& labels = std::string())
+    {
+        std::lock_guard<std::mutex> lock(myMutex);
+        Family& family = get_family(name, help, "counter");
+        std::unique_ptr<Counter>& counter = family.myCounters[labels];
+        if ( !counter) {
+            counter.reset(new Counter);
+        }
+        return *counter;
+    }
+
+    Histogram& histogram(const std::string& name, const std::string& help, const std::string& labels = std::string())
+    {
+        std::lock_guard<std::mutex> lock(myMutex);
+        Family& family = get_family(name, help, "histogram");
+        std::unique_ptr<Histogram>& histogram = family.myHistograms[labels];
+        if ( !histogram) {
+            histogram.reset(new Histogram);
+        }
+        return *histogram;
+    }
+
+    /**
+     * Totals of the connections of the kind, closed ones included but for the queued bytes.
+     */
+    ConnectionStats connections(const std::string& kind, size_t* live = nullptr) const;
+
+    /**
+     * All metrics in the Prometheus text exposition format.
+     */
+    std::string prometheus() const;
+
+private:
+    friend class ConnectionMetrics;
+
+    struct Family
+    {
+        std::string myHelp;
+        const char* myType;
+        std::map<std::string, std::unique_ptr<Counter>> myCounters;
+        std::map<std::string, std::unique_ptr<Histogram>> myHistograms;
+    };
+
+    mutable std::mutex myMutex;
+    std::map<std::string, Family> myFamilies;
+    std::set<const ConnectionMetrics*> myConnections;
+    std::map<std::string, ConnectionStats> myClosed;    //By kind.
+
+    Family& get_family(const std::string& name, const std::string& help, const char* type)
+    {
+        Family& family = myFamilies[name];
+        if (family.myHelp.empty()) {
+            family.myHelp = help;
+            family.myType = type;
+        }
+        return family;
+    }
+
+    void attach(const ConnectionMetrics* connection)
+    {
+        std::lock_guard<std::mutex> lock(myMutex);
+        myConnections.insert(connection);
+    }
+
+    void detach(const ConnectionMetrics* connection);
+
+    static std::string number(double v)
+    {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.9g", v);
+        return buf;
+    }
+
+    static void add_sample(std::string& out, const std::string& name, const std::string& labels,
+                           const std::string& value)
+    {
+        out += name;
+        if ( !labels.empty()) {
+            out += "{" + labels + "}";
+        }
+        out += " " + value + "\n";
+    }
+};
+
+/**
+ * The counters of one connection, which count in the totals of its kind of transport while it lives.
+ */
+class ConnectionMetrics
+{
+public:
+    explicit ConnectionMetrics(const char* kind, Registry& registry = Registry::global())
+        : myKind(kind), myRegistry(registry)
+    {
+        myRegistry.attach(this);
+    }
+
+    ConnectionMetrics(const ConnectionMetrics&) = delete;
+    ConnectionMetrics& operator=(const ConnectionMetrics&) = delete;
+
+    ~ConnectionMetrics()
+    {
+        myRegistry.detach(this);
+    }
+
+    void wakeup()
+    {
+        bump(myWakeups, 1u);
+    }
+
+    void frame_in(size_t bytes)
+    {
+        bump(myFramesIn, 1u);
+        bump(myBytesIn, bytes);
+    }
+
+    void frame_out(size_t bytes)
+    {
+        bump(myFramesOut, 1u);
+        bump(myBytesOut, bytes);
+    }
+
+    void frame_conflated()
+    {
+        bump(myFramesConflated, 1u);
+    }
+
+    void frames_dropped(uint64_t count)
+    {
+        bump(myFramesDropped, count);
+    }
+
+    void queued(size_t bytes)
+    {
+        myQueuedBytes.store(bytes, std::memory_order_relaxed);
+    }
+
+    const char* kind() const
+    {
+        return myKind;
+    }
+
+    ConnectionStats stats() const
+    {
+        ConnectionStats s;
+        s.myBytesIn = myBytesIn.load(std::memory_order_relaxed);
+        s.myBytesOut = myBytesOut.load(std::memory_order_relaxed);
+        s.myFramesIn = myFramesIn.load(std::memory_order_relaxed);
+        s.myFramesOut = myFramesOut.load(std::memory_order_relaxed);
+        s.myFramesConflated = myFramesConflated.load(std::memory_order_relaxed);
+        s.myFramesDropped = myFramesDropped.load(std::memory_order_relaxed);
+        s.myWakeups = myWakeups.load(std::memory_order_relaxed);
+        s.myQueuedBytes = myQueuedBytes.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    const char* myKind;
+    Registry& myRegistry;
+    std::atomic<uint64_t> myBytesIn { 0u };
+    std::atomic<uint64_t> myBytesOut { 0u };
+    std::atomic<uint64_t> myFramesIn { 0u };
+    std::atomic<uint64_t> myFramesOut { 0u };
+    std::atomic<uint64_t> myFramesConflated { 0u };
+    std::atomic<uint64_t> myFramesDropped { 0u };
+    std::atomic<uint64_t> myWakeups { 0u };
+    std::atomic<uint64_t> myQueuedBytes { 0u };
+
+    //Only the thread of the connection writes, so no atomic read-modify-write is needed.
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+inline void Registry::detach(const ConnectionMetrics* connection)
+{
+    ConnectionStats s = connection->stats();
+    s.myQueuedBytes = 0u;
+    std::lock_guard<std::mutex> lock(myMutex);
+    myConnections.erase(connection);
+    myClosed[connection->kind()].add(s);
+}
+
+inline ConnectionStats Registry::connections(const std::string& kind, size_t* live) const
+{
+    std::lock_guard<std::mutex> lock(myMutex);
+    auto closed = myClosed.find(kind);
+    ConnectionStats total = closed != myClosed.end() ? closed->second : ConnectionStats {};
+    size_t count = 0u;
+    for (const ConnectionMetrics* connection : myConnections) {
+        if (kind == connection->kind()) {
+            total.add(connection->stats());
+            ++count;
+        }
+    }
+    if (live != nullptr) {
+        *live = count;
+    }
+    return total;
+}
+
+inline std::string Registry::prometheus() const
+{
+    std::set<std::string> kinds;
+    {
+        std::lock_guard<std::mutex> lock(myMutex);
+        for (const auto& closed : myClosed) {
+            kinds.insert(closed.first);
+        }
+        for (const ConnectionMetrics* connection : myConnections) {
+            kinds.insert(connection->kind());
+        }
+    }
+    std::map<std::string, std::pair<ConnectionStats, size_t>> byKind;
+    for (const std::string& kind : kinds) {
+        size_t live = 0u;
+        ConnectionStats s = connections(kind, &live);
+        byKind[kind] = std::make_pair(s, live);
+    }
+
+    std::string out;
+    struct ConnectionMetric
+    {
+        const char* myName;
+        const char* myHelp;
+        const char* myType;
+        uint64_t ConnectionStats::* myField;
+    };
+    const ConnectionMetric connectionMetrics[] = {
+        { "cerqall_transport_bytes_in_total", "Bytes of the messages read.", "counter", &ConnectionStats::myBytesIn },
+        { "cerqall_transport_bytes_out_total", "Bytes of the messages written.", "counter",
+          &ConnectionStats::myBytesOut },
+        { "cerqall_transport_frames_in_total", "Messages read.", "counter", &ConnectionStats::myFramesIn },
+        { "cerqall_transport_frames_out_total", "Messages written.", "counter", &ConnectionStats::myFramesOut },
+        { "cerqall_transport_frames_conflated_total", "Events replaced by newer ones in the outbound queues.",
+          "counter", &ConnectionStats::myFramesConflated },
+        { "cerqall_transport_frames_dropped_total", "Events dropped because the outbound queues were full.",
+          "counter", &ConnectionStats::myFramesDropped },
+        { "cerqall_transport_wakeups_total", "Notifications of incoming data.", "counter",
+          &ConnectionStats::myWakeups },
+        { "cerqall_transport_queued_bytes", "Bytes in the outbound queues.", "gauge", &ConnectionStats::myQueuedBytes }
+    };
+    for (const ConnectionMetric& m : connectionMetrics) {
+        out += std::string("# HELP ") + m.myName + " " + m.myHelp + "\n# TYPE " + m.myName + " " + m.myType + "\n";
+        for (const auto& kind : byKind) {
+            add_sample(out, m.myName, "transport=\"" + kind.first + "\"", std::to_string(kind.second.first.*m.myField));
+        }
+    }
+    out += "# HELP cerqall_transport_connections Open connections.\n# TYPE cerqall_transport_connections gauge\n";
+    for (const auto& kind : byKind) {
+        add_sample(out, "cerqall_transport_connections", "transport=\"" + kind.first + "\"",
+                   std::to_string(kind.second.second));
+    }
+
+    std::lock_guard<std::mutex> lock(myMutex);
+    for (const auto& entry : myFamilies) {
+        const std::string& name = entry.first;
+        const Family& family = entry.second;
+        out += "# HELP " + name + " " + family.myHelp + "\n# TYPE " + name + " " + family.myType + "\n";
+        for (const auto& counter : family.myCounters) {
+            add_sample(out, name, counter.first, std::to_string(counter.second->value()));
+        }
+        for (const auto& histogram : family.myHistograms) {
+            const std::string& labels = histogram.first;
+            const std::string sep = labels.empty() ? "" : ",";
+            uint64_t cumulative = 0u;
+            for (int b = 0; b <= Histogram::Buckets; ++b) {
+                cumulative += histogram.second->count(b);
+                std::string le = b < Histogram::Buckets ? number(Histogram::upper_bound_sec(b)) : "+Inf";
+                add_sample(out, name + "_bucket", labels + sep + "le=\"" + le + "\"", std::to_string(cumulative));
+            }
+            add_sample(out, name + "_sum", labels, number(histogram.second->sum_ns() * 1e-9));
+            add_sample(out, name + "_count", labels, std::to_string(cumulative));
+        }
+    }
+    return out;
+}
+
+#else   //CERQALL_NO_METRICS
+
+class Counter
+{
+public:
+    void add(uint64_t = 1u) {}
+
+    uint64_t value() const
+    {
+        return 0u;
+    }
+};
+
+class Histogram
+{
+public:
+    void record(std::chrono::nanoseconds) {}
+};
+
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(Histogram*) {}
+
+    ~ScopedTimer() {}
+};
+
+class Registry
+{
+public:
+    static Registry& global()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    Counter& counter(const std::string&, const std::string&, const std::string& = std::string())
+    {
+        static Counter counter;
+        return counter;
+    }
+
+    Histogram& histogram(const std::string&, const std::string&, const std::string& = std::string())
+    {
+        static Histogram histogram;
+        return histogram;
+    }
+
+    ConnectionStats connections(const std::string&, size_t* live = nullptr) const
+    {
+        if (live != nullptr) {
+            *live = 0u;
+        }
+        return ConnectionStats {};
+    }
+
+    std::string prometheus() const
+    {
+        return std::string();
+    }
+};
+
+class ConnectionMetrics
+{
+public:
+    explicit ConnectionMetrics(const char*, Registry& = Registry::global()) {}
+
+    void wakeup() {}
+
+    void frame_in(size_t) {}
+
+    void frame_out(size_t) {}
+
+    void frame_conflated() {}
+
+    void frames_dropped(uint64_t) {}
+
+    void queued(size_t) {}
+
+    ConnectionStats stats() const
+    {
+        return ConnectionStats {};
+    }
+};
+
+#endif  //CERQALL_NO_METRICS
+
+}   //namespace metrics
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_METRICS_H
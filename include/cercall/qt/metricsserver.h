@@ -0,0 +1,86 @@
+/*!
+ * \file
+ * \brief     CerQall HTTP endpoint exporting the runtime metrics
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_METRICSSERVER_H
+#define CERCALL_QT_METRICSSERVER_H
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include "cercall/qt/metrics.h"
+
+namespace cercall {
+namespace qt {
+
+/**
+ * Answers every HTTP request with the metrics of a registry in the Prometheus text format, so that they
+ * can be scraped or just fetched with curl. It should listen on a local address only. The metrics are
+ * collected on the thread of the server, which need not be one of the threads doing the work.
+ */
+class MetricsServer
+{
+public:
+    explicit MetricsServer(metrics::Registry& registry = metrics::Registry::global()) : myRegistry(registry)
+    {
+        QObject::connect(&myServer, &QTcpServer::newConnection, [this]() {
+            while (QTcpSocket* sock = myServer.nextPendingConnection()) {
+                serve(sock);
+            }
+        });
+    }
+
+    bool listen(const QHostAddress& address = QHostAddress::LocalHost, quint16 port = 0)
+    {
+        return myServer.listen(address, port);
+    }
+
+    quint16 port() const
+    {
+        return myServer.serverPort();
+    }
+
+    QString error_string() const
+    {
+        return myServer.errorString();
+    }
+
+private:
+    metrics::Registry& myRegistry;
+    QTcpServer myServer;
+
+    static constexpr int RequestTimeoutMs = 5000;
+
+    /**
+     * Answers once the request header is in; its contents do not matter.
+     */
+    void serve(QTcpSocket* sock)
+    {
+        QObject::connect(sock, &QTcpSocket::disconnected, sock, &QObject::deleteLater);
+        QObject::connect(sock, &QTcpSocket::readyRead, sock, [this, sock]() {
+            if (sock->property("answered").toBool() || !sock->peek(64 * 1024).contains("\r\n\r\n")) {
+                return;
+            }
+            sock->setProperty("answered", true);
+            sock->readAll();
+            const std::string body = myRegistry.prometheus();
+            QByteArray response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                    + QByteArray::number(static_cast<qulonglong>(body.size())) + "\r\nConnection: close\r\n\r\n";
+            response.append(body.data(), static_cast<int>(body.size()));
+            sock->write(response);
+            sock->disconnectFromHost();
+        });
+        QTimer::singleShot(RequestTimeoutMs, sock, [sock]() { sock->abort(); });
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_METRICSSERVER_H
@@ -0,0 +1,454 @@
+/*!
+ * \file
+ * \brief     CerQall UDP multicast Transport for Qt
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_MULTICASTTRANSPORT_H
+#define CERCALL_QT_MULTICASTTRANSPORT_H
+
+#include <QNetworkInterface>
+#include <QTimer>
+#include <QUdpSocket>
+#include <QtEndian>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include "cercall/transport.h"
+#include "cercall/qt/error.h"
+#include "cercall/qt/broadcastscope.h"
+#include "cercall/qt/metrics.h"
+#include "cercall/log.h"
+
+namespace cercall {
+namespace qt {
+
+/**
+ * Options of the sockets of MulticastTransports.
+ */
+struct MulticastOptions
+{
+    int myTimeToLive = 1;               //!< IP_MULTICAST_TTL; 1 keeps the datagrams on the LAN segment.
+    bool myLoopback = true;             //!< IP_MULTICAST_LOOP, for receivers on the sending host.
+    QNetworkInterface myInterface;      //!< Interface of the group, invalid for the system default.
+    int myReceiveBufferSize = 0;        //!< SO_RCVBUF of receivers in bytes, 0 for the system default.
+    std::chrono::milliseconds myKeepaliveInterval { 1000 };    //!< Of senders, 0 for no keepalives.
+
+    /**
+     * Options which keep the group on the loopback interface, for tests and benchmarks on one host.
+     */
+    static MulticastOptions loopback()
+    {
+        MulticastOptions options;
+        for (const QNetworkInterface& iface : QNetworkInterface::allInterfaces()) {
+            if (iface.flags().testFlag(QNetworkInterface::IsLoopBack)) {
+                options.myInterface = iface;
+                break;
+            }
+        }
+        return options;
+    }
+};
+
+/**
+ * One-way transport of messages to a UDP multicast group, for events which many clients on the same network
+ * want and which may get lost, such as the state of something sent at regular intervals. A sender sends every
+ * message written to it as one datagram, whatever the number of receivers. A receiver joins the group and
+ * delivers the messages to its listener like any other transport, so a cercall client on top of it gets the
+ * events of the service; it cannot send anything. Calls and their results stay on a connected transport.
+ *
+ * Every datagram starts with a header holding the session of the sender, chosen at random, and a sequence
+ * number. A receiver drops datagrams which come late or twice, and counts the sequence numbers it has not
+ * seen as missed, so that the client can tell how reliable the channel is and fall back to the events of its
+ * connected transport. There must be a single sender per group and port; a new session restarts the count.
+ *
+ * A sender which has sent nothing during a keepalive interval sends a keepalive datagram, with the sequence
+ * number of its next message. Receivers thus hear from a sender which has nothing to say, and notice the loss
+ * of the last messages before a quiet period.
+ *
+ * A message is sent only if it fits in a datagram; messages bigger than the MTU of the network are sent in
+ * IP fragments, and lost as a whole if a fragment is.
+ */
+class MulticastTransport : public Transport
+{
+public:
+    enum class Role
+    {
+        Sender,
+        Receiver
+    };
+
+    static constexpr uint32_t Magic = 0x43514d43u;     //"CQMC"
+    static constexpr uint32_t KeepaliveMagic = 0x43514b41u;    //"CQKA", a header without a message.
+    static constexpr size_t HeaderSize = 16u;           //Magic, session and sequence number, big-endian.
+    static constexpr size_t MaxMessageSize = 65507u - HeaderSize;
+
+    /**
+     * Called by a receiver with the first sequence number and the number of messages it has missed.
+     */
+    using GapHandler = std::function<void(uint64_t first, uint64_t count)>;
+
+    MulticastTransport(Role role, const QHostAddress& group, quint16 port,
+                       const MulticastOptions& options = MulticastOptions {})
+        : myRole(role), myGroup(group), myPort(port), myOptions(options), mySession(std::random_device {}())
+    {
+        QObject::connect(&mySocket, &QUdpSocket::readyRead, [this]() { notify_incoming_data(); });
+        QObject::connect(&myKeepaliveTimer, &QTimer::timeout, [this]() { keepalive(); });
+    }
+
+    MulticastTransport(const MulticastTransport&) = delete;
+    MulticastTransport& operator=(const MulticastTransport&) = delete;
+
+    ~MulticastTransport()
+    {
+        close();
+    }
+
+    bool is_open() override
+    {
+        return myOpen;
+    }
+
+    /**
+     * Binds the socket; a receiver binds to the port of the group, shared with the other receivers on the
+     * host, and joins the group. Does not block.
+     */
+    bool open() override
+    {
+        if (myOpen) {
+            return true;
+        }
+        const bool ipv4 = myGroup.protocol() == QAbstractSocket::IPv4Protocol;
+        const QHostAddress any(ipv4 ? QHostAddress::AnyIPv4 : QHostAddress::AnyIPv6);
+        bool ok = false;
+        if (myRole == Role::Sender) {
+            ok = mySocket.bind(any, 0);
+            if (ok) {
+                mySocket.setSocketOption(QAbstractSocket::MulticastTtlOption, myOptions.myTimeToLive);
+                mySocket.setSocketOption(QAbstractSocket::MulticastLoopbackOption, myOptions.myLoopback ? 1 : 0);
+                if (myOptions.myInterface.isValid()) {
+                    mySocket.setMulticastInterface(myOptions.myInterface);
+                }
+            }
+        } else {
+            ok = mySocket.bind(any, myPort, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint);
+            if (ok && myOptions.myReceiveBufferSize > 0) {
+                mySocket.setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, myOptions.myReceiveBufferSize);
+            }
+            ok = ok && (myOptions.myInterface.isValid() ? mySocket.joinMulticastGroup(myGroup, myOptions.myInterface)
+                                                        : mySocket.joinMulticastGroup(myGroup));
+        }
+        if ( !ok) {
+            Error err { mySocket.error(), mySocket.errorString().toStdString() };
+            log<error>(O_LOG_TOKEN, "cannot open multicast socket - %s", err.message().c_str());
+            mySocket.abort();
+            if (myListener != nullptr) {
+                myListener->on_connection_error(*this, err);
+            }
+            return false;
+        }
+        myOpen = true;
+        if (myRole == Role::Sender && myOptions.myKeepaliveInterval.count() > 0) {
+            myKeepaliveTimer.start(static_cast<int>(myOptions.myKeepaliveInterval.count()));
+        }
+        if (myListener != nullptr) {
+            myListener->on_connected(*this);
+        }
+        return true;
+    }
+
+    void open(const cercall::Closure<bool>& cl) override
+    {
+        if (myOpen) {
+            cl(Result<bool> { false, Error { QAbstractSocket::UnknownSocketError, "Socket is already open" } });
+            return;
+        }
+        bool ok = open();
+        cl(Result<bool> { ok, ok ? Error {} : Error { mySocket.error(), mySocket.errorString().toStdString() } });
+    }
+
+    void close() override
+    {
+        if ( !myOpen) {
+            return;
+        }
+        myOpen = false;
+        myKeepaliveTimer.stop();
+        if (myRole == Role::Receiver) {
+            mySocket.leaveMulticastGroup(myGroup);
+        }
+        mySocket.close();
+        myInbox.clear();
+        myInboxPos = 0u;
+        myReadLength = 0u;
+        if (myListener != nullptr) {
+            myListener->on_disconnected(*this);
+        }
+    }
+
+    /**
+     * Records the length of the next message part to deliver. Senders have nothing to read.
+     */
+    void read(uint32_t len) override
+    {
+        o_assert(len > 0);
+        if ( !myOpen) {
+            throw std::runtime_error("cercall::qt::MulticastTransport: cannot read from a closed transport");
+        }
+        myReadLength = len;
+    }
+
+    const std::string& get_read_data() override
+    {
+        const size_t available = myInbox.size() - myInboxPos;
+        if (myReadLength > 0u && available > 0u) {
+            const size_t n = std::min<size_t>(myReadLength, available);
+            myReadData.assign(myInbox, myInboxPos, n);
+            myInboxPos += n;
+            myReadLength = 0u;
+            ++myReadCount;
+            myMetrics.frame_in(n);
+        } else {
+            myReadData.clear();
+            log<error>(O_LOG_TOKEN, "no data to read");
+        }
+        return myReadData;
+    }
+
+    /**
+     * Sends the message as one datagram. Within a BroadcastScope the message is sent only if the scope wants
+     * this transport. A message which cannot be sent still takes a sequence number, so that the receivers
+     * count it as missed.
+     */
+    Error write(const std::string& msg) override
+    {
+        if (BroadcastScope* broadcast = BroadcastScope::active()) {
+            if ( !broadcast->wants(*this)) {
+                return Error {};
+            }
+        }
+        if (myRole != Role::Sender || !myOpen) {
+            return write_error(QAbstractSocket::OperationError,
+                               myOpen ? "Multicast receivers cannot send" : "Socket is not open");
+        }
+        const uint64_t sequence = mySequence++;
+        if (msg.size() > MaxMessageSize) {
+            return write_error(QAbstractSocket::DatagramTooLargeError, "Message too large for a datagram");
+        }
+        myDatagram.resize(HeaderSize + msg.size());
+        put_header(Magic, sequence);
+        std::copy(msg.begin(), msg.end(), myDatagram.begin() + HeaderSize);
+        mySentSinceKeepalive = true;
+        if (mySocket.writeDatagram(myDatagram.data(), static_cast<qint64>(myDatagram.size()), myGroup, myPort) < 0) {
+            return write_error(mySocket.error(), mySocket.errorString().toStdString());
+        }
+        myMetrics.frame_out(msg.size());
+        return Error {};
+    }
+
+    void set_gap_handler(GapHandler handler)
+    {
+        myGapHandler = std::move(handler);
+    }
+
+    Role role() const
+    {
+        return myRole;
+    }
+
+    /**
+     * Messages sent by a sender, or delivered by a receiver.
+     */
+    uint64_t messages() const
+    {
+        return myRole == Role::Sender ? mySequence - 1u : myReceived;
+    }
+
+    /**
+     * Datagrams a receiver has accepted from the sender, messages and keepalives.
+     */
+    uint64_t datagrams() const
+    {
+        return myReceived + myKeepalives;
+    }
+
+    /**
+     * Messages a receiver has not got, by the sequence numbers, since it joined the session of the sender.
+     */
+    uint64_t missed() const
+    {
+        return myMissed;
+    }
+
+    /**
+     * Datagrams a receiver has dropped because they came late or twice, or were not sent by a MulticastTransport.
+     */
+    uint64_t discarded() const
+    {
+        return myDiscarded;
+    }
+
+    /**
+     * Counters of the messages and bytes sent or delivered, and of the readyRead notifications.
+     */
+    const metrics::ConnectionMetrics& metrics() const
+    {
+        return myMetrics;
+    }
+
+private:
+    const Role myRole;
+    QHostAddress myGroup;
+    quint16 myPort;
+    MulticastOptions myOptions;
+    QUdpSocket mySocket;
+    bool myOpen = false;
+    GapHandler myGapHandler;
+    QTimer myKeepaliveTimer;
+    bool mySentSinceKeepalive = false;
+
+    uint32_t mySession;                 //Of this sender, or of the sender a receiver has heard last.
+    uint64_t mySequence = 1u;           //The next one to send, or to receive.
+    bool myInSession = false;
+    uint64_t myReceived = 0u;
+    uint64_t myKeepalives = 0u;
+    uint64_t myMissed = 0u;
+    uint64_t myDiscarded = 0u;
+
+    std::string myDatagram;
+    std::string myInbox;                //Messages received and not read yet, from myInboxPos.
+    size_t myInboxPos = 0u;
+    std::string myReadData;
+    uint32_t myReadLength = 0u;
+    uint64_t myReadCount = 0u;
+    metrics::ConnectionMetrics myMetrics { "multicast" };
+
+    Error write_error(int code, const std::string& message)
+    {
+        Error err { code, message };
+        log<error>(O_LOG_TOKEN, "write error - %s", err.message().c_str());
+        return err;
+    }
+
+    void put_header(uint32_t magic, uint64_t sequence)
+    {
+        qToBigEndian(magic, &myDatagram[0]);
+        qToBigEndian(mySession, &myDatagram[4]);
+        qToBigEndian(sequence, &myDatagram[8]);
+    }
+
+    /**
+     * Sends a keepalive if no message went out since the last one.
+     */
+    void keepalive()
+    {
+        if ( !mySentSinceKeepalive) {
+            myDatagram.resize(HeaderSize);
+            put_header(KeepaliveMagic, mySequence);
+            if (mySocket.writeDatagram(myDatagram.data(), static_cast<qint64>(HeaderSize), myGroup, myPort) < 0) {
+                log<error>(O_LOG_TOKEN, "keepalive error - %s", [this]() { return mySocket.errorString(); });
+            }
+        }
+        mySentSinceKeepalive = false;
+    }
+
+    static metrics::Counter& missed_metric()
+    {
+        return metrics::Registry::global().counter("cerqall_multicast_missed_messages_total",
+                                                   "Multicast messages missed by receivers.");
+    }
+
+    /**
+     * Checks the header of a datagram; returns true if its message is the next one to deliver. A keepalive
+     * only tells which message comes next.
+     */
+    bool accept(const std::string& datagram)
+    {
+        const uint32_t magic = datagram.size() >= HeaderSize ? qFromBigEndian<quint32>(datagram.data()) : 0u;
+        const bool keepalive = magic == KeepaliveMagic && datagram.size() == HeaderSize;
+        if (magic != Magic && !keepalive) {
+            ++myDiscarded;
+            return false;
+        }
+        const uint32_t session = qFromBigEndian<quint32>(datagram.data() + 4);
+        const uint64_t sequence = qFromBigEndian<quint64>(datagram.data() + 8);
+        if ( !myInSession || session != mySession) {
+            if (myInSession) {
+                log<debug>(O_LOG_TOKEN, "new multicast session %u", session);
+            }
+            myInSession = true;
+            mySession = session;
+            mySequence = sequence;
+        }
+        if (sequence < mySequence) {
+            ++myDiscarded;
+            return false;
+        }
+        if (sequence > mySequence) {
+            const uint64_t first = mySequence;
+            myMissed += sequence - first;
+            missed_metric().add(sequence - first);
+            mySequence = sequence;
+            if (myGapHandler) {
+                myGapHandler(first, sequence - first);
+            }
+        }
+        if (keepalive) {
+            ++myKeepalives;
+            return false;
+        }
+        ++mySequence;
+        ++myReceived;
+        return true;
+    }
+
+    void receive_datagrams()
+    {
+        //The messages of all the datagrams there are get delivered together.
+        if (myInboxPos == myInbox.size()) {
+            myInbox.clear();
+            myInboxPos = 0u;
+        } else if (myInboxPos > myInbox.size() / 2u) {
+            myInbox.erase(0, myInboxPos);
+            myInboxPos = 0u;
+        }
+        while (mySocket.hasPendingDatagrams()) {
+            const qint64 size = mySocket.pendingDatagramSize();
+            myDatagram.resize(size > 0 ? static_cast<size_t>(size) : 0u);
+            const qint64 n = mySocket.readDatagram(&myDatagram[0], static_cast<qint64>(myDatagram.size()));
+            if (n < 0) {
+                break;
+            }
+            myDatagram.resize(static_cast<size_t>(n));
+            if (myRole == Role::Receiver && myOpen && accept(myDatagram)) {
+                myInbox.append(myDatagram, HeaderSize, std::string::npos);
+            }
+        }
+    }
+
+    void notify_incoming_data()
+    {
+        myMetrics.wakeup();
+        receive_datagrams();
+        //Deliver every message received, as TcpTransport does, while the listener keeps reading.
+        while (myOpen && myReadLength > 0u && myInbox.size() - myInboxPos >= myReadLength) {
+            o_assert(myListener != nullptr);
+            uint64_t readCount = myReadCount;
+            myListener->on_incoming_data(*this, myInbox.size() - myInboxPos);
+            if (myReadCount == readCount) {
+                break;
+            }
+        }
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_MULTICASTTRANSPORT_H
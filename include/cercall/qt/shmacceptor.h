@@ -0,0 +1,115 @@
+/*!
+ * \file
+ * \brief     CerQall shared memory Acceptor class for Qt
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_SHMACCEPTOR_H
+#define CERCALL_QT_SHMACCEPTOR_H
+
+#include <QCoreApplication>
+#include <QLocalServer>
+#include <stdexcept>
+#include "cercall/acceptor.h"
+#include "cercall/qt/shmtransport.h"
+
+namespace cercall {
+namespace qt {
+
+/**
+ * Acceptor of ShmTransport connections. Clients connect to the local server of the given name; every
+ * connection gets its own shared memory segment, whose key is sent to the client.
+ */
+class ShmAcceptor : public cercall::Acceptor
+{
+public:
+    static constexpr uint32_t DefaultRingCapacity = 1u << 20;
+
+    /**
+     * The ring capacity must be a power of two.
+     */
+    ShmAcceptor(const QString& serverName, uint32_t ringCapacity = DefaultRingCapacity)
+        : myServerName { serverName }, myRingCapacity { ringCapacity }, myServer {}
+    {
+        if (ringCapacity == 0u || (ringCapacity & (ringCapacity - 1u)) != 0u) {
+            throw std::invalid_argument("cercall::qt::ShmAcceptor: ring capacity must be a power of two");
+        }
+        QObject::connect(&myServer, &QLocalServer::newConnection, [this]() {
+            notify_new_connection();
+        });
+    }
+
+    bool is_open() const override
+    {
+        return myServer.isListening();
+    }
+
+    void open(int maxPendingClientConnections = -1) override
+    {
+        if (myListener == nullptr) {
+            throw std::logic_error("cercall::qt::ShmAcceptor::open(): listener is NULL");
+        }
+        if ( !is_open()) {
+            if (maxPendingClientConnections > 0) {
+                myServer.setMaxPendingConnections(maxPendingClientConnections);
+            }
+            QLocalServer::removeServer(myServerName);
+            if (!myServer.listen(myServerName)) {
+                Error err { myServer.serverError(), myServer.errorString().toStdString() };
+                myListener->on_accept_error(err);
+                return;
+            }
+        }
+    }
+
+    void close() override
+    {
+        if (is_open()) {
+            myServer.close();
+        }
+    }
+
+private:
+    QString myServerName;
+    uint32_t myRingCapacity;
+    QLocalServer myServer;
+    quint64 myConnectionCount = 0u;
+
+    void notify_new_connection()
+    {
+        if (myListener == nullptr) {
+            throw std::logic_error("cercall::qt::ShmAcceptor::notify_new_connection(): listener is NULL");
+        }
+        QLocalSocket* newClientSock = myServer.nextPendingConnection();
+        if (newClientSock == nullptr) {
+            return;
+        }
+        newClientSock->setParent(nullptr);  //cercall::Service class manages its transport objects.
+
+        QString key = QString("cerqall-%1-%2-%3").arg(myServerName).arg(QCoreApplication::applicationPid())
+                                                  .arg(++myConnectionCount);
+        std::unique_ptr<QSharedMemory> shm { new QSharedMemory(key) };
+        if ( !shm->create(static_cast<int>(details::ShmSegment::size_for(myRingCapacity)))) {
+            Error err { shm->error(), shm->errorString().toStdString() };
+            newClientSock->abort();
+            delete newClientSock;
+            myListener->on_accept_error(err);
+            return;
+        }
+        details::ShmSegment::create(shm->data(), myRingCapacity);
+
+        QByteArray keyLine = key.toUtf8() + '\n';
+        newClientSock->write(keyLine);
+        newClientSock->flush();
+        myListener->on_client_accepted(std::make_shared<ShmTransport>(newClientSock, std::move(shm)));
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif // CERCALL_QT_SHMACCEPTOR_H
@@ -0,0 +1,479 @@
+/*!
+ * \file
+ * \brief     CerQall shared memory Transport for Qt
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_SHMTRANSPORT_H
+#define CERCALL_QT_SHMTRANSPORT_H
+
+#include <QLocalSocket>
+#include <QSharedMemory>
+#include <QTimer>
+#include <deque>
+#include <new>
+#include "cercall/transport.h"
+#include "cercall/qt/error.h"
+#include "cercall/qt/broadcastscope.h"
+#include "cercall/qt/details/spscring.h"
+#include "cercall/log.h"
+
+namespace cercall {
+namespace qt {
+
+namespace details {
+
+/**
+ * Layout of the shared memory segment of a ShmTransport connection: a header and one ring per direction.
+ */
+struct ShmSegment
+{
+    static constexpr uint32_t Magic = 0x43455251u;     //"CERQ"
+
+    uint32_t myMagic;
+    uint32_t myCapacity;
+
+    static size_t aligned(size_t n)
+    {
+        return (n + 63u) & ~size_t(63u);
+    }
+
+    static size_t size_for(uint32_t capacity)
+    {
+        return aligned(sizeof(ShmSegment)) + 2u * aligned(SpscRing::size_for(capacity));
+    }
+
+    /**
+     * Constructs the header and both rings in the memory block.
+     */
+    static ShmSegment* create(void* mem, uint32_t capacity)
+    {
+        ShmSegment* seg = new (mem) ShmSegment { Magic, capacity };
+        new (seg->ring_address(0)) SpscRing(capacity);
+        new (seg->ring_address(1)) SpscRing(capacity);
+        return seg;
+    }
+
+    /**
+     * Ring 0 carries data from the client to the service, ring 1 the other way.
+     */
+    SpscRing* ring(int i)
+    {
+        return static_cast<SpscRing*>(ring_address(i));
+    }
+
+private:
+    void* ring_address(int i)
+    {
+        char* base = reinterpret_cast<char*>(this) + aligned(sizeof(ShmSegment));
+        return base + static_cast<size_t>(i) * aligned(SpscRing::size_for(myCapacity));
+    }
+};
+
+}   //namespace details
+
+/**
+ * Transport which moves data through a pair of lock-free rings in shared memory, for clients running on the
+ * same host as the service.
+ *
+ * The connection is set up over a QLocalSocket: the acceptor creates the shared memory segment and sends its
+ * key to the client. After that the local socket only carries one-byte wake-up calls, and only when the
+ * receiving side has announced that it is waiting, so a busy connection moves data without system calls.
+ * The wake-ups arrive through the Qt event loop, like the data of a TcpTransport.
+ */
+class ShmTransport : public Transport
+{
+public:
+    using SocketType = QLocalSocket*;
+
+    static constexpr size_t InitialReadCapacity = 4096u;
+
+    /**
+     * Timeout of the client-side connection set-up.
+     */
+    static constexpr int HandshakeTimeoutMs = 5000;
+
+    /**
+     * For use by the acceptor, which has created and initialized the shared memory segment.
+     */
+    ShmTransport(QLocalSocket* s, std::unique_ptr<QSharedMemory> shm)
+        : mySocket { s }, myShm { std::move(shm) }, myIsServer { true }
+    {
+        log<trace>(O_LOG_TOKEN, "socket param");
+        o_assert(s != nullptr && myShm != nullptr);
+        init();
+        s->setParent(nullptr);
+        connect_signals();
+        attach_rings();
+    }
+
+    /**
+     * For client-side connections.
+     */
+    ShmTransport(const QString& serverName) : mySocket(nullptr), myServerName(serverName), myIsServer { false }
+    {
+        log<trace>(O_LOG_TOKEN, "server name param");
+        init();
+    }
+
+    ShmTransport() = delete;
+    ShmTransport(const ShmTransport&) = delete;
+    ShmTransport& operator=(const ShmTransport&) = delete;
+    virtual ~ShmTransport()
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        close();
+    }
+
+    bool is_open() override
+    {
+        return mySocket != nullptr && mySocket->state() == QLocalSocket::ConnectedState && myRx != nullptr;
+    }
+
+    bool open() override
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        if ( !is_open()) {
+            connect_to_server();
+            if ( !mySocket->waitForConnected(HandshakeTimeoutMs)) {
+                return false;
+            }
+            while (myRx == nullptr && mySocket->state() == QLocalSocket::ConnectedState) {
+                //The key arrives through notify_incoming_data().
+                if ( !mySocket->waitForReadyRead(HandshakeTimeoutMs)) {
+                    return false;
+                }
+            }
+            return is_open();
+        } else {
+            return false;
+        }
+    }
+
+    void open(const cercall::Closure<bool>& cl) override
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        if ( !is_open()) {
+            myOpenClosure = cl;
+            connect_to_server();
+        } else {
+            Result<bool> result { false, Error { QLocalSocket::UnknownSocketError, "Socket is already connected" } };
+            cl(result);
+        }
+    }
+
+    void close() override
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        myTx = nullptr;
+        myRx = nullptr;
+        myPending.clear();
+        if (mySocket != nullptr) {
+            if (mySocket->state() == QLocalSocket::ConnectedState) {
+                log<debug>(O_LOG_TOKEN, "disconnect from server");
+                mySocket->disconnectFromServer();
+            }
+            mySocket->deleteLater();
+            mySocket = nullptr;
+        }
+        myShm.reset();
+    }
+
+    void read(uint32_t len) override
+    {
+        o_assert(len > 0);
+        if ( is_open()) {
+            myReadLength = len;
+            myReadFill = 0u;
+            myReadData.resize(len);
+            //The data may already be in the ring, in which case no wake-up is coming.
+            if ( !myDelivering && myRx->readable() > 0u && !myDeliverTimer.isActive()) {
+                myDeliverTimer.start();
+            }
+        } else {
+            throw std::runtime_error("cercall::qt::ShmTransport: cannot read from a closed transport");
+        }
+    }
+
+    const std::string& get_read_data() override
+    {
+        if (myReadLength > 0 && myReadFill == myReadLength) {
+            myReadLength = 0u;
+            myReadFill = 0u;
+            ++myReadCount;
+        } else {
+            log<error>(O_LOG_TOKEN, "no data to read");
+        }
+        return myReadData;
+    }
+
+    Error write(const std::string& msg) override
+    {
+        BroadcastScope* broadcast = BroadcastScope::active();
+        if (broadcast != nullptr && !broadcast->wants(*this)) {
+            return Error {};
+        }
+        Error result;   //no error by default
+        if ( is_open()) {
+            size_t n = myPending.empty() ? myTx->write(msg.data(), msg.size()) : 0u;
+            if (n < msg.size()) {
+                myPending.emplace_back(msg, n, std::string::npos);
+                wait_for_space();
+            }
+            if (n > 0u && myTx->take_data_request()) {
+                wake_peer();
+            }
+        } else {
+            Error err { QLocalSocket::UnknownSocketError, "Socket is not connected" };
+            result = err;
+        }
+        if ( result) {
+            log<error>(O_LOG_TOKEN, "write error - %s", result.message().c_str());
+        }
+        return result;
+    }
+
+private:
+
+    QLocalSocket* mySocket;
+    std::unique_ptr<QSharedMemory> myShm;
+    details::SpscRing* myTx = nullptr;
+    details::SpscRing* myRx = nullptr;
+    std::deque<std::string> myPending;      //Written data that did not fit in the ring yet.
+    uint32_t myReadLength = 0u;
+    uint32_t myReadFill = 0u;       //Bytes of the requested message already in myReadData.
+    std::string myReadData;
+    uint64_t myReadCount = 0u;
+    bool myDelivering = false;
+    QTimer myDeliverTimer;
+
+    QString myServerName;
+    bool myIsServer;
+    cercall::Closure<bool> myOpenClosure;
+
+    void init()
+    {
+        myReadData.reserve(InitialReadCapacity);
+        myDeliverTimer.setSingleShot(true);
+        myDeliverTimer.setInterval(0);
+        QObject::connect(&myDeliverTimer, &QTimer::timeout, [this]() { deliver(); });
+    }
+
+    void connect_to_server()
+    {
+        log<debug>(O_LOG_TOKEN, "new socket");
+        mySocket = new QLocalSocket(nullptr);
+        connect_signals();
+        log<debug>(O_LOG_TOKEN, "connect to server %s", [this]() { return myServerName; });
+        mySocket->connectToServer(myServerName);
+    }
+
+    void connect_signals()
+    {
+        QObject::connect(mySocket, &QLocalSocket::readyRead, [this]() { notify_incoming_data(); });
+        QObject::connect(mySocket, &QLocalSocket::disconnected, [this]() { notify_disconnected(); });
+        QObject::connect(mySocket, QOverload<QLocalSocket::LocalSocketError>::of(&QLocalSocket::error),
+                                         [this](QLocalSocket::LocalSocketError e) { notify_error(e); });
+    }
+
+    void attach_rings()
+    {
+        auto seg = static_cast<details::ShmSegment*>(myShm->data());
+        myTx = seg->ring(myIsServer ? 1 : 0);
+        myRx = seg->ring(myIsServer ? 0 : 1);
+    }
+
+    /**
+     * Reads the key of the shared memory segment sent by the acceptor and attaches to the segment.
+     */
+    void complete_handshake()
+    {
+        if ( !mySocket->canReadLine()) {
+            return;
+        }
+        QString key = QString::fromUtf8(mySocket->readLine()).trimmed();
+        myShm.reset(new QSharedMemory(key));
+        if ( !myShm->attach()) {
+            Error err { myShm->error(), myShm->errorString().toStdString() };
+            fail_handshake(err);
+            return;
+        }
+        auto seg = static_cast<details::ShmSegment*>(myShm->data());
+        if (seg->myMagic != details::ShmSegment::Magic
+                || myShm->size() < static_cast<int>(details::ShmSegment::size_for(seg->myCapacity))) {
+            fail_handshake(Error { QLocalSocket::UnknownSocketError, "Invalid shared memory segment" });
+            return;
+        }
+        attach_rings();
+        o_assert(myListener != nullptr);
+        log<debug>(O_LOG_TOKEN, "shared memory transport connected");
+        myListener->on_connected(*this);
+        if (myOpenClosure) {
+            myOpenClosure(Result<bool> { true });
+            myOpenClosure = nullptr;
+        }
+    }
+
+    void fail_handshake(const Error& err)
+    {
+        log<error>(O_LOG_TOKEN, "shared memory error - %s", err.message().c_str());
+        myShm.reset();
+        if (myListener != nullptr) {
+            myListener->on_connection_error(*this, err);
+        }
+        if (myOpenClosure) {
+            myOpenClosure(Result<bool> { false, err });
+            myOpenClosure = nullptr;
+        }
+        mySocket->abort();
+    }
+
+    void wake_peer()
+    {
+        if (mySocket != nullptr) {
+            char kick = 'K';
+            mySocket->write(&kick, 1);
+            mySocket->flush();
+        }
+    }
+
+    /**
+     * Called when the ring to the peer is full. The peer wakes us up once it has made room.
+     */
+    void wait_for_space()
+    {
+        myTx->want_space();
+        flush_pending();    //Room may have been made before the flag was seen.
+    }
+
+    void flush_pending()
+    {
+        size_t written = 0u;
+        while ( !myPending.empty()) {
+            std::string& front = myPending.front();
+            size_t n = myTx->write(front.data(), front.size());
+            written += n;
+            if (n < front.size()) {
+                front.erase(0, n);
+                break;
+            }
+            myPending.pop_front();
+        }
+        if (written > 0u && myTx->take_data_request()) {
+            wake_peer();
+        }
+    }
+
+    void notify_incoming_data()
+    {
+        if (mySocket == nullptr) {
+            return;
+        }
+        if (myRx == nullptr) {
+            if ( !myIsServer) {
+                complete_handshake();
+            }
+            if (myRx == nullptr) {
+                return;
+            }
+        }
+        //The wake-up calls carry no information; all there is to do is to look at both rings.
+        char kicks[64];
+        while (mySocket->read(kicks, sizeof(kicks)) > 0) {}
+        if ( !myPending.empty()) {
+            flush_pending();
+        }
+        deliver();
+    }
+
+    void deliver()
+    {
+        if (myRx == nullptr || myDelivering) {
+            return;
+        }
+        myDelivering = true;
+        while (myRx != nullptr) {
+            if ( !has_data()) {
+                //Ask for a wake-up and look again: data written before the peer saw the request has none.
+                myRx->want_data();
+                if ( !has_data()) {
+                    break;
+                }
+            }
+            o_assert(myListener != nullptr);
+            uint64_t readCount = myReadCount;
+            uint32_t readLength = myReadLength;
+            uint64_t written = myRx->written();
+            myListener->on_incoming_data(*this, myReadLength > 0u ? myReadLength : myRx->readable());
+            if ((myReadCount == readCount && myReadLength == readLength) || myReadLength == 0u) {
+                //The listener waits for more data; so must we. Data written while it ran brought no wake-up.
+                if (myRx == nullptr) {
+                    break;
+                }
+                myRx->want_data();
+                if (myRx->written() == written || !has_data()) {
+                    break;
+                }
+            }
+        }
+        myDelivering = false;
+    }
+
+    /**
+     * Returns true if there is data for the listener: any data, or the whole of the requested message.
+     */
+    bool has_data()
+    {
+        return myReadLength == 0u ? myRx->readable() > 0u : pull();
+    }
+
+    /**
+     * Moves data of the requested message from the ring into myReadData. Messages larger than the ring
+     * are assembled over several wake-ups. Returns true when the message is complete.
+     */
+    bool pull()
+    {
+        if (myReadFill < myReadLength) {
+            size_t n = myRx->read(&myReadData[myReadFill], myReadLength - myReadFill);
+            myReadFill += static_cast<uint32_t>(n);
+            if (n > 0u && myRx->take_space_request()) {
+                wake_peer();
+            }
+        }
+        return myReadFill == myReadLength;
+    }
+
+    void notify_disconnected()
+    {
+        if (mySocket != nullptr) {
+            o_assert(myListener != nullptr);
+            log<debug>(O_LOG_TOKEN, "shared memory transport disconnected");
+            myTx = nullptr;
+            myRx = nullptr;
+            myListener->on_disconnected(*this);
+        }
+    }
+
+    void notify_error(QLocalSocket::LocalSocketError e)
+    {
+        if (mySocket != nullptr) {
+            o_assert(myListener != nullptr);
+            Error err { e, mySocket->errorString().toStdString() };
+            log<error>(O_LOG_TOKEN, "local socket error - %s", err.message().c_str());
+            myListener->on_connection_error(*this, err);
+            if (myOpenClosure) {
+                myOpenClosure(Result<bool> { false, err });
+                myOpenClosure = nullptr;
+            }
+        }
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_SHMTRANSPORT_H
@@ -0,0 +1,82 @@
+/*!
+ * \file
+ * \brief     CerQall options of the sockets of TCP transports
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_SOCKETOPTIONS_H
+#define CERCALL_QT_SOCKETOPTIONS_H
+
+#include <QAbstractSocket>
+#ifdef Q_OS_UNIX
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+namespace cercall {
+namespace qt {
+
+/**
+ * Options of the sockets of TcpTransports, given to a transport or to the acceptor whose transports get them.
+ *
+ * The defaults suit request/response traffic: Nagle's algorithm is off, so that a small call or result is sent
+ * at once instead of waiting for the acknowledgment of the previous one, and keepalive probes detect dead peers
+ * of idle connections. The kernel buffer sizes and the type of service are left alone unless set. Qt can only
+ * set the options of a socket which is connected, so they are applied when the connection is established.
+ */
+struct SocketOptions
+{
+    bool myLowDelay = true;         //!< TCP_NODELAY
+    bool myKeepAlive = true;        //!< SO_KEEPALIVE
+    int mySendBufferSize = 0;       //!< SO_SNDBUF in bytes, 0 for the system default.
+    int myReceiveBufferSize = 0;    //!< SO_RCVBUF in bytes, 0 for the system default.
+    int myTypeOfService = -1;       //!< IP_TOS, for example 0x10 for low delay; -1 for the system default.
+
+    void apply(QAbstractSocket& socket) const
+    {
+        socket.setSocketOption(QAbstractSocket::LowDelayOption, myLowDelay ? 1 : 0);
+        socket.setSocketOption(QAbstractSocket::KeepAliveOption, myKeepAlive ? 1 : 0);
+        if (mySendBufferSize > 0) {
+            socket.setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, mySendBufferSize);
+        }
+        if (myReceiveBufferSize > 0) {
+            socket.setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, myReceiveBufferSize);
+        }
+        if (myTypeOfService >= 0) {
+            socket.setSocketOption(QAbstractSocket::TypeOfServiceOption, myTypeOfService);
+        }
+    }
+
+#ifdef Q_OS_UNIX
+    /**
+     * Applies the options to a socket descriptor, for the transports which do not use a Qt socket.
+     */
+    void apply(int fd) const
+    {
+        int on = myLowDelay ? 1 : 0;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        on = myKeepAlive ? 1 : 0;
+        ::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        if (mySendBufferSize > 0) {
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &mySendBufferSize, sizeof(mySendBufferSize));
+        }
+        if (myReceiveBufferSize > 0) {
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &myReceiveBufferSize, sizeof(myReceiveBufferSize));
+        }
+        if (myTypeOfService >= 0) {
+            ::setsockopt(fd, IPPROTO_IP, IP_TOS, &myTypeOfService, sizeof(myTypeOfService));
+        }
+    }
+#endif
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif // CERCALL_QT_SOCKETOPTIONS_H
@@ -11,20 +11,55 @@
 #ifndef CERCALL_QT_TCPACCEPTOR_H
 #define CERCALL_QT_TCPACCEPTOR_H
 
+#include <QElapsedTimer>
 #include <QTcpServer>
+#include <QTimer>
+#include <functional>
+#include <memory>
+#include <vector>
 #include "cercall/acceptor.h"
+#include "cercall/qt/metrics.h"
 #include "cercall/qt/tcptransport.h"
 
 namespace cercall {
 namespace qt {
 
+/**
+ * Limits of the connections a TcpAcceptor takes. Zero means no limit.
+ *
+ * The accept rate is limited with a token bucket: up to myAcceptBurst connections are taken at once, and then
+ * myAcceptRate per second on average.
+ */
+struct AdmissionControl
+{
+    int myMaxConnections = 0;       //!< Live connections accepted by the acceptor.
+    double myAcceptRate = 0.0;      //!< Connections per second.
+    int myAcceptBurst = 100;
+};
+
+/**
+ * Why a TcpAcceptor turned a connection down.
+ */
+enum class Rejection
+{
+    TooManyConnections,
+    RateLimited
+};
+
 class TcpAcceptor : public cercall::Acceptor
 {
 public:
 
-    TcpAcceptor(const QHostAddress &address = QHostAddress::Any, quint16 port = 0)
-        : myHostAddr { address }, myPort { port }, myServer {}
+    /**
+     * Called with a connection which is turned down, before it is closed. It may write a last message to it.
+     */
+    using RejectHandler = std::function<void(QTcpSocket&, Rejection)>;
+
+    TcpAcceptor(const QHostAddress &address = QHostAddress::Any, quint16 port = 0,
+                const SocketOptions& options = SocketOptions {})
+        : myHostAddr { address }, myPort { port }, mySocketOptions(options), myServer {}
     {
+        myRateClock.start();
         QObject::connect(&myServer, &QTcpServer::newConnection, [this]() {
             notify_new_connection();
         });
@@ -66,22 +101,137 @@ public:
         }
     }
 
+    /**
+     * The port listened on, useful if the acceptor was given port 0.
+     */
+    quint16 port() const
+    {
+        return myServer.serverPort();
+    }
+
+    /**
+     * Sets the socket options of the transports accepted from now on.
+     */
+    void set_socket_options(const SocketOptions& options)
+    {
+        mySocketOptions = options;
+    }
+
+    void set_admission_control(const AdmissionControl& admission)
+    {
+        myAdmission = admission;
+        myTokens = admission.myAcceptBurst;
+    }
+
+    /**
+     * Sets the function called with the connections turned down. Without one they are just closed.
+     */
+    void set_reject_handler(RejectHandler handler)
+    {
+        myRejectHandler = std::move(handler);
+    }
+
+    /**
+     * Number of live connections accepted by this acceptor.
+     */
+    int connection_count() const
+    {
+        return *myConnections;
+    }
+
+    uint64_t rejected_connections() const
+    {
+        return myRejected;
+    }
+
 private:
     QHostAddress myHostAddr;
     quint16 myPort;
+    SocketOptions mySocketOptions;
+    AdmissionControl myAdmission;
+    RejectHandler myRejectHandler;
+    std::shared_ptr<int> myConnections = std::make_shared<int>(0);
+    uint64_t myRejected = 0u;
+    double myTokens = 0.0;
+    QElapsedTimer myRateClock;
     QTcpServer myServer;
+    metrics::Counter& myAcceptedMetric = accepted_metric();
+    metrics::Counter& myTooManyMetric = rejected_metric("reason=\"connections\"");
+    metrics::Counter& myRateLimitedMetric = rejected_metric("reason=\"rate\"");
+
+    static constexpr int RejectTimeoutMs = 5000;
+
+    static metrics::Counter& accepted_metric()
+    {
+        return metrics::Registry::global().counter("cerqall_accepted_connections_total", "Connections accepted.");
+    }
+
+    static metrics::Counter& rejected_metric(const char* labels)
+    {
+        return metrics::Registry::global().counter("cerqall_rejected_connections_total",
+                                                   "Connections turned down by admission control.", labels);
+    }
 
+    /**
+     * Takes all the pending connections at once, so that none are left waiting for the next signal while
+     * clients keep connecting, then hands them to the listener.
+     */
     void notify_new_connection()
     {
         if (myListener == nullptr) {
             throw std::logic_error("cercall::qt::TcpAcceptor::notify_new_connection(): listener is NULL");
         }
-        QTcpSocket* newClientSock = myServer.nextPendingConnection();
-        if (newClientSock != nullptr) {
+        std::vector<QTcpSocket*> batch;
+        while (QTcpSocket* newClientSock = myServer.nextPendingConnection()) {
             newClientSock->setParent(nullptr);  //cercall::Service class manages its transport objects.
-            myListener->on_client_accepted(std::make_shared<TcpTransport>(newClientSock));
+            batch.push_back(newClientSock);
+        }
+        if (batch.size() > 1u) {
+            log<debug>(O_LOG_TOKEN, "%d connections", static_cast<int>(batch.size()));
+        }
+        refill_tokens();
+        for (QTcpSocket* sock : batch) {
+            if (myAdmission.myMaxConnections > 0 && *myConnections >= myAdmission.myMaxConnections) {
+                reject(sock, Rejection::TooManyConnections);
+            } else if (myAdmission.myAcceptRate > 0.0 && myTokens < 1.0) {
+                reject(sock, Rejection::RateLimited);
+            } else {
+                myTokens -= myAdmission.myAcceptRate > 0.0 ? 1.0 : 0.0;
+                std::shared_ptr<int> connections = myConnections;
+                ++*connections;
+                QObject::connect(sock, &QObject::destroyed, [connections]() { --*connections; });
+                myAcceptedMetric.add();
+                myListener->on_client_accepted(std::make_shared<TcpTransport>(sock, mySocketOptions));
+            }
+        }
+    }
+
+    void refill_tokens()
+    {
+        const double burst = std::max(myAdmission.myAcceptBurst, 1);
+        myTokens = std::min(burst, myTokens + myRateClock.restart() * myAdmission.myAcceptRate / 1000.0);
+    }
+
+    /**
+     * Closes the connection, after it has sent what the reject handler wrote to it.
+     */
+    void reject(QTcpSocket* sock, Rejection reason)
+    {
+        ++myRejected;
+        (reason == Rejection::RateLimited ? myRateLimitedMetric : myTooManyMetric).add();
+        log<debug>(O_LOG_TOKEN, "connection rejected (%d)", static_cast<int>(reason));
+        if (myRejectHandler) {
+            myRejectHandler(*sock, reason);
+        }
+        QObject::connect(sock, &QTcpSocket::disconnected, sock, &QObject::deleteLater);
+        sock->disconnectFromHost();
+        if (sock->state() != QTcpSocket::UnconnectedState) {
+            QTimer::singleShot(RejectTimeoutMs, sock, [sock]() {
+                sock->abort();
+                sock->deleteLater();
+            });
         } else {
-            //Silently ignore ?
+            sock->deleteLater();
         }
     }
 };
@@ -0,0 +1,377 @@
+/*!
+ * \file
+ * \brief     CerQall pool of TCP acceptors running on worker threads
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_TCPACCEPTORPOOL_H
+#define CERCALL_QT_TCPACCEPTORPOOL_H
+
+#include <QTcpServer>
+#include <QThread>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "cercall/acceptor.h"
+#include "cercall/qt/metrics.h"
+#include "cercall/qt/tcptransport.h"
+
+namespace cercall {
+namespace qt {
+
+class TcpAcceptorPool;
+
+/**
+ * Acceptor of one worker thread of a TcpAcceptorPool.
+ *
+ * It receives the connections which the pool assigns to its worker and creates their transports on the
+ * worker thread, so that all I/O and all listener callbacks of these connections run there. The acceptor
+ * must be created, opened and destroyed on its worker thread, normally by the service it is given to.
+ */
+class TcpWorkerAcceptor : public cercall::Acceptor
+{
+public:
+    TcpWorkerAcceptor(const TcpWorkerAcceptor&) = delete;
+    TcpWorkerAcceptor& operator=(const TcpWorkerAcceptor&) = delete;
+    ~TcpWorkerAcceptor();
+
+    bool is_open() const override
+    {
+        return myOpen;
+    }
+
+    void open(int = -1) override;
+
+    void close() override;
+
+    /**
+     * Number of live connections accepted by this worker.
+     */
+    int connection_count() const
+    {
+        return myConnections->load();
+    }
+
+private:
+    friend class TcpAcceptorPool;
+
+    TcpAcceptorPool& myPool;
+    int myIndex;
+    QObject myContext;      //Used to run calls on the worker thread.
+    bool myOpen = false;
+    std::shared_ptr<std::atomic<int>> myConnections;
+    std::vector<qintptr> myPendingFds;  //Dispatched to the worker, not accepted yet. Guarded by the pool mutex.
+
+    TcpWorkerAcceptor(TcpAcceptorPool& pool, int index, QThread* thread)
+        : myPool(pool), myIndex(index), myContext(), myConnections(std::make_shared<std::atomic<int>>(0))
+    {
+        myContext.moveToThread(thread);
+    }
+
+    void accept_pending();
+
+    void accept_descriptor(qintptr fd, const SocketOptions& options);
+
+    void notify_accept_error(const Error& err)
+    {
+        if (myListener != nullptr) {
+            myListener->on_accept_error(err);
+        }
+    }
+};
+
+/**
+ * Listens on a TCP port and distributes the accepted connections over a number of worker threads, each
+ * running its own event loop.
+ *
+ * Every worker gets its own TcpWorkerAcceptor, and therefore its own service object, so that services and
+ * their transports are only ever used from a single thread. Connections are assigned to the open worker
+ * acceptors either round-robin or to the one with the fewest live connections.
+ *
+ * All worker acceptors must be destroyed before the pool.
+ */
+class TcpAcceptorPool
+{
+public:
+    enum class Balancing
+    {
+        RoundRobin,
+        LeastLoaded
+    };
+
+    TcpAcceptorPool(int workers, const QHostAddress &address = QHostAddress::Any, quint16 port = 0,
+                    Balancing balancing = Balancing::LeastLoaded)
+        : myHostAddr { address }, myPort { port }, myBalancing { balancing }, myServer { *this }
+    {
+        if (workers <= 0) {
+            throw std::invalid_argument("cercall::qt::TcpAcceptorPool: at least one worker is needed");
+        }
+        for (int i = 0; i < workers; ++i) {
+            std::unique_ptr<QThread> thread { new QThread };
+            QObject* ctx = new QObject;
+            ctx->moveToThread(thread.get());
+            QObject::connect(thread.get(), &QThread::finished, ctx, &QObject::deleteLater);
+            thread->start();
+            myContexts.push_back(ctx);
+            myThreads.push_back(std::move(thread));
+        }
+        myAcceptors.resize(static_cast<size_t>(workers), nullptr);
+    }
+
+    TcpAcceptorPool(const TcpAcceptorPool&) = delete;
+    TcpAcceptorPool& operator=(const TcpAcceptorPool&) = delete;
+
+    ~TcpAcceptorPool()
+    {
+        close();
+        for (auto& thread : myThreads) {
+            thread->quit();
+            thread->wait();
+        }
+    }
+
+    int worker_count() const
+    {
+        return static_cast<int>(myThreads.size());
+    }
+
+    QThread* worker_thread(int i) const
+    {
+        return myThreads.at(static_cast<size_t>(i)).get();
+    }
+
+    /**
+     * Runs the function on the worker thread. If wait is true, returns after the function has completed.
+     */
+    void run_on_worker(int i, std::function<void()> fn, bool wait = false)
+    {
+        QObject* ctx = myContexts.at(static_cast<size_t>(i));
+        if (QThread::currentThread() == ctx->thread()) {
+            fn();
+        } else {
+            QMetaObject::invokeMethod(ctx, std::move(fn),
+                                      wait ? Qt::BlockingQueuedConnection : Qt::QueuedConnection);
+        }
+    }
+
+    /**
+     * Creates the acceptor of the worker. Each worker has at most one acceptor at a time.
+     */
+    std::unique_ptr<TcpWorkerAcceptor> make_acceptor(int i)
+    {
+        std::lock_guard<std::mutex> lock(myMutex);
+        if (myAcceptors.at(static_cast<size_t>(i)) != nullptr) {
+            throw std::logic_error("cercall::qt::TcpAcceptorPool::make_acceptor(): worker has an acceptor");
+        }
+        std::unique_ptr<TcpWorkerAcceptor> acceptor { new TcpWorkerAcceptor(*this, i, worker_thread(i)) };
+        myAcceptors[static_cast<size_t>(i)] = acceptor.get();
+        return acceptor;
+    }
+
+    /**
+     * Starts listening. Returns false on error, the reason is given by error_string().
+     */
+    bool listen(int maxPendingClientConnections = -1)
+    {
+        if (myServer.isListening()) {
+            return true;
+        }
+        if (maxPendingClientConnections > 0) {
+            myServer.setMaxPendingConnections(maxPendingClientConnections);
+        }
+        return myServer.listen(myHostAddr, myPort);
+    }
+
+    bool is_listening() const
+    {
+        return myServer.isListening();
+    }
+
+    void close()
+    {
+        if (myServer.isListening()) {
+            myServer.close();
+        }
+    }
+
+    QString error_string() const
+    {
+        return myServer.errorString();
+    }
+
+    /**
+     * Sets the socket options of the transports accepted from now on.
+     */
+    void set_socket_options(const SocketOptions& options)
+    {
+        std::lock_guard<std::mutex> lock(myMutex);
+        mySocketOptions = options;
+    }
+
+    quint16 port() const
+    {
+        return myServer.serverPort();
+    }
+
+private:
+    friend class TcpWorkerAcceptor;
+
+    class Server : public QTcpServer
+    {
+    public:
+        explicit Server(TcpAcceptorPool& pool) : myPool(pool) {}
+    protected:
+        void incomingConnection(qintptr fd) override
+        {
+            myPool.dispatch(fd);
+        }
+    private:
+        TcpAcceptorPool& myPool;
+    };
+
+    QHostAddress myHostAddr;
+    quint16 myPort;
+    Balancing myBalancing;
+    std::vector<std::unique_ptr<QThread>> myThreads;
+    std::vector<QObject*> myContexts;
+    std::mutex myMutex;
+    std::vector<TcpWorkerAcceptor*> myAcceptors;    //Indexed by worker, guarded by myMutex.
+    SocketOptions mySocketOptions;                  //Guarded by myMutex.
+    size_t myNextWorker = 0u;
+    Server myServer;
+
+    void dispatch(qintptr fd)
+    {
+        std::lock_guard<std::mutex> lock(myMutex);
+        TcpWorkerAcceptor* target = nullptr;
+        const size_t n = myAcceptors.size();
+        for (size_t k = 0u; k < n; ++k) {
+            TcpWorkerAcceptor* acc = myAcceptors[(myNextWorker + k) % n];
+            if (acc == nullptr || !acc->myOpen) {
+                continue;
+            }
+            if (myBalancing == Balancing::RoundRobin) {
+                target = acc;
+                break;
+            }
+            if (target == nullptr || acc->connection_count() < target->connection_count()) {
+                target = acc;
+            }
+        }
+        if (target == nullptr) {
+            log<error>(O_LOG_TOKEN, "no open worker acceptor, connection refused");
+            refuse(fd);
+            return;
+        }
+        myNextWorker = (static_cast<size_t>(target->myIndex) + 1u) % n;
+        //Counted here already, so that a burst of connections is spread over the workers.
+        ++*target->myConnections;
+        //The descriptor is kept by the acceptor, so that it is closed even if the call is dropped with it.
+        target->myPendingFds.push_back(fd);
+        QMetaObject::invokeMethod(&target->myContext, [target]() { target->accept_pending(); },
+                                  Qt::QueuedConnection);
+    }
+
+    /**
+     * Takes the descriptors which the pool has dispatched to the worker acceptor, with the socket options.
+     */
+    std::vector<qintptr> take_pending(TcpWorkerAcceptor* acceptor, SocketOptions& options)
+    {
+        std::lock_guard<std::mutex> lock(myMutex);
+        options = mySocketOptions;
+        std::vector<qintptr> fds;
+        fds.swap(acceptor->myPendingFds);
+        return fds;
+    }
+
+    /**
+     * Removes the worker acceptor from the pool. Returns the descriptors dispatched to it and not accepted.
+     */
+    std::vector<qintptr> remove(TcpWorkerAcceptor* acceptor)
+    {
+        std::lock_guard<std::mutex> lock(myMutex);
+        myAcceptors[static_cast<size_t>(acceptor->myIndex)] = nullptr;
+        std::vector<qintptr> fds;
+        fds.swap(acceptor->myPendingFds);
+        return fds;
+    }
+
+    static void refuse(qintptr fd)
+    {
+        QTcpSocket refused;
+        refused.setSocketDescriptor(fd);
+        refused.abort();
+    }
+
+    void set_open(TcpWorkerAcceptor* acceptor, bool open)
+    {
+        std::lock_guard<std::mutex> lock(myMutex);
+        acceptor->myOpen = open;
+    }
+};
+
+inline TcpWorkerAcceptor::~TcpWorkerAcceptor()
+{
+    //After this no more connections are posted to the worker. The calls already posted are dropped with
+    //myContext, so the connections they were to accept are closed here.
+    for (qintptr fd : myPool.remove(this)) {
+        --*myConnections;
+        TcpAcceptorPool::refuse(fd);
+    }
+}
+
+inline void TcpWorkerAcceptor::open(int)
+{
+    if (myListener == nullptr) {
+        throw std::logic_error("cercall::qt::TcpWorkerAcceptor::open(): listener is NULL");
+    }
+    myPool.set_open(this, true);
+}
+
+inline void TcpWorkerAcceptor::close()
+{
+    myPool.set_open(this, false);
+}
+
+inline void TcpWorkerAcceptor::accept_pending()
+{
+    SocketOptions options;
+    for (qintptr fd : myPool.take_pending(this, options)) {
+        accept_descriptor(fd, options);
+    }
+}
+
+inline void TcpWorkerAcceptor::accept_descriptor(qintptr fd, const SocketOptions& options)
+{
+    QTcpSocket* newClientSock = new QTcpSocket(nullptr);
+    if ( !newClientSock->setSocketDescriptor(fd)) {
+        --*myConnections;
+        Error err { newClientSock->error(), newClientSock->errorString().toStdString() };
+        delete newClientSock;
+        notify_accept_error(err);
+        return;
+    }
+    if ( !myOpen || myListener == nullptr) {
+        --*myConnections;
+        newClientSock->abort();
+        delete newClientSock;
+        return;
+    }
+    std::shared_ptr<std::atomic<int>> connections = myConnections;
+    QObject::connect(newClientSock, &QObject::destroyed, [connections]() { --*connections; });
+    static metrics::Counter& accepted = metrics::Registry::global().counter("cerqall_accepted_connections_total",
+                                                                             "Connections accepted.");
+    accepted.add();
+    myListener->on_client_accepted(std::make_shared<TcpTransport>(newClientSock, options));
+}
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif // CERCALL_QT_TCPACCEPTORPOOL_H
@@ -12,33 +12,54 @@
 #define CERCALL_QT_TCPTRANSPORT_H
 
 #include <QTcpSocket>
-#include "cercall/transport.h"
-#include "cercall/qt/error.h"
-#include "cercall/log.h"
+#include "cercall/qt/details/sockettransport.h"
+#include "cercall/qt/socketoptions.h"
 
 namespace cercall {
 namespace qt {
+namespace details {
 
-class TcpTransport : public Transport
+template<>
+struct SocketTraits<QTcpSocket>
 {
-public:
-    using SocketType = QTcpSocket*;
+    using SocketError = QAbstractSocket::SocketError;
+
+    static const char* kind()
+    {
+        return "tcp";
+    }
+
+    static void disconnect(QTcpSocket& s)
+    {
+        s.disconnectFromHost();
+    }
+};
+
+}   //namespace details
 
+/**
+ * Transport over a QTcpSocket. On top of details::SocketTransport, it connects to a host and port and applies
+ * the socket options to each connection.
+ */
+class TcpTransport : public details::SocketTransport<QTcpSocket>
+{
+public:
     /**
      * For use by the acceptor.
      */
-    TcpTransport(QTcpSocket* s) : mySocket { s }
+    TcpTransport(QTcpSocket* s, const SocketOptions& options = SocketOptions {})
+        : SocketTransport(s), mySocketOptions(options)
     {
-        log<trace>(O_LOG_TOKEN, "socket param");
-        o_assert(s != nullptr);
-        s->setParent(nullptr);
-        connect_signals();
+        if (state() == State::Connected) {
+            mySocketOptions.apply(*s);
+        }
     }
 
     /**
      * For client-side connections.
      */
-    TcpTransport(const QHostAddress &hostAddr, quint16 port) : mySocket(nullptr), myHostAddress(hostAddr), myPort(port)
+    TcpTransport(const QHostAddress &hostAddr, quint16 port, const SocketOptions& options = SocketOptions {})
+        : mySocketOptions(options), myHostAddress(hostAddr), myPort(port)
     {
         log<trace>(O_LOG_TOKEN, "host,port params");
     }
@@ -52,156 +73,36 @@ public:
         close();
     }
 
-    bool is_open() override
-    {
-        return mySocket != nullptr && mySocket->state() == QTcpSocket::ConnectedState;
-    }
-
-    bool open() override
-    {
-        log<trace>(O_LOG_TOKEN, "");
-        if ( !is_open()) {
-            log<debug>(O_LOG_TOKEN, "new socket");
-            mySocket = new QTcpSocket(nullptr);
-            connect_signals();
-            log<debug>(O_LOG_TOKEN, "connect to host %s:%d", myHostAddress.toString().toStdString().c_str(), myPort);
-            mySocket->connectToHost(myHostAddress, myPort);
-            return mySocket->waitForConnected(-1);
-        } else {
-            return false;
-        }
-    }
-
-    void open(const cercall::Closure<bool>& cl) override
-    {
-        log<trace>(O_LOG_TOKEN, "");
-        if ( !is_open()) {
-            log<debug>(O_LOG_TOKEN, "new socket");
-            mySocket = new QTcpSocket(nullptr);
-            connect_signals();
-            myOpenClosure = cl;
-            log<debug>(O_LOG_TOKEN, "connect to host %s:%d", myHostAddress.toString().toStdString().c_str(), myPort);
-            mySocket->connectToHost(myHostAddress, myPort);
-        } else {
-            Result<bool> result { false, Error { QAbstractSocket::UnknownSocketError, "Socket is already connected" } };
-            cl(result);
-        }
-    }
-
-    void close() override
-    {
-        log<trace>(O_LOG_TOKEN, "");
-        if (mySocket != nullptr) {
-            if (mySocket->state() == QTcpSocket::ConnectedState) {
-                log<debug>(O_LOG_TOKEN, "disconnect from host");
-                mySocket->disconnectFromHost();
-            }
-            mySocket->deleteLater();
-        }
-    }
-
-    void read(uint32_t len) override
-    {
-        o_assert(len > 0);
-        if ( is_open()) {
-            mySocket->setReadBufferSize(len);
-            myReadLength = len;
-        } else {
-            throw std::runtime_error("cercall::qt::TcpTransport: cannot read from a closed transport");
-        }
-    }
-
-    const std::string& get_read_data() override
+    /**
+     * Sets the socket options, which apply to the current connection, if any, and to the next ones.
+     */
+    void set_socket_options(const SocketOptions& options)
     {
-        if (mySocket != nullptr && myReadLength > 0) {
-            /* QIODevice has an internal buffer and offers no means to access its contents without copying data.
-            * Hence a copy of the data (into myReadData) has to be made.
-            */
-            QByteArray data = mySocket->read(myReadLength);
-            myReadData = std::string(data.constData(), data.length());
-            myReadLength = 0u;
-        } else {
-            log<error>(O_LOG_TOKEN, "no data to read");
+        mySocketOptions = options;
+        if (is_open()) {
+            mySocketOptions.apply(*socket());
         }
-        return myReadData;
     }
 
-    Error write(const std::string& msg) override
+    const SocketOptions& socket_options() const
     {
-        Error result;   //no error by default
-        if ( is_open()) {
-            if (mySocket->write(msg.data(), msg.length()) < 0) {
-                Error err { mySocket->error(), mySocket->errorString().toStdString() };
-                result = err;
-            }
-        } else {
-            Error err { QAbstractSocket::UnknownSocketError, "Socket is not connected" };
-            result = err;
-        }
-        if ( result) {
-            log<error>(O_LOG_TOKEN, "write error - %s", result.message().c_str());
-        }
-        return result;
+        return mySocketOptions;
     }
 
-
 private:
-
-    QTcpSocket* mySocket;
-    uint32_t myReadLength;
-    std::string myReadData;
-
+    SocketOptions mySocketOptions;
     QHostAddress myHostAddress;
-    quint16 myPort;
-    cercall::Closure<bool> myOpenClosure;
+    quint16 myPort = 0u;
 
-    void connect_signals()
+    void connect_socket(QTcpSocket& s) override
     {
-        QObject::connect(mySocket, &QTcpSocket::readyRead, [this]() { notify_incoming_data(); });
-        QObject::connect(mySocket, &QTcpSocket::connected, [this]() { notify_connected(); });
-        QObject::connect(mySocket, &QTcpSocket::disconnected, [this]() { notify_disconnected(); });
-        QObject::connect(mySocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error),
-                                         [this](QAbstractSocket::SocketError e) { notify_error(e); });
+        log<debug>(O_LOG_TOKEN, "connect to host %s:%d", [this]() { return myHostAddress.toString(); }, myPort);
+        s.connectToHost(myHostAddress, myPort);
     }
 
-    void notify_connected()
+    void configure_socket(QTcpSocket& s) override
     {
-        if (mySocket != nullptr) {
-            o_assert(myListener != nullptr);
-            log<debug>(O_LOG_TOKEN, "tcp socket connected");
-            myListener->on_connected(*this);
-        }
-    }
-
-    void notify_disconnected()
-    {
-        if (mySocket != nullptr) {
-            o_assert(myListener != nullptr);
-            log<debug>(O_LOG_TOKEN, "tcp socket disconnected");
-            myListener->on_disconnected(*this);
-        }
-    }
-
-    void notify_incoming_data()
-    {
-        if (mySocket != nullptr && mySocket->bytesAvailable() >= myReadLength) {
-            o_assert(myListener != nullptr);
-            myListener->on_incoming_data(*this, mySocket->bytesAvailable());
-        }
-    }
-
-    void notify_error(QAbstractSocket::SocketError e)
-    {
-        if (mySocket != nullptr) {
-            o_assert(myListener != nullptr);
-            Error err { e, mySocket->errorString().toStdString() };
-            log<error>(O_LOG_TOKEN, "tcp socket error - %s", err.message().c_str());
-            myListener->on_connection_error(*this, err);
-            if (myOpenClosure) {
-                myOpenClosure(Result<bool> { false, err });
-                myOpenClosure = nullptr;
-            }
-        }
+        mySocketOptions.apply(s);
     }
 };
 
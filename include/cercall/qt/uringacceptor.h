@@ -0,0 +1,229 @@
+/*!
+ * \file
+ * \brief     CerQall TCP Acceptor driven by io_uring
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_URINGACCEPTOR_H
+#define CERCALL_QT_URINGACCEPTOR_H
+
+#include <QTimer>
+#include "cercall/acceptor.h"
+#include "cercall/qt/uringtransport.h"
+
+namespace cercall {
+namespace qt {
+
+/**
+ * Acceptor of UringTransports. A multishot accept on the io_uring of the thread takes the connections, as many
+ * as there are per completion batch, without a system call of its own.
+ *
+ * When accepting fails, for example with EMFILE in a connection storm, the error is reported and the accept is
+ * started again after a delay, which doubles from MinRetryDelayMs up to MaxRetryDelayMs while it keeps failing.
+ */
+class UringAcceptor : public cercall::Acceptor
+{
+public:
+    static constexpr int MinRetryDelayMs = 10;
+    static constexpr int MaxRetryDelayMs = 1000;
+
+    UringAcceptor(const QHostAddress& address = QHostAddress::Any, quint16 port = 0,
+                  const SocketOptions& options = SocketOptions {})
+        : myHostAddr(address), myPort(port), mySocketOptions(options)
+    {
+    }
+
+    UringAcceptor(const UringAcceptor&) = delete;
+    UringAcceptor& operator=(const UringAcceptor&) = delete;
+
+    ~UringAcceptor()
+    {
+        close();
+    }
+
+    bool is_open() const override
+    {
+        return myListening != nullptr;
+    }
+
+    void open(int maxPendingClientConnections = -1) override
+    {
+        if (myListener == nullptr) {
+            throw std::logic_error("cercall::qt::UringAcceptor::open(): listener is NULL");
+        }
+        if (is_open()) {
+            return;
+        }
+        std::shared_ptr<details::UringLoop> loop;
+        try {
+            loop = details::UringLoop::for_current_thread();
+        } catch (const std::runtime_error& e) {
+            myListener->on_accept_error(Error { ENOSYS, e.what() });
+            return;
+        }
+        sockaddr_storage addr;
+        socklen_t len = details::to_sockaddr(myHostAddr, myPort, addr);
+        int fd = ::socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int on = 1;
+        if (fd < 0 || ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+                || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), len) < 0
+                || ::listen(fd, maxPendingClientConnections > 0 ? maxPendingClientConnections : SOMAXCONN) < 0) {
+            Error err { errno, std::strerror(errno) };
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            myListener->on_accept_error(err);
+            return;
+        }
+        len = sizeof(addr);
+        ::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+        myBoundPort = ntohs(addr.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6&>(addr).sin6_port
+                                                       : reinterpret_cast<sockaddr_in&>(addr).sin_port);
+        myListening = new Listening(std::move(loop), fd, this);
+        myListening->accept();
+    }
+
+    void close() override
+    {
+        if (myListening != nullptr) {
+            myListening->release();
+            myListening = nullptr;
+        }
+    }
+
+    /**
+     * The port listened on, useful if the acceptor was given port 0.
+     */
+    quint16 port() const
+    {
+        return is_open() ? myBoundPort : 0u;
+    }
+
+    /**
+     * Sets the socket options of the transports accepted from now on.
+     */
+    void set_socket_options(const SocketOptions& options)
+    {
+        mySocketOptions = options;
+    }
+
+private:
+
+    /**
+     * The listening socket, which outlives the acceptor until the accept operation has been cancelled.
+     */
+    class Listening : public details::UringHandler
+    {
+    public:
+        Listening(std::shared_ptr<details::UringLoop> loop, int fd, UringAcceptor* owner)
+            : myLoop(std::move(loop)), myFd(fd), myOwner(owner)
+        {
+            myRetryTimer.setSingleShot(true);
+            QObject::connect(&myRetryTimer, &QTimer::timeout, [this]() {
+                if (myOwner != nullptr) {
+                    accept();
+                }
+            });
+        }
+
+        ~Listening()
+        {
+            ::close(myFd);
+        }
+
+        void accept()
+        {
+            io_uring_sqe* sqe = myLoop->get_sqe(this, OpAccept);
+            io_uring_prep_multishot_accept(sqe, myFd, nullptr, nullptr, SOCK_CLOEXEC);
+            ++myPending;
+        }
+
+        void release()
+        {
+            myOwner = nullptr;
+            myRetryTimer.stop();
+            io_uring_prep_cancel64(myLoop->get_sqe(this, OpCancel), details::UringLoop::user_data(this, OpAccept), 0);
+            ++myPending;
+        }
+
+        void complete(int op, int res, unsigned flags) override
+        {
+            if (op == OpCancel || (flags & IORING_CQE_F_MORE) == 0u) {
+                --myPending;
+            }
+            if (op == OpAccept) {
+                bool failed = false;
+                if (res >= 0) {
+                    myRetryDelayMs = 0;
+                    if (myOwner != nullptr) {
+                        myOwner->accepted(res, myLoop);
+                    } else {
+                        ::close(res);
+                    }
+                } else if (res != -ECANCELED && myOwner != nullptr) {
+                    failed = true;
+                    myOwner->accept_error(Error { -res, std::strerror(-res) });
+                }
+                if ((flags & IORING_CQE_F_MORE) == 0u && myOwner != nullptr) {
+                    if (failed) {
+                        //Started again at once, an error such as EMFILE would repeat in a busy loop.
+                        const int delay = myRetryDelayMs > 0 ? myRetryDelayMs * 2 : MinRetryDelayMs;
+                        myRetryDelayMs = delay < MaxRetryDelayMs ? delay : MaxRetryDelayMs;
+                        myRetryTimer.start(myRetryDelayMs);
+                    } else {
+                        accept();
+                    }
+                }
+            }
+            if (myOwner == nullptr && myPending == 0) {
+                delete this;
+            }
+        }
+
+    private:
+        enum Op
+        {
+            OpAccept = 1,
+            OpCancel
+        };
+
+        std::shared_ptr<details::UringLoop> myLoop;
+        int myFd;
+        UringAcceptor* myOwner;
+        int myPending = 0;
+        QTimer myRetryTimer;
+        int myRetryDelayMs = 0;
+    };
+
+    QHostAddress myHostAddr;
+    quint16 myPort;
+    quint16 myBoundPort = 0u;
+    SocketOptions mySocketOptions;
+    Listening* myListening = nullptr;
+
+    void accepted(int fd, const std::shared_ptr<details::UringLoop>& loop)
+    {
+        if (myListener != nullptr) {
+            myListener->on_client_accepted(std::make_shared<UringTransport>(fd, loop, mySocketOptions));
+        } else {
+            ::close(fd);
+        }
+    }
+
+    void accept_error(const Error& err)
+    {
+        log<error>(O_LOG_TOKEN, "accept error - %s", err.message().c_str());
+        if (myListener != nullptr) {
+            myListener->on_accept_error(err);
+        }
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_URINGACCEPTOR_H
@@ -0,0 +1,749 @@
+/*!
+ * \file
+ * \brief     CerQall TCP Transport driven by io_uring
+ *
+ *  Copyright (c) 2018, Arthur Wisz
+ *  All rights reserved.
+ *
+ * See the LICENSE file for the license terms and conditions.
+ */
+
+#ifndef CERCALL_QT_URINGTRANSPORT_H
+#define CERCALL_QT_URINGTRANSPORT_H
+
+#include <QHostAddress>
+#include <QTimer>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <deque>
+#include <limits>
+#include "cercall/transport.h"
+#include "cercall/qt/broadcastscope.h"
+#include "cercall/qt/details/uringloop.h"
+#include "cercall/qt/metrics.h"
+#include "cercall/qt/socketoptions.h"
+#include "cercall/log.h"
+
+namespace cercall {
+namespace qt {
+
+namespace details {
+
+/**
+ * Fills the socket address for the host address and port, and returns its length.
+ */
+inline socklen_t to_sockaddr(const QHostAddress& host, quint16 port, sockaddr_storage& addr)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    if (host.protocol() == QAbstractSocket::IPv6Protocol) {
+        sockaddr_in6& in6 = reinterpret_cast<sockaddr_in6&>(addr);
+        in6.sin6_family = AF_INET6;
+        in6.sin6_port = htons(port);
+        Q_IPV6ADDR ip = host.toIPv6Address();
+        std::memcpy(&in6.sin6_addr, &ip, sizeof(in6.sin6_addr));
+        return sizeof(sockaddr_in6);
+    }
+    sockaddr_in& in = reinterpret_cast<sockaddr_in&>(addr);
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = htonl(host.toIPv4Address());
+    return sizeof(sockaddr_in);
+}
+
+}   //namespace details
+
+/**
+ * Linux TCP transport which owns its socket descriptor and does all its I/O through the io_uring of its
+ * thread, see details::UringLoop, instead of a QTcpSocket. It can take the place of TcpTransport; UringAcceptor
+ * makes the service-side ones.
+ *
+ * A multishot receive, armed once, has the kernel put the incoming data straight into the buffers registered
+ * with the ring, without a read system call per wakeup and without the buffer of a QIODevice in between.
+ * get_read_data() copies each message from there into the string it returns. Data which the listener does not
+ * read right away, such as the start of a message, is copied into a buffer of the transport, so that the receive
+ * buffers, which all the connections of the thread share, go back to the kernel at once. Written messages are
+ * kept, without copying those moved in, and the messages of all the transports of the thread are sent with one
+ * submission, each transport's with a single sendmsg operation. A closed transport still sends what was written
+ * to it, for at most LingerTimeoutMs.
+ */
+class UringTransport : public Transport
+{
+public:
+    static constexpr size_t InitialReadCapacity = 4096u;
+    static constexpr int DefaultConnectTimeoutMs = 10000;
+    static constexpr int MaxSegments = 64;
+
+    /**
+     * How long a closed transport goes on sending what was written to it, as TcpTransport does.
+     */
+    static constexpr int LingerTimeoutMs = 30000;
+
+    /**
+     * For use by the acceptor: takes over the connected socket.
+     */
+    UringTransport(int fd, std::shared_ptr<details::UringLoop> loop, const SocketOptions& options = SocketOptions {})
+        : myLoop(std::move(loop)), mySocketOptions(options)
+    {
+        init();
+        mySocketOptions.apply(fd);
+        attach(fd);
+    }
+
+    /**
+     * For client-side connections.
+     */
+    UringTransport(const QHostAddress& hostAddr, quint16 port, const SocketOptions& options = SocketOptions {})
+        : myLoop(details::UringLoop::for_current_thread()), mySocketOptions(options), myHostAddress(hostAddr),
+          myPort(port)
+    {
+        init();
+    }
+
+    UringTransport(const UringTransport&) = delete;
+    UringTransport& operator=(const UringTransport&) = delete;
+
+    virtual ~UringTransport()
+    {
+        log<trace>(O_LOG_TOKEN, "");
+        close();
+    }
+
+    bool is_open() override
+    {
+        return myConnection != nullptr && myConnection->myConnected && !myConnection->myClosing;
+    }
+
+    /**
+     * Connects and waits for the connection, at most for the connect timeout.
+     */
+    bool open() override
+    {
+        if (myConnection != nullptr) {
+            return false;
+        }
+        sockaddr_storage addr;
+        socklen_t len = details::to_sockaddr(myHostAddress, myPort, addr);
+        int fd = ::socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            connect_failed(Error { errno, std::strerror(errno) });
+            return false;
+        }
+        int err = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), len) == 0 ? 0 : errno;
+        if (err == EINPROGRESS) {
+            pollfd p { fd, POLLOUT, 0 };
+            err = ETIMEDOUT;
+            if (::poll(&p, 1, myConnectTimeoutMs) > 0) {
+                socklen_t errLen = sizeof(err);
+                ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+            }
+        }
+        if (err != 0) {
+            ::close(fd);
+            connect_failed(Error { err, std::strerror(err) });
+            return false;
+        }
+        mySocketOptions.apply(fd);
+        attach(fd);
+        notify_connected();
+        return true;
+    }
+
+    /**
+     * Starts connecting through the ring and returns. The closure gets true once the transport is connected.
+     */
+    void open(const cercall::Closure<bool>& cl) override
+    {
+        if (myConnection != nullptr) {
+            cl(Result<bool> { false, Error { EISCONN, "Transport is already open" } });
+            return;
+        }
+        sockaddr_storage addr;
+        socklen_t len = details::to_sockaddr(myHostAddress, myPort, addr);
+        int fd = ::socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            Error err { errno, std::strerror(errno) };
+            cl(Result<bool> { false, err });
+            return;
+        }
+        myOpenClosure = cl;
+        myConnection = new Connection(myLoop, fd, this);
+        myConnection->connect(addr, len);
+        myConnectTimer.start(myConnectTimeoutMs);
+    }
+
+    void close() override
+    {
+        myConnectTimer.stop();
+        myDeliverTimer.stop();
+        if (myConnection == nullptr) {
+            return;
+        }
+        const bool connected = is_open();
+        Connection* connection = myConnection;
+        myConnection = nullptr;
+        //What was written is still sent before the connection is shut down.
+        connection->release();
+        complete_open(Result<bool> { false, Error { ECANCELED, "Transport closed" } });
+        if (connected && myListener != nullptr) {
+            myListener->on_disconnected(*this);
+        }
+    }
+
+    void set_connect_timeout(std::chrono::milliseconds timeout)
+    {
+        myConnectTimeoutMs = static_cast<int>(std::max<std::chrono::milliseconds::rep>(timeout.count(), 1));
+    }
+
+    /**
+     * Bytes written and not yet sent.
+     */
+    size_t pending_bytes() const
+    {
+        return myConnection != nullptr ? myConnection->myQueuedBytes : 0u;
+    }
+
+    const metrics::ConnectionMetrics& metrics() const
+    {
+        return myMetrics;
+    }
+
+    void read(uint32_t len) override
+    {
+        o_assert(len > 0);
+        if ( !is_open()) {
+            throw std::runtime_error("cercall::qt::UringTransport: cannot read from a closed transport");
+        }
+        myReadLength = len;
+        if ( !myDelivering && myConnection->myBuffered >= len) {
+            //The data came in before it was asked for.
+            myDeliverTimer.start();
+        }
+    }
+
+    const std::string& get_read_data() override
+    {
+        if (myConnection != nullptr && myReadLength > 0u) {
+            myReadData.resize(std::min<size_t>(myReadLength, myConnection->myBuffered));
+            myConnection->take(&myReadData[0], myReadData.size());
+            myReadLength = 0u;
+            ++myReadCount;
+            myMetrics.frame_in(myReadData.size());
+        } else {
+            log<error>(O_LOG_TOKEN, "no data to read");
+        }
+        return myReadData;
+    }
+
+    /**
+     * Writes a copy of the message. Within a BroadcastScope the frame shared by the transports of the
+     * broadcast is queued instead, or nothing if the scope filters this transport out.
+     */
+    Error write(const std::string& msg) override
+    {
+        if (BroadcastScope* broadcast = BroadcastScope::active()) {
+            if ( !broadcast->wants(*this)) {
+                return Error {};
+            }
+            return enqueue(Segment(broadcast->share(msg)));
+        }
+        return enqueue(Segment(std::string(msg)));
+    }
+
+    /**
+     * Writes a message without copying it.
+     */
+    Error write(std::string&& msg)
+    {
+        return enqueue(Segment(std::move(msg)));
+    }
+
+private:
+
+    /**
+     * A queued message, owned or shared with the other transports of a broadcast.
+     */
+    class Segment
+    {
+    public:
+        explicit Segment(std::string&& s) : myOwned(std::move(s)) {}
+        explicit Segment(std::shared_ptr<const std::string> s) : myShared(std::move(s)) {}
+
+        const std::string& data() const
+        {
+            return myShared ? *myShared : myOwned;
+        }
+
+    private:
+        std::string myOwned;
+        std::shared_ptr<const std::string> myShared;
+    };
+
+    /**
+     * Part of a receive buffer holding data not read yet.
+     */
+    struct Chunk
+    {
+        unsigned myBufferId;
+        uint32_t myOffset;
+        uint32_t myLength;
+    };
+
+    enum Op
+    {
+        OpReceive = 1,
+        OpSend,
+        OpConnect
+    };
+
+    /**
+     * The socket and the operations on it. Outlives the transport until its last operation has completed,
+     * after it has sent what it was given; the socket is then closed.
+     */
+    class Connection : public details::UringHandler
+    {
+    public:
+        std::shared_ptr<details::UringLoop> myLoop;
+        int myFd;
+        UringTransport* myOwner;
+        bool myConnected = false;
+        bool myClosing = false;
+        size_t myBuffered = 0u;
+        size_t myQueuedBytes = 0u;
+
+        Connection(std::shared_ptr<details::UringLoop> loop, int fd, UringTransport* owner)
+            : myLoop(std::move(loop)), myFd(fd), myOwner(owner) {}
+
+        ~Connection()
+        {
+            myLoop->forget(this);
+            recycle_all();
+            ::close(myFd);
+        }
+
+        void connect(const sockaddr_storage& addr, socklen_t len)
+        {
+            myPeer = addr;
+            io_uring_sqe* sqe = myLoop->get_sqe(this, OpConnect);
+            io_uring_prep_connect(sqe, myFd, reinterpret_cast<const sockaddr*>(&myPeer), len);
+            ++myPending;
+        }
+
+        void start()
+        {
+            myConnecting = false;
+            myConnected = true;
+            receive();
+        }
+
+        void receive()
+        {
+            io_uring_sqe* sqe = myLoop->get_sqe(this, OpReceive);
+            io_uring_prep_recv_multishot(sqe, myFd, nullptr, 0, 0);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = details::UringLoop::BufferGroup;
+            myReceiving = true;
+            ++myPending;
+        }
+
+        void push(Segment&& segment)
+        {
+            myQueuedBytes += segment.data().size();
+            mySendQueue.push_back(std::move(segment));
+            if ( !mySendRequested) {
+                mySendRequested = true;
+                myLoop->defer(this);
+            }
+        }
+
+        /**
+         * Copies the first len bytes received into dest and gives back the buffers read to the end.
+         */
+        void take(char* dest, size_t len)
+        {
+            myBuffered -= len;
+            if (myStashPos < myStash.size()) {
+                size_t n = std::min(len, myStash.size() - myStashPos);
+                std::memcpy(dest, myStash.data() + myStashPos, n);
+                dest += n;
+                len -= n;
+                myStashPos += n;
+                if (myStashPos == myStash.size()) {
+                    myStash.clear();
+                    myStashPos = 0u;
+                }
+            }
+            while (len > 0u) {
+                Chunk& chunk = myChunks.front();
+                size_t n = std::min<size_t>(len, chunk.myLength);
+                std::memcpy(dest, myLoop->buffer(chunk.myBufferId) + chunk.myOffset, n);
+                dest += n;
+                len -= n;
+                chunk.myOffset += static_cast<uint32_t>(n);
+                chunk.myLength -= static_cast<uint32_t>(n);
+                if (chunk.myLength == 0u) {
+                    myLoop->recycle(chunk.myBufferId);
+                    myChunks.pop_front();
+                }
+            }
+        }
+
+        /**
+         * Copies the data which has not been read from the receive buffers into the stash of the connection,
+         * and gives the buffers back. A slow or partial message must not keep the buffers from the other
+         * connections of the thread.
+         */
+        void stash()
+        {
+            if (myChunks.empty()) {
+                return;
+            }
+            myStash.erase(0, myStashPos);
+            myStashPos = 0u;
+            for (const Chunk& chunk : myChunks) {
+                myStash.append(myLoop->buffer(chunk.myBufferId) + chunk.myOffset, chunk.myLength);
+            }
+            recycle_all();
+        }
+
+        /**
+         * Detaches the connection from the transport, which is going away.
+         */
+        void release()
+        {
+            myOwner = nullptr;
+            myClosing = true;
+            recycle_all();
+            myStash.clear();
+            myStashPos = 0u;
+            myBuffered = 0u;
+            if (myConnected && !mySendQueue.empty()) {
+                //The peer may not read what is left; then the socket is shut down anyway.
+                myLingerTimer.setSingleShot(true);
+                QObject::connect(&myLingerTimer, &QTimer::timeout, [this]() {
+                    log<error>(O_LOG_TOKEN, "%zu bytes not sent before the linger timeout", myQueuedBytes);
+                    myLingerExpired = true;
+                    finish();
+                });
+                myLingerTimer.start(LingerTimeoutMs);
+            }
+            if (myConnecting) {
+                io_uring_prep_cancel64(myLoop->get_sqe(this, 0), details::UringLoop::user_data(this, OpConnect), 0);
+                ++myPending;
+            }
+            finish();
+        }
+
+        void complete(int op, int res, unsigned flags) override
+        {
+            myCompleting = true;
+            switch (op) {
+                case OpReceive:
+                    received(res, flags);
+                    break;
+                case OpSend:
+                    sent(res);
+                    break;
+                case OpConnect:
+                    --myPending;
+                    myConnecting = false;
+                    if (myOwner != nullptr) {
+                        myOwner->connected(res);
+                    }
+                    break;
+                default:
+                    --myPending;     //Cancellation.
+                    break;
+            }
+            myCompleting = false;
+            finish();
+        }
+
+        void flush() override
+        {
+            mySendRequested = false;
+            send();
+        }
+
+        void resume() override
+        {
+            if ( !myClosing && myConnected && !myReceiving) {
+                receive();
+            }
+        }
+
+    private:
+        std::deque<Chunk> myChunks;
+        std::string myStash;            //Data received and not read, taken before the chunks.
+        size_t myStashPos = 0u;
+        std::deque<Segment> mySendQueue;
+        size_t myFrontOffset = 0u;      //Bytes of the first queued message already sent.
+        std::vector<iovec> myIov;
+        msghdr myMessage {};
+        sockaddr_storage myPeer {};
+        int myPending = 0;              //Operations in flight; a multishot receive counts until its last completion.
+        bool myReceiving = false;
+        bool mySending = false;
+        bool mySendRequested = false;
+        bool myConnecting = true;
+        bool myShutDown = false;
+        bool myCompleting = false;
+        bool myLingerExpired = false;
+        QTimer myLingerTimer;
+
+        void recycle_all()
+        {
+            for (const Chunk& chunk : myChunks) {
+                myLoop->recycle(chunk.myBufferId);
+            }
+            myChunks.clear();
+        }
+
+        void received(int res, unsigned flags)
+        {
+            if ((flags & IORING_CQE_F_MORE) == 0u) {
+                --myPending;
+                myReceiving = false;
+            }
+            if (res > 0 && (flags & IORING_CQE_F_BUFFER) != 0u) {
+                const unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                if (myOwner == nullptr) {
+                    myLoop->recycle(bid);
+                    return;
+                }
+                myChunks.push_back(Chunk { bid, 0u, static_cast<uint32_t>(res) });
+                myBuffered += static_cast<size_t>(res);
+                if ( !myReceiving) {
+                    receive();      //The kernel ended the multishot receive.
+                }
+                myOwner->incoming_data();
+            } else if (res == -ENOBUFS) {
+                if ( !myClosing) {
+                    myLoop->starve(this);
+                }
+            } else if (res != -ECANCELED && myOwner != nullptr && myConnected) {
+                myConnected = false;
+                myOwner->connection_lost(res == 0 ? Error {} : Error { -res, std::strerror(-res) });
+            }
+        }
+
+        void send()
+        {
+            if (mySending || mySendQueue.empty() || !myConnected || myShutDown) {
+                return;
+            }
+            myIov.clear();
+            size_t offset = myFrontOffset;
+            for (const Segment& segment : mySendQueue) {
+                const std::string& data = segment.data();
+                myIov.push_back(iovec { const_cast<char*>(data.data()) + offset, data.size() - offset });
+                offset = 0u;
+                if (myIov.size() == static_cast<size_t>(MaxSegments)) {
+                    break;
+                }
+            }
+            myMessage = msghdr {};
+            myMessage.msg_iov = myIov.data();
+            myMessage.msg_iovlen = myIov.size();
+            io_uring_sqe* sqe = myLoop->get_sqe(this, OpSend);
+            io_uring_prep_sendmsg(sqe, myFd, &myMessage, MSG_NOSIGNAL);
+            mySending = true;
+            ++myPending;
+        }
+
+        void sent(int res)
+        {
+            --myPending;
+            mySending = false;
+            if (res < 0) {
+                log<error>(O_LOG_TOKEN, "send error - %s", std::strerror(-res));
+                mySendQueue.clear();
+                myFrontOffset = myQueuedBytes = 0u;
+                if (myOwner != nullptr && myConnected) {
+                    myConnected = false;
+                    myOwner->connection_lost(Error { -res, std::strerror(-res) });
+                }
+                return;
+            }
+            size_t n = static_cast<size_t>(res);
+            myQueuedBytes -= n;
+            while (n > 0u) {
+                size_t left = mySendQueue.front().data().size() - myFrontOffset;
+                if (n < left) {
+                    myFrontOffset += n;
+                    break;
+                }
+                n -= left;
+                myFrontOffset = 0u;
+                mySendQueue.pop_front();
+            }
+            send();
+            if (myOwner != nullptr) {
+                myOwner->myMetrics.queued(myQueuedBytes);
+            }
+        }
+
+        /**
+         * Once a released connection has sent everything, or the linger timeout has expired, shuts the socket
+         * down, which ends the receive and a blocked send, and deletes itself after the last completion.
+         */
+        void finish()
+        {
+            if ( !myClosing || myCompleting) {
+                return;
+            }
+            if ( !myShutDown && (mySendQueue.empty() || !myConnected || myLingerExpired)) {
+                myLingerTimer.stop();
+                myShutDown = true;
+                myLoop->forget(this);
+                ::shutdown(myFd, SHUT_RDWR);
+            }
+            if (myShutDown && myPending == 0) {
+                delete this;
+            }
+        }
+    };
+
+    std::shared_ptr<details::UringLoop> myLoop;
+    SocketOptions mySocketOptions;
+    QHostAddress myHostAddress;
+    quint16 myPort = 0u;
+    Connection* myConnection = nullptr;
+    uint32_t myReadLength = 0u;
+    std::string myReadData;
+    uint64_t myReadCount = 0u;
+    bool myDelivering = false;
+    cercall::Closure<bool> myOpenClosure;
+    int myConnectTimeoutMs = DefaultConnectTimeoutMs;
+    QTimer myConnectTimer;
+    QTimer myDeliverTimer;
+    metrics::ConnectionMetrics myMetrics { "uring" };
+
+    void init()
+    {
+        myReadData.reserve(InitialReadCapacity);
+        myConnectTimer.setSingleShot(true);
+        QObject::connect(&myConnectTimer, &QTimer::timeout, [this]() {
+            if (myConnection != nullptr && !myConnection->myConnected) {
+                connect_failed(Error { ETIMEDOUT, "Connection timed out" });
+            }
+        });
+        myDeliverTimer.setSingleShot(true);
+        myDeliverTimer.setInterval(0);
+        QObject::connect(&myDeliverTimer, &QTimer::timeout, [this]() { deliver(); });
+    }
+
+    void attach(int fd)
+    {
+        myConnection = new Connection(myLoop, fd, this);
+        myConnection->start();
+    }
+
+    Error enqueue(Segment&& segment)
+    {
+        if ( !is_open()) {
+            Error err { ENOTCONN, "Socket is not connected" };
+            log<error>(O_LOG_TOKEN, "write error - %s", err.message().c_str());
+            return err;
+        }
+        myMetrics.frame_out(segment.data().size());
+        myConnection->push(std::move(segment));
+        myMetrics.queued(myConnection->myQueuedBytes);
+        return Error {};
+    }
+
+    void connected(int res)
+    {
+        myConnectTimer.stop();
+        if (res < 0) {
+            connect_failed(Error { -res, std::strerror(-res) });
+            return;
+        }
+        mySocketOptions.apply(myConnection->myFd);
+        myConnection->start();
+        notify_connected();
+    }
+
+    void notify_connected()
+    {
+        if (myListener != nullptr) {
+            myListener->on_connected(*this);
+        }
+        complete_open(Result<bool> { true, Error {} });
+    }
+
+    void connect_failed(const Error& err)
+    {
+        log<error>(O_LOG_TOKEN, "connect error - %s", err.message().c_str());
+        if (myConnection != nullptr) {
+            Connection* connection = myConnection;
+            myConnection = nullptr;
+            connection->release();
+        }
+        if (myListener != nullptr) {
+            myListener->on_connection_error(*this, err);
+        }
+        complete_open(Result<bool> { false, err });
+    }
+
+    void complete_open(const Result<bool>& result)
+    {
+        if (myOpenClosure) {
+            cercall::Closure<bool> cl = std::move(myOpenClosure);
+            myOpenClosure = nullptr;
+            cl(result);
+        }
+    }
+
+    void incoming_data()
+    {
+        myMetrics.wakeup();
+        deliver();
+        if (myConnection != nullptr) {
+            myConnection->stash();
+        }
+    }
+
+    /**
+     * Delivers every complete message received, as TcpTransport does; the messages written meanwhile are
+     * sent together when the connection is flushed by the loop.
+     */
+    void deliver()
+    {
+        if (myDelivering) {
+            return;
+        }
+        myDelivering = true;
+        while (myConnection != nullptr && myConnection->myBuffered >= myReadLength && myConnection->myBuffered > 0u) {
+            o_assert(myListener != nullptr);
+            uint64_t readCount = myReadCount;
+            myListener->on_incoming_data(*this, myConnection->myBuffered);
+            if (myReadCount == readCount || myReadLength == 0u || !is_open()) {
+                break;
+            }
+        }
+        myDelivering = false;
+    }
+
+    void connection_lost(const Error& err)
+    {
+        Connection* connection = myConnection;
+        myConnection = nullptr;
+        connection->release();
+        if (myListener != nullptr) {
+            if (err) {
+                log<error>(O_LOG_TOKEN, "socket error - %s", err.message().c_str());
+                myListener->on_connection_error(*this, err);
+            }
+            myListener->on_disconnected(*this);
+        }
+    }
+};
+
+}   //namespace qt
+}   //namespace cercall
+
+#endif //CERCALL_QT_URINGTRANSPORT_H